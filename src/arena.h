@@ -0,0 +1,131 @@
+#ifndef ARENAH
+#define ARENAH
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+#include <type_traits>
+
+/*
+    Arena for scene construction. Every type gets its own pool, so objects
+    of the same type sit next to each other in blocks that start small and
+    double up to block_size. Nothing is freed individually: release() runs
+    the destructors that need running and frees every block at once.
+*/
+
+class arena {
+    public:
+        arena(size_t block_bytes = 64 * 1024) : block_size(block_bytes) {}
+        ~arena() { release(); }
+        arena(const arena&) = delete;
+        arena& operator=(const arena&) = delete;
+
+        template <class T, class... Args>
+        T* make(Args&&... args) {
+            T* obj = new (allocate(pool_index<T>(), sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+            if (!std::is_trivially_destructible<T>::value)
+                cleanups.push_back(cleanup(obj, &destroy<T>));
+            return obj;
+        }
+
+        // n default-constructed elements, contiguous; meant for pointer lists
+        template <class T>
+        T* make_array(size_t n) {
+            static_assert(std::is_trivially_destructible<T>::value, "arena arrays are never destroyed");
+            T* arr = static_cast<T*>(allocate(pool_index<T>(), n * sizeof(T), alignof(T)));
+            for (size_t i = 0; i < n; i++)
+                new (arr + i) T();
+            return arr;
+        }
+
+        void release();
+
+        // bytes handed out to objects, and bytes reserved in blocks
+        size_t bytes_used() const;
+        size_t bytes_reserved() const;
+
+    private:
+        struct pool {
+            std::vector<char*> blocks;
+            std::vector<size_t> block_bytes;
+            size_t used_in_last;
+            size_t used;
+            pool() : used_in_last(0), used(0) {}
+        };
+        typedef std::pair<void*, void (*)(void*)> cleanup;
+
+        // arenas on different threads may meet their first T at once
+        static int next_pool_index() {
+            static std::atomic<int> n(0);
+            return n.fetch_add(1);
+        }
+        template <class T>
+        static int pool_index() {
+            static int i = next_pool_index();
+            return i;
+        }
+        template <class T>
+        static void destroy(void* p) {
+            static_cast<T*>(p)->~T();
+        }
+
+        void* allocate(int index, size_t bytes, size_t align);
+
+    private:
+        size_t block_size;
+        std::vector<pool> pools;
+        std::vector<cleanup> cleanups;
+};
+
+inline void* arena::allocate(int index, size_t bytes, size_t align) {
+    if (index >= int(pools.size()))
+        pools.resize(index + 1);
+    pool& p = pools[index];
+
+    size_t offset = (p.used_in_last + align - 1) & ~(align - 1);
+    if (p.blocks.empty() || offset + bytes > p.block_bytes.back()) {
+        size_t size = p.blocks.empty() ? 1024 : 2 * p.block_bytes.back();
+        if (size > block_size)
+            size = block_size;
+        if (size < bytes)
+            size = bytes;
+        char* block = static_cast<char*>(std::malloc(size));
+        if (!block)
+            throw std::bad_alloc();
+        p.blocks.push_back(block);
+        p.block_bytes.push_back(size);
+        offset = 0;
+    }
+    p.used_in_last = offset + bytes;
+    p.used += bytes;
+    return p.blocks.back() + offset;
+}
+
+inline void arena::release() {
+    for (size_t i = cleanups.size(); i > 0; i--)
+        cleanups[i-1].second(cleanups[i-1].first);
+    cleanups.clear();
+    for (size_t i = 0; i < pools.size(); i++)
+        for (size_t b = 0; b < pools[i].blocks.size(); b++)
+            std::free(pools[i].blocks[b]);
+    pools.clear();
+}
+
+inline size_t arena::bytes_used() const {
+    size_t total = 0;
+    for (size_t i = 0; i < pools.size(); i++)
+        total += pools[i].used;
+    return total;
+}
+
+inline size_t arena::bytes_reserved() const {
+    size_t total = 0;
+    for (size_t i = 0; i < pools.size(); i++)
+        for (size_t b = 0; b < pools[i].block_bytes.size(); b++)
+            total += pools[i].block_bytes[b];
+    return total;
+}
+
+#endif
@@ -3,14 +3,8 @@
 
 #include "ray.h"
 
-const double pi = 3.1415926535897932385;
-
 vec3 random_in_unit_disk() {
-    vec3 p;
-    do {
-        p = 2.0 * vec3(random_double(), random_double(), 0) - vec3(1,1,0);
-    } while (dot(p,p) >= 1.0);
-    return p;
+    return map_to_disk(random_double(), random_double());
 }
 
 class camera {
@@ -28,8 +22,12 @@ class camera {
             horizonal = 2*half_width*focus_dist*u;
             vertical = 2*half_height*focus_dist*v;
         }
-        ray get_ray(double s, double t) {
-            vec3 rd = lens_radius * random_in_unit_disk();
+        ray get_ray(double s, double t) const {
+            return get_ray(s, t, random_in_unit_disk());
+        }
+        // lens_point is a point on the unit disk, e.g. from map_to_disk
+        ray get_ray(double s, double t, const vec3& lens_point) const {
+            vec3 rd = lens_radius * lens_point;
             vec3 offset = u * rd.x() + v * rd.y();
             return ray(origin+offset, lower_left_corner + s*horizonal + t*vertical - origin - offset);
         }
@@ -0,0 +1,659 @@
+#ifndef CHUNKSH
+#define CHUNKSH
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "framebuffer.h"
+#include "hittable.h"
+#include "particles.h"
+#include "sphere.h"
+#include "stats.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CHUNKS_MMAP 1
+#endif
+
+/*
+    Streamed particle clouds, for clouds bigger than memory.
+    --make-chunks cuts a particle file (particles.h) into chunks of at
+    most 64K particles that lie close together, and builds each one's
+    BVH. It does this without holding more than one chunk: a range too
+    big for a chunk is sorted into the octants of its centres, through
+    temporary files next to the output, until every range fits.
+
+    Only the table of chunks stays in memory. The scene's BVH takes each
+    chunk's box as one entry, so rays only ask for the chunks they may
+    hit. A chunk is mapped from the file when a ray first needs it, into
+    one cache shared by every thread and every cloud. Once the cache is
+    over its budget, the least recently used chunks are unmapped. A ray
+    that needs a chunk waits for it; rays are traced a path at a time,
+    so there is no queue to hold them in, but the rays of a tile are
+    close together and mostly find their chunks already mapped.
+
+    A chunk that cannot be mapped or read is not cached: the rays that
+    wanted it miss it, the next ray tries again, and the first failure
+    of a file is reported on stderr and every one in the stats.
+
+    A chunk is stored as the arrays of its particle_set, so a mapped
+    chunk is used where it lies. That makes the file specific to the
+    layout of the machine that wrote it; the header records the layout
+    and the file is refused elsewhere.
+
+    The file is a 64-byte header ("RTPCK1", two zero bytes, then as
+    little-endian integers the layout, 1 if quantised, the number of
+    materials, the number of chunks, the particle count and the offset
+    of the table), the chunks, each starting at a multiple of 64K, and
+    the table. An entry of the table has the chunk's box as six
+    little-endian floats, its offset as a 64-bit integer, and its node
+    and particle counts as 32-bit integers. A chunk holds its nodes, its
+    particles or packed particles, and its material indices if the file
+    has more than one material.
+*/
+
+const int chunk_header_bytes = 64;
+const int chunk_entry_bytes = 40;
+const int chunk_particles = 1 << 16;
+// chunks start at multiples of this, which every page size divides
+const uint64_t chunk_align = 1 << 16;
+// deeper ranges are cut in file order, as their centres barely differ
+const int chunk_max_depth = 20;
+
+// sizes of the stored arrays and the byte order, as the header records them
+inline uint32_t chunk_layout() {
+    const uint32_t one = 1;
+    unsigned char first;
+    std::memcpy(&first, &one, 1);
+    return uint32_t(sizeof(particle_node)) | (uint32_t(sizeof(particle)) << 8) | (uint32_t(sizeof(packed_particle)) << 16)
+         | (uint32_t(first) << 24);
+}
+
+struct chunk_info {
+    float lo[3], hi[3];
+    uint64_t offset;
+    int nodes, count;
+    // index of its first particle in the cloud
+    int first;
+};
+
+inline uint64_t chunk_bytes(const chunk_info& c, bool quantized, int palette) {
+    return uint64_t(c.nodes) * sizeof(particle_node) + uint64_t(c.count) * (quantized ? sizeof(packed_particle) : sizeof(particle))
+         + (palette > 1 ? uint64_t(c.count) * sizeof(uint16_t) : 0);
+}
+
+inline uint64_t chunk_read_u64(const unsigned char* b) {
+    return uint64_t(particle_read_u32(b)) | (uint64_t(particle_read_u32(b + 4)) << 32);
+}
+
+// True if path starts like a file made with --make-chunks.
+inline bool is_chunk_file(const std::string& path) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    char magic[6];
+    return in.read(magic, sizeof(magic)) && std::memcmp(magic, "RTPCK1", 6) == 0;
+}
+
+// Appends built chunks to a file, then writes the table and header.
+class chunk_writer {
+    public:
+        chunk_writer(const std::string& path, int p) : out(path.c_str(), std::ios::binary), palette(p), total(0) {
+            out.write(std::string(chunk_header_bytes, '\0').data(), chunk_header_bytes);
+            end = chunk_header_bytes;
+        }
+        void add(particle_set& set);
+        bool finish();
+
+    private:
+        std::ofstream out;
+        int palette;
+        uint64_t end, total;
+        std::vector<chunk_info> table;
+};
+
+inline void chunk_writer::add(particle_set& set) {
+    set.build(false);
+    if (set.size() == 0)
+        return;
+    particle_view v = set.view();
+    chunk_info c;
+    vec3 lo, hi;
+    v.bounds(lo, hi);
+    for (int k = 0; k < 3; k++) {
+        c.lo[k] = float(lo[k]);
+        c.hi[k] = float(hi[k]);
+    }
+    c.offset = (end + chunk_align - 1) / chunk_align * chunk_align;
+    c.nodes = v.node_count;
+    c.count = set.size();
+    c.first = int(total);
+    out.write(std::string(size_t(c.offset - end), '\0').data(), std::streamsize(c.offset - end));
+    out.write(reinterpret_cast<const char*>(v.nodes), std::streamsize(c.nodes * sizeof(particle_node)));
+    out.write(reinterpret_cast<const char*>(v.particles), std::streamsize(c.count * sizeof(particle)));
+    if (v.materials)
+        out.write(reinterpret_cast<const char*>(v.materials), std::streamsize(c.count * sizeof(uint16_t)));
+    end = c.offset + chunk_bytes(c, false, palette);
+    total += c.count;
+    table.push_back(c);
+}
+
+inline bool chunk_writer::finish() {
+    std::string bytes;
+    for (size_t i = 0; i < table.size(); i++) {
+        for (int k = 0; k < 3; k++)
+            put_f32(bytes, table[i].lo[k]);
+        for (int k = 0; k < 3; k++)
+            put_f32(bytes, table[i].hi[k]);
+        put_u64(bytes, table[i].offset);
+        put_u32(bytes, uint32_t(table[i].nodes));
+        put_u32(bytes, uint32_t(table[i].count));
+    }
+    out.write(bytes.data(), bytes.size());
+    std::string header("RTPCK1\0\0", 8);
+    put_u32(header, chunk_layout());
+    put_u32(header, 0);
+    put_u32(header, uint32_t(palette));
+    put_u32(header, uint32_t(table.size()));
+    put_u64(header, total);
+    put_u64(header, end);
+    header.resize(chunk_header_bytes, '\0');
+    out.seekp(0);
+    out.write(header.data(), header.size());
+    return bool(out.flush());
+}
+
+// Writes the count records in at its position as chunks, cutting the
+// range into octants through files named from tmp while it is too big.
+inline bool write_chunk_range(std::istream& in, uint64_t count, const std::string& path, const std::string& tmp, int depth,
+                              int palette, chunk_writer& w, std::string& error) {
+    if (count <= uint64_t(chunk_particles) || depth >= chunk_max_depth) {
+        for (uint64_t done = 0; done < count; done += chunk_particles) {
+            particle_set set;
+            if (!set.read(in, std::min<uint64_t>(chunk_particles, count - done), palette, path, error))
+                return false;
+            w.add(set);
+        }
+        return true;
+    }
+
+    // the box of the centres, then every record into the octant of its centre
+    std::streampos start = in.tellg();
+    std::vector<unsigned char> block(size_t(particle_chunk) * particle_record_bytes);
+    double lo[3], hi[3];
+    for (int k = 0; k < 3; k++) {
+        lo[k] = std::numeric_limits<double>::infinity();
+        hi[k] = -std::numeric_limits<double>::infinity();
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        std::ofstream octants[8];
+        if (pass == 1) {
+            in.clear();
+            in.seekg(start);
+            for (int o = 0; o < 8; o++)
+                octants[o].open((tmp + char('0' + o)).c_str(), std::ios::binary);
+        }
+        for (uint64_t done = 0; done < count; ) {
+            size_t n = size_t(std::min<uint64_t>(particle_chunk, count - done));
+            if (!in.read(reinterpret_cast<char*>(block.data()), std::streamsize(n * particle_record_bytes))) {
+                error = "truncated particles " + path;
+                return false;
+            }
+            for (size_t i = 0; i < n; i++) {
+                const unsigned char* rec = &block[i * particle_record_bytes];
+                int octant = 0;
+                for (int k = 0; k < 3; k++) {
+                    double c = particle_read_float(rec + 4 * k);
+                    if (pass == 0) {
+                        lo[k] = std::min(lo[k], c);
+                        hi[k] = std::max(hi[k], c);
+                    } else if (c > 0.5 * (lo[k] + hi[k])) {
+                        octant |= 1 << k;
+                    }
+                }
+                if (pass == 1)
+                    octants[octant].write(reinterpret_cast<const char*>(rec), particle_record_bytes);
+            }
+            done += n;
+        }
+        if (pass == 0 && !(hi[0] > lo[0] || hi[1] > lo[1] || hi[2] > lo[2])) {
+            // every centre is the same point
+            in.clear();
+            in.seekg(start);
+            return write_chunk_range(in, count, path, tmp, chunk_max_depth, palette, w, error);
+        }
+        for (int o = 0; pass == 1 && o < 8; o++) {
+            if (!octants[o].flush()) {
+                error = "cannot write " + tmp + char('0' + o);
+                return false;
+            }
+        }
+    }
+    bool ok = true;
+    for (int o = 0; o < 8; o++) {
+        std::string name = tmp + char('0' + o);
+        std::ifstream part(name.c_str(), std::ios::binary | std::ios::ate);
+        uint64_t n = uint64_t(part.tellg()) / particle_record_bytes;
+        part.seekg(0);
+        ok = ok && write_chunk_range(part, n, path, name + ".", depth + 1, palette, w, error);
+        part.close();
+        std::remove(name.c_str());
+    }
+    return ok;
+}
+
+// Cuts the particle file at in_path into a chunk file at out_path.
+inline bool make_chunks(const std::string& in_path, const std::string& out_path, std::string& error) {
+    std::ifstream in(in_path.c_str(), std::ios::binary);
+    unsigned char header[particle_header_bytes];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || std::memcmp(header, "RTPTS1", 6) != 0) {
+        error = "cannot read particles " + in_path;
+        return false;
+    }
+    uint64_t count = chunk_read_u64(header + 8);
+    if (count > particle_max_count) {
+        error = "too many particles in " + in_path;
+        return false;
+    }
+    // the materials used, so a file of one material stores no indices
+    uint32_t palette = 1;
+    std::vector<unsigned char> block(size_t(particle_chunk) * particle_record_bytes);
+    for (uint64_t done = 0; done < count; ) {
+        size_t n = size_t(std::min<uint64_t>(particle_chunk, count - done));
+        if (!in.read(reinterpret_cast<char*>(block.data()), std::streamsize(n * particle_record_bytes))) {
+            error = "truncated particles " + in_path;
+            return false;
+        }
+        for (size_t i = 0; i < n; i++)
+            palette = std::max(palette, particle_read_u32(&block[i * particle_record_bytes + 16]) + 1);
+        done += n;
+    }
+    if (palette > 65536) {
+        error = "bad particle in " + in_path;
+        return false;
+    }
+    in.clear();
+    in.seekg(particle_header_bytes);
+    chunk_writer w(out_path, int(palette));
+    if (!write_chunk_range(in, count, in_path, out_path + ".part", 0, int(palette), w, error))
+        return false;
+    if (!w.finish()) {
+        error = "cannot write chunks " + out_path;
+        return false;
+    }
+    return true;
+}
+
+// a chunk in memory, unmapped when the last ray using it lets go
+class mapped_chunk {
+    public:
+        mapped_chunk() : base(0), length(0) {
+            particle_view empty = { 0, 0, 0, 0, 0 };
+            view = empty;
+        }
+        ~mapped_chunk() {
+#ifdef CHUNKS_MMAP
+            if (base)
+                munmap(base, length);
+#endif
+        }
+        mapped_chunk(const mapped_chunk&) = delete;
+        mapped_chunk& operator=(const mapped_chunk&) = delete;
+
+    public:
+        particle_view view;
+        void* base;
+        size_t length;
+        // the chunk read into memory, where it cannot be mapped
+        std::vector<uint64_t> buffer;
+};
+
+// An opened chunk file: its table, and the chunks through the cache.
+class chunked_particles {
+    public:
+        chunked_particles();
+        ~chunked_particles();
+
+        // Opens a file made with --make-chunks. Its material indices must be
+        // below palette_size. False with error otherwise.
+        bool open(const std::string& path, int palette_size, std::string& error);
+        int size() const { return chunks.empty() ? 0 : chunks.back().first + chunks.back().count; }
+        int chunk_count() const { return int(chunks.size()); }
+        const chunk_info& chunk(int c) const { return chunks[c]; }
+        size_t bytes_used() const { return chunks.capacity() * sizeof(chunk_info); }
+        uint64_t bytes_on_disk() const;
+        void bounds(vec3& lo, vec3& hi) const;
+
+        // Tests the particles of chunk c, if r meets its box. On a hit index
+        // is within the cloud, and the particle and its index into the
+        // palette are decoded while the chunk is still held. The rest as
+        // particle_view::intersect.
+        bool intersect(int c, const ray& r, double t_min, double t_max, bool any, double& t, int& index,
+                       vec3& center, double& radius, int& material, uint64_t& tests) const;
+
+        // chunk c, mapped or read; null if it cannot be. Called by the cache on a miss.
+        std::shared_ptr<mapped_chunk> load(int c) const;
+
+    private:
+        std::string path;
+        // set once a failure to load has been reported
+        mutable std::atomic<bool> warned;
+        int id;
+        bool quantized;
+        int palette;
+        std::vector<chunk_info> chunks;
+#ifdef CHUNKS_MMAP
+        int fd;
+#else
+        mutable std::mutex lock;
+        mutable std::ifstream in;
+#endif
+};
+
+class chunk_cache {
+    public:
+        static chunk_cache& global() {
+            static chunk_cache c;
+            return c;
+        }
+
+        // the most chunk data kept mapped; older chunks go first
+        void set_capacity(size_t bytes) { capacity = bytes; }
+        // an id for a newly opened file, to key its chunks by
+        int next_id() {
+            std::lock_guard<std::mutex> guard(ids_lock);
+            return ids++;
+        }
+        // chunk c of file f, loaded if it is not resident; null if it cannot be
+        std::shared_ptr<const mapped_chunk> fetch(const chunked_particles& f, int id, int c);
+        size_t bytes_resident();
+
+    private:
+        typedef std::shared_ptr<const mapped_chunk> chunk_ptr;
+        typedef std::unordered_map<uint64_t, std::pair<chunk_ptr, std::list<uint64_t>::iterator> > chunk_map;
+
+        // one part of the cache with its own lock, so threads rarely wait
+        struct shard {
+            std::mutex lock;
+            // most recent at the front
+            std::list<uint64_t> order;
+            chunk_map chunks;
+            size_t bytes;
+            shard() : bytes(0) {}
+        };
+        static const int shard_count = 16;
+
+        chunk_cache() : capacity(size_t(1024) << 20), ids(0) {}
+
+    private:
+        size_t capacity;
+        std::mutex ids_lock;
+        int ids;
+        shard shards[shard_count];
+};
+
+inline std::shared_ptr<const mapped_chunk> chunk_cache::fetch(const chunked_particles& f, int id, int c) {
+    uint64_t key = (uint64_t(id) << 32) | uint64_t(c);
+    shard& s = shards[(key ^ (key >> 32)) % shard_count];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        chunk_map::iterator it = s.chunks.find(key);
+        if (it != s.chunks.end()) {
+            s.order.splice(s.order.begin(), s.order, it->second.second);
+            count_stat(STAT_CHUNK_HITS);
+            return it->second.first;
+        }
+    }
+
+    // loaded outside the lock; two threads missing on the same chunk both
+    // map it and the second one's mapping is dropped
+    count_stat(STAT_CHUNK_MISSES);
+    std::shared_ptr<mapped_chunk> chunk = f.load(c);
+    if (!chunk) {
+        count_stat(STAT_CHUNK_FAILURES);
+        return chunk_ptr();
+    }
+    std::lock_guard<std::mutex> guard(s.lock);
+    chunk_map::iterator it = s.chunks.find(key);
+    if (it != s.chunks.end())
+        return it->second.first;
+    s.order.push_front(key);
+    s.chunks[key] = std::make_pair(chunk_ptr(chunk), s.order.begin());
+    s.bytes += chunk->length;
+    // a chunk in use elsewhere stays mapped through its shared_ptr
+    while (s.bytes > capacity / shard_count && s.order.size() > 1) {
+        chunk_map::iterator last = s.chunks.find(s.order.back());
+        s.bytes -= last->second.first->length;
+        s.chunks.erase(last);
+        s.order.pop_back();
+    }
+    return chunk;
+}
+
+inline size_t chunk_cache::bytes_resident() {
+    size_t total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        total += shards[i].bytes;
+    }
+    return total;
+}
+
+inline chunked_particles::chunked_particles() : warned(false), id(chunk_cache::global().next_id()), quantized(false), palette(1) {
+#ifdef CHUNKS_MMAP
+    fd = -1;
+#endif
+}
+
+inline chunked_particles::~chunked_particles() {
+#ifdef CHUNKS_MMAP
+    if (fd >= 0)
+        close(fd);
+#endif
+}
+
+inline bool chunked_particles::open(const std::string& file, int palette_size, std::string& error) {
+    path = file;
+    unsigned char header[chunk_header_bytes];
+    bool ok;
+#ifdef CHUNKS_MMAP
+    fd = ::open(path.c_str(), O_RDONLY);
+    ok = fd >= 0 && pread(fd, header, sizeof(header), 0) == ssize_t(sizeof(header));
+#else
+    in.open(path.c_str(), std::ios::binary);
+    ok = bool(in.read(reinterpret_cast<char*>(header), sizeof(header)));
+#endif
+    if (!ok || std::memcmp(header, "RTPCK1", 6) != 0) {
+        error = "cannot read chunks " + path + " (make them with --make-chunks)";
+        return false;
+    }
+    if (particle_read_u32(header + 8) != chunk_layout()) {
+        error = "chunks " + path + " were made on a machine of another layout";
+        return false;
+    }
+    quantized = particle_read_u32(header + 12) != 0;
+    palette = int(particle_read_u32(header + 16));
+    uint32_t count = particle_read_u32(header + 20);
+    uint64_t total = chunk_read_u64(header + 24);
+    uint64_t table = chunk_read_u64(header + 32);
+    if (palette > palette_size || total > particle_max_count) {
+        error = palette > palette_size ? "too few materials for " + path : "too many particles in " + path;
+        return false;
+    }
+    std::vector<unsigned char> bytes(size_t(count) * chunk_entry_bytes);
+#ifdef CHUNKS_MMAP
+    ok = pread(fd, bytes.data(), bytes.size(), off_t(table)) == ssize_t(bytes.size());
+#else
+    in.seekg(std::streamoff(table));
+    ok = bool(in.read(reinterpret_cast<char*>(bytes.data()), bytes.size()));
+#endif
+    chunks.resize(count);
+    int first = 0;
+    for (uint32_t c = 0; ok && c < count; c++) {
+        const unsigned char* e = &bytes[size_t(c) * chunk_entry_bytes];
+        chunk_info& info = chunks[c];
+        for (int k = 0; k < 3; k++) {
+            info.lo[k] = particle_read_float(e + 4 * k);
+            info.hi[k] = particle_read_float(e + 12 + 4 * k);
+        }
+        info.offset = chunk_read_u64(e + 24);
+        info.nodes = int(particle_read_u32(e + 32));
+        info.count = int(particle_read_u32(e + 36));
+        info.first = first;
+        first += info.count;
+        ok = info.offset % chunk_align == 0 && info.offset + chunk_bytes(info, quantized, palette) <= table && info.nodes > 0;
+    }
+    if (!ok || uint64_t(first) != total) {
+        error = "bad chunk table in " + path;
+        return false;
+    }
+    return true;
+}
+
+inline uint64_t chunked_particles::bytes_on_disk() const {
+    uint64_t total = 0;
+    for (size_t c = 0; c < chunks.size(); c++)
+        total += chunk_bytes(chunks[c], quantized, palette);
+    return total;
+}
+
+inline void chunked_particles::bounds(vec3& lo, vec3& hi) const {
+    if (chunks.empty()) {
+        lo = hi = vec3(0,0,0);
+        return;
+    }
+    for (int k = 0; k < 3; k++) {
+        lo[k] = chunks[0].lo[k];
+        hi[k] = chunks[0].hi[k];
+    }
+    for (size_t c = 1; c < chunks.size(); c++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], double(chunks[c].lo[k]));
+            hi[k] = std::max(hi[k], double(chunks[c].hi[k]));
+        }
+    }
+}
+
+inline std::shared_ptr<mapped_chunk> chunked_particles::load(int c) const {
+    const chunk_info& info = chunks[c];
+    std::shared_ptr<mapped_chunk> chunk(new mapped_chunk);
+    size_t bytes = size_t(chunk_bytes(info, quantized, palette));
+    const char* data;
+#ifdef CHUNKS_MMAP
+    // pages past the end of a file cut short since it was opened would
+    // fault when touched, so the mapping is refused instead
+    struct stat st;
+    bool whole = fstat(fd, &st) == 0 && uint64_t(st.st_size) >= info.offset + bytes;
+    void* p = whole ? mmap(0, bytes, PROT_READ, MAP_PRIVATE, fd, off_t(info.offset)) : MAP_FAILED;
+    if (p == MAP_FAILED) {
+        if (!warned.exchange(true))
+            std::cerr << "\ncannot map chunk " << c << " of " << path << ": " << (whole ? strerror(errno) : "the file was cut short")
+                      << "; its particles are missing from the rays that need it\n";
+        return std::shared_ptr<mapped_chunk>();
+    }
+    // fault the whole chunk in now rather than page by page under the rays
+    madvise(p, bytes, MADV_WILLNEED);
+    chunk->base = p;
+    data = static_cast<const char*>(p);
+#else
+    chunk->buffer.resize((bytes + 7) / 8);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        in.clear();
+        if (!in.seekg(std::streamoff(info.offset)) || !in.read(reinterpret_cast<char*>(chunk->buffer.data()), bytes)) {
+            if (!warned.exchange(true))
+                std::cerr << "\ncannot read chunk " << c << " of " << path
+                          << "; its particles are missing from the rays that need it\n";
+            return std::shared_ptr<mapped_chunk>();
+        }
+    }
+    data = reinterpret_cast<const char*>(chunk->buffer.data());
+#endif
+    chunk->length = bytes;
+    const char* particles = data + info.nodes * sizeof(particle_node);
+    const char* materials = particles + info.count * (quantized ? sizeof(packed_particle) : sizeof(particle));
+    particle_view v = { reinterpret_cast<const particle_node*>(data),
+                        quantized ? 0 : reinterpret_cast<const particle*>(particles),
+                        quantized ? reinterpret_cast<const packed_particle*>(particles) : 0,
+                        palette > 1 ? reinterpret_cast<const uint16_t*>(materials) : 0, info.nodes };
+    chunk->view = v;
+    return chunk;
+}
+
+inline bool chunked_particles::intersect(int c, const ray& r, double t_min, double t_max, bool any, double& t, int& index,
+                                         vec3& center, double& radius, int& material, uint64_t& tests) const {
+    const chunk_info& info = chunks[c];
+    double enter = t_min, leave = t_max;
+    for (int k = 0; k < 3; k++) {
+        double inv = 1 / r.direction()[k];
+        double ta = (info.lo[k] - r.origin()[k]) * inv, tb = (info.hi[k] - r.origin()[k]) * inv;
+        enter = std::max(enter, std::min(ta, tb));
+        leave = std::min(leave, std::max(ta, tb));
+    }
+    if (enter > leave)
+        return false;
+    std::shared_ptr<const mapped_chunk> chunk = chunk_cache::global().fetch(*this, id, c);
+    int leaf;
+    if (!chunk || !chunk->view.intersect(r, t_min, t_max, any, t, index, leaf, tests))
+        return false;
+    chunk->view.get(index, leaf, center, radius);
+    material = chunk->view.material(index);
+    index += info.first;
+    return true;
+}
+
+// The hittable side of a cloud: the particles, or the chunks they are
+// streamed from, shared with the compiled scene, and the materials their
+// indices pick from.
+class particle_cloud: public hittable {
+    public:
+        particle_cloud(const std::shared_ptr<const particle_set>& p, const std::vector<material*>& m) : particles(p), palette(m) {}
+        particle_cloud(const std::shared_ptr<const chunked_particles>& c, const std::vector<material*>& m) : chunks(c), palette(m) {}
+        virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void compile(scene& s) const;
+
+    public:
+        std::shared_ptr<const particle_set> particles;
+        std::shared_ptr<const chunked_particles> chunks;
+        std::vector<material*> palette;
+};
+
+bool particle_cloud::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t = t_max, radius;
+    int index = -1, material = 0;
+    uint64_t tests = 0;
+    vec3 center;
+    if (particles) {
+        int leaf;
+        if (!particles->intersect(r, t_min, t_max, false, t, index, leaf, tests))
+            return false;
+        particles->get(index, leaf, center, radius);
+        material = particles->material(index);
+    } else {
+        for (int c = 0; c < chunks->chunk_count(); c++) {
+            double found;
+            if (chunks->intersect(c, r, t_min, t, false, found, index, center, radius, material, tests))
+                t = found;
+        }
+        if (index < 0)
+            return false;
+    }
+    sphere_attributes(center, radius, r, t, rec);
+    rec.mat_ptr = palette[material];
+    return true;
+}
+
+#endif
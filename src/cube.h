@@ -1,73 +1,131 @@
 #ifndef BOXH
 #define BOXH
 
+#include <algorithm>
 #include "hittable.h"
-#include "hittable_list.h"
-#include "triangle.h"
+
+/*
+    A box: a corner and three edges leaving it, which need not line up
+    with the axes. A ray is taken into box space, where the box is the
+    unit cube, by the inverse of the edge matrix, and clipped against the
+    three slabs there; that is the cost of one ray/AABB test plus two
+    matrix-vector products. Maps of this kind keep t, so the t found in
+    box space is the t of the world ray. The face the ray crossed gives
+    the normal, the row of the inverse for its edge, without a search.
+
+    Faces are numbered by edge: face k lies at 0 along edge k and face
+    k + 3 at 1. Every face is textured with the whole unit square,
+    spanned by the box coordinates along its two other edges.
+*/
+
+// Finds t and the face crossed there; the rest of the hit is filled in by
+// box_attributes. to_local holds the rows of the inverse edge matrix.
+inline bool intersect_box(const vec3& corner, const vec3 to_local[3], const ray& r, double t_min, double t_max, double& t, int& face) {
+    vec3 o = r.origin() - corner;
+    double enter = t_min, leave = t_max;
+    int enter_face = -1, leave_face = -1;
+    for (int k = 0; k < 3; k++) {
+        double ok = dot(to_local[k], o);
+        double inverse = 1 / dot(to_local[k], r.direction());
+        double ta = -ok * inverse, tb = (1 - ok) * inverse;
+        int fa = k, fb = k + 3;
+        if (ta > tb) {
+            std::swap(ta, tb);
+            std::swap(fa, fb);
+        }
+        if (ta > enter) {
+            enter = ta;
+            enter_face = fa;
+        }
+        if (tb < leave) {
+            leave = tb;
+            leave_face = fb;
+        }
+        if (enter > leave)
+            return false;
+    }
+    // a ray that starts inside hits the face it leaves through
+    if (enter_face >= 0) {
+        t = enter;
+        face = enter_face;
+        return true;
+    }
+    if (leave_face >= 0) {
+        t = leave;
+        face = leave_face;
+        return true;
+    }
+    return false;
+}
+
+inline void box_attributes(const vec3& corner, const vec3 edge[3], const vec3 to_local[3], const ray& r, double t, int face,
+                           hit_record& rec) {
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    int k = face % 3;
+    rec.normal = unit_vector(face < 3 ? -to_local[k] : to_local[k]);
+    int a = k == 0 ? 1 : 0;
+    int b = k == 2 ? 1 : 2;
+    vec3 d = rec.p - corner;
+    rec.u = dot(to_local[a], d);
+    rec.v = dot(to_local[b], d);
+    double area = cross(edge[a], edge[b]).length();
+    rec.uv_scale = area > 0 ? 1 / sqrt(area) : 0.0;
+}
+
+// the inverse of the matrix with the edges as columns, as rows; zero if
+// the edges span no volume
+inline void box_inverse(const vec3 edge[3], vec3 to_local[3]) {
+    double det = dot(edge[0], cross(edge[1], edge[2]));
+    for (int k = 0; k < 3; k++)
+        to_local[k] = det != 0 ? cross(edge[(k + 1) % 3], edge[(k + 2) % 3]) / det : vec3(0,0,0);
+}
 
 class cube: public hittable {
     public:
         cube() {}
-        cube(vec3& p1, vec3& p2, vec3& p3, material* m) {
-            /*
-                 c4 ______ c3
-                /          /
-                p1 ______ c2
-                 c8 ______ c7
-                /          /
-                p2 ______ p3
-            */
+        // An oriented box from three corners:
+        //      p1 ______
+        //      /      /|
+        //     /______/ |
+        //    |       | /
+        //    p2 ____ p3
+        // It reaches back from p2 by the length of p2 p3, square to both edges.
+        cube(const vec3& p1, const vec3& p2, const vec3& p3, material* m) : corner(p2), mat_ptr(m) {
             vec3 up = p1 - p2;
             vec3 side = p3 - p2;
             vec3 back = unit_vector(cross(up, side));
             back *= side.length();
-            vec3 corners[8] = { p1, p1 + side, (p1 + side) + back, p1 + back, p2, p3, p3 + back, p2 + back };
-            vec3 a, b;
-            vec3 n;
-            for (int i = 0; i < 8; i++){   
-                if (i % 2 == 0)
-                {
-                    int j = i/2;
-                    int s = (5 + j < 8) ? 5 + j : 4;
-                    a = corners[s] - corners[4+j];
-                    b = corners[0+j] - corners[4+j];
-                    n = unit_vector(cross(a, b));
-                    n = (i > 1) ? -n : n;
-                    triangles[i] = new triangle(corners[0+j], corners[4+j], corners[s], n, m);
-                } else {
-                    int j = (i-1)/2;
-                    int s = (5 + j < 8) ? 5 + j : 4;
-                    int c = (1 + j < 3) ? 1 + j : 0;
-                    a = corners[0+j] - corners[(1+j) % 4];
-                    b = corners[s] - corners[(1+j) % 4];
-                    n = unit_vector(cross(a, b));
-                    n = (i > 1) ? -n : n;
-                    triangles[i] = new triangle(corners[0+j], corners[c], corners[s], n, m);
-                }
-            }
-            // top face
-            a = corners[1] - corners[0];
-            b = corners[3] - corners[0];
-            n = unit_vector(cross(a, b));
-            triangles[8] = new triangle(corners[3], corners[0], corners[1], n, m);
-            triangles[9] = new triangle(corners[3], corners[2], corners[1], n, m);
-            // bottom face
-            triangles[10] = new triangle(corners[7], corners[4], corners[5], -n, m);
-            triangles[11] = new triangle(corners[7], corners[6], corners[5], -n, m);
-            triangle_list = hittable_list(triangles, 12);
-           
-            mat_ptr = m;
+            edge[0] = side;
+            edge[1] = up;
+            edge[2] = back;
+            box_inverse(edge, to_local);
+        }
+        // an axis-aligned box between two opposite corners
+        cube(const vec3& lo, const vec3& hi, material* m) : corner(lo), mat_ptr(m) {
+            edge[0] = vec3(hi.x() - lo.x(), 0, 0);
+            edge[1] = vec3(0, hi.y() - lo.y(), 0);
+            edge[2] = vec3(0, 0, hi.z() - lo.z());
+            box_inverse(edge, to_local);
         }
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
-        
+        virtual void compile(scene& s) const;
+
     public:
-        hittable_list triangle_list;
-        hittable *triangles[12];
+        vec3 corner;
+        vec3 edge[3];
+        vec3 to_local[3];
         material *mat_ptr;
 };
 
 bool cube::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return triangle_list.hit(r, t_min, t_max, rec);
+    double t;
+    int face;
+    if (!intersect_box(corner, to_local, r, t_min, t_max, t, face))
+        return false;
+    box_attributes(corner, edge, to_local, r, t, face, rec);
+    rec.mat_ptr = mat_ptr;
+    return true;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,408 @@
+#ifndef DAEMONH
+#define DAEMONH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "render.h"
+#include "denoise.h"
+#include "scene_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define RENDER_DAEMON 1
+#endif
+
+/*
+    Render server. It listens on a UNIX socket, and each connection
+    carries one job as "key value" lines ending with an empty line:
+
+        scene default|FILE
+        width 600
+        height 300
+        spp 64
+        sampler sobol
+        denoise 0|1
+        lookfrom -3 1 5
+        lookat 0 -0.5 -1
+        vfov 40
+        aperture 0.1
+
+    Keys that are left out keep these defaults. A side may be at most
+    16384 pixels, spp at most 65536, and a job at most 16M pixels and 2^34
+    samples. The reply is "ok", a few
+    "name value" stats lines, an empty line, and then the image as a P3
+    PPM. On failure the reply is a single "error MESSAGE" line. A job that
+    is just "shutdown" stops the server once the running jobs finish.
+
+    Compiled scenes stay resident, keyed by a hash of the scene text, so a
+    job for a scene already seen skips the parse and compile. Each
+    connection is served on its own thread, but all renders share one
+    thread pool and take turns on it. A job's scene can therefore load
+    while the previous job renders; its framebuffer is only made once its
+    turn comes. At most 4 connections are served at once, and the rest
+    wait in the socket's backlog. A request that has not fully arrived
+    within 10 seconds is answered with an error.
+*/
+
+// A job can come from any client of the socket, so its size is bounded:
+// one job must not take the memory every client's renders live in.
+const int job_max_side = 16384;
+const int job_max_spp = 1 << 16;
+const int64_t job_max_pixels = int64_t(1) << 24;
+const int64_t job_max_samples = int64_t(1) << 34;
+// connections served at once, and how long a client has to send its
+// request and to take each part of the reply
+const int daemon_max_connections = 4;
+const int daemon_io_timeout_ms = 10000;
+
+// fills job from the request text; false with error on an unknown key or bad value
+inline bool parse_job(const std::string& text, render_job& job, std::string& error) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        std::istringstream in(line);
+        std::string key;
+        if (!(in >> key))
+            continue;
+        bool ok;
+        if (key == "scene")
+            ok = bool(in >> job.scene_name);
+        else if (key == "width")
+            ok = (in >> job.nx) && job.nx > 0 && job.nx <= job_max_side;
+        else if (key == "height")
+            ok = (in >> job.ny) && job.ny > 0 && job.ny <= job_max_side;
+        else if (key == "spp")
+            ok = (in >> job.ns) && job.ns > 0 && job.ns <= job_max_spp;
+        else if (key == "sampler")
+            ok = bool(in >> job.sampler_name);
+        else if (key == "denoise")
+            ok = bool(in >> job.denoise);
+        else if (key == "lookfrom")
+            ok = bool(in >> job.lookfrom);
+        else if (key == "lookat")
+            ok = bool(in >> job.lookat);
+        else if (key == "vfov")
+            ok = bool(in >> job.vfov);
+        else if (key == "aperture")
+            ok = bool(in >> job.aperture);
+        else
+            ok = false;
+        if (!ok) {
+            error = "bad job line '" + line + "'";
+            return false;
+        }
+    }
+    int64_t pixels = int64_t(job.nx) * job.ny;
+    if (pixels > job_max_pixels || pixels * job.ns > job_max_samples) {
+        error = pixels > job_max_pixels ? "image too big" : "too many samples";
+        return false;
+    }
+    return true;
+}
+
+#ifdef RENDER_DAEMON
+
+class render_daemon {
+    public:
+        render_daemon(thread_pool& p, size_t scenes_kept = 8)
+        : pool(p), max_scenes(scenes_kept), use_clock(0), stopping(false), active(0) {}
+
+        // serves jobs until a "shutdown" job; false with error if the socket cannot be opened
+        bool serve(const std::string& socket_path, std::string& error);
+
+    private:
+        struct cached_scene {
+            scene compiled;
+            light_list l;
+            uint64_t last_used;
+        };
+
+        void handle(int fd);
+        std::string run_job(const std::string& request);
+        std::shared_ptr<cached_scene> find_scene(const std::string& text, bool& hit, std::string& error);
+
+    private:
+        thread_pool& pool;
+        size_t max_scenes;
+        std::mutex cache_lock;
+        std::map<uint64_t, std::shared_ptr<cached_scene> > cache;
+        uint64_t use_clock;
+        std::atomic<bool> stopping;
+        std::mutex active_lock;
+        // signalled whenever a connection ends
+        std::condition_variable idle;
+        int active;
+        // held by the job that has the pool, from its framebuffer to its image
+        std::mutex render_turn;
+};
+
+inline bool render_daemon::serve(const std::string& socket_path, std::string& error) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        error = "socket path too long";
+        return false;
+    }
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    // a socket file left behind by an earlier server is replaced
+    unlink(socket_path.c_str());
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0) {
+        error = "cannot listen on " + socket_path + ": " + strerror(errno);
+        if (listener >= 0)
+            close(listener);
+        return false;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::cerr << "Listening on " << socket_path << "\n";
+
+    while (!stopping) {
+        {
+            std::unique_lock<std::mutex> guard(active_lock);
+            if (!idle.wait_for(guard, std::chrono::milliseconds(200), [&] { return active < daemon_max_connections; }))
+                continue;
+        }
+        pollfd p = { listener, POLLIN, 0 };
+        if (poll(&p, 1, 200) <= 0)
+            continue;
+        int client = accept(listener, 0, 0);
+        if (client < 0)
+            continue;
+        {
+            std::lock_guard<std::mutex> guard(active_lock);
+            active++;
+        }
+        std::thread(&render_daemon::handle, this, client).detach();
+    }
+
+    std::unique_lock<std::mutex> guard(active_lock);
+    idle.wait(guard, [&] { return active == 0; });
+    close(listener);
+    unlink(socket_path.c_str());
+    return true;
+}
+
+inline void render_daemon::handle(int fd) {
+    typedef std::chrono::steady_clock clock;
+    // a reply that stops being read gives up after the timeout too
+    timeval send_limit = { daemon_io_timeout_ms / 1000, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_limit, sizeof(send_limit));
+    clock::time_point deadline = clock::now() + std::chrono::milliseconds(daemon_io_timeout_ms);
+    std::string request;
+    char buf[4096];
+    bool timed_out = false;
+    while (request.size() < (1 << 20) && request.find("\n\n") == std::string::npos) {
+        int left = int(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count());
+        pollfd p = { fd, POLLIN, 0 };
+        int ready = left > 0 ? poll(&p, 1, left) : 0;
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready == 0) {
+            timed_out = true;
+            break;
+        }
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        request.append(buf, size_t(got));
+    }
+    std::string reply = timed_out ? "error request not received in time\n" : run_job(request);
+    for (size_t sent = 0; sent < reply.size();) {
+        ssize_t put = write(fd, reply.data() + sent, reply.size() - sent);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            break;
+        sent += size_t(put);
+    }
+    close(fd);
+    std::lock_guard<std::mutex> guard(active_lock);
+    --active;
+    idle.notify_all();
+}
+
+inline std::shared_ptr<render_daemon::cached_scene> render_daemon::find_scene(const std::string& text, bool& hit, std::string& error) {
+    uint64_t key = content_hash(text);
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        std::map<uint64_t, std::shared_ptr<cached_scene> >::iterator it = cache.find(key);
+        hit = it != cache.end();
+        if (hit) {
+            it->second->last_used = ++use_clock;
+            return it->second;
+        }
+    }
+
+    // built outside the lock, so other jobs keep going; if two jobs race
+    // for the same scene the second copy simply replaces the first
+    std::shared_ptr<cached_scene> entry(new cached_scene);
+    arena scene_arena;
+    hittable* world;
+    int integrator;
+    if (!parse_scene(text, scene_arena, world, entry->l, integrator, error))
+        return std::shared_ptr<cached_scene>();
+    world->compile(entry->compiled);
+    entry->compiled.integrator = integrator;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+    entry->last_used = ++use_clock;
+    cache[key] = entry;
+    while (cache.size() > max_scenes) {
+        std::map<uint64_t, std::shared_ptr<cached_scene> >::iterator oldest = cache.begin();
+        for (std::map<uint64_t, std::shared_ptr<cached_scene> >::iterator it = cache.begin(); it != cache.end(); ++it)
+            if (it->second->last_used < oldest->second->last_used)
+                oldest = it;
+        cache.erase(oldest);
+    }
+    return entry;
+}
+
+inline std::string render_daemon::run_job(const std::string& request) {
+    typedef std::chrono::steady_clock clock;
+    std::istringstream first(request);
+    std::string word;
+    if ((first >> word) && word == "shutdown") {
+        stopping = true;
+        return "ok\n\n";
+    }
+
+    render_job job;
+    std::string error, text;
+    if (!parse_job(request, job, error) || !scene_source(job.scene_name, text, error))
+        return "error " + error + "\n";
+    std::vector<std::unique_ptr<sampler> > samplers;
+    for (int t = 0; t < pool.size(); t++)
+        samplers.push_back(std::unique_ptr<sampler>(make_sampler(job.sampler_name, job.ns, 0)));
+    if (!samplers[0])
+        return "error unknown sampler " + job.sampler_name + "\n";
+
+    clock::time_point start = clock::now();
+    bool hit;
+    std::shared_ptr<cached_scene> s = find_scene(text, hit, error);
+    if (!s)
+        return "error " + error + "\n";
+    clock::time_point loaded = clock::now();
+
+    // only the job whose turn it is holds a framebuffer, so the jobs
+    // waiting for the pool hold no more than their scenes
+    std::unique_lock<std::mutex> turn(render_turn);
+    clock::time_point began = clock::now();
+    std::ostringstream ppm;
+    clock::time_point rendered, denoised;
+    {
+        framebuffer image(job.nx, job.ny, job.denoise ? AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO | AOV_VARIANCE : 0);
+        render_tiles(s->compiled, job.make_camera(), s->l, job.ns, samplers, pool, image, [](int, int) {});
+        rendered = clock::now();
+
+        std::vector<vec3> colour(size_t(job.nx) * job.ny);
+        for (size_t p = 0; p < colour.size(); p++)
+            colour[p] = image.colour(p);
+        if (job.denoise) {
+            atrous_denoiser denoiser(job.nx, job.ny, denoise_settings());
+            denoiser.run(image, colour, pool);
+        }
+        denoised = clock::now();
+        write_ppm(ppm, colour, job.nx, job.ny);
+    }
+    turn.unlock();
+    typedef std::chrono::duration<double, std::milli> ms;
+    double render_ms = ms(rendered - began).count();
+    double samples = double(job.nx) * job.ny * job.ns;
+    std::ostringstream reply;
+    reply << "ok\n"
+          << "scene_hash " << std::hex << std::setw(16) << std::setfill('0') << content_hash(text) << std::dec << "\n"
+          << "scene_cache " << (hit ? "hit" : "miss") << "\n"
+          << "scene_ms " << ms(loaded - start).count() << "\n"
+          << "wait_ms " << ms(began - loaded).count() << "\n"
+          << "render_ms " << render_ms << "\n"
+          << "denoise_ms " << ms(denoised - rendered).count() << "\n"
+          << "samples " << samples << "\n"
+          << "samples_per_sec " << samples / (render_ms / 1000.0) << "\n"
+          << "\n" << ppm.str();
+    return reply.str();
+}
+
+#endif
+
+/*
+    Client side: sends job (the request text) to the server at socket_path,
+    writes the image to image and the stats lines to log. Returns false
+    with the reason in error if the job could not be rendered.
+*/
+inline bool submit_job(const std::string& socket_path, const std::string& job, std::ostream& image, std::ostream& log, std::string& error) {
+#ifdef RENDER_DAEMON
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        error = "socket path too long";
+        return false;
+    }
+    std::memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        error = "cannot connect to " + socket_path + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    std::string request = job + "\n\n";
+    bool sent = true;
+    for (size_t done = 0; sent && done < request.size();) {
+        ssize_t put = write(fd, request.data() + done, request.size() - done);
+        sent = put > 0 || (put < 0 && errno == EINTR);
+        done += size_t(std::max<ssize_t>(put, 0));
+    }
+    shutdown(fd, SHUT_WR);
+    std::string reply;
+    char buf[65536];
+    for (;;) {
+        ssize_t got = read(fd, buf, sizeof(buf));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        reply.append(buf, size_t(got));
+    }
+    close(fd);
+
+    if (reply.compare(0, 3, "ok\n") != 0) {
+        error = reply.empty() ? std::string("no reply from server") : reply.substr(0, reply.find('\n'));
+        return false;
+    }
+    size_t body = reply.find("\n\n");
+    if (body == std::string::npos) {
+        error = "truncated reply from server";
+        return false;
+    }
+    log << reply.substr(3, body - 2);
+    image << reply.substr(body + 2);
+    return true;
+#else
+    (void)socket_path; (void)job; (void)image; (void)log;
+    error = "the render server needs UNIX sockets, which this platform does not have";
+    return false;
+#endif
+}
+
+#endif
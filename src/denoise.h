@@ -0,0 +1,189 @@
+#ifndef DENOISEH
+#define DENOISEH
+
+#include <algorithm>
+#include <vector>
+#include "vec3.h"
+#include "thread_pool.h"
+#include "framebuffer.h"
+
+/*
+    Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Each pass
+    is a 5x5 B3-spline blur whose taps are spread 2^i pixels apart, so a
+    few passes cover a large footprint. Every tap is weighted down by how
+    much it differs from the centre pixel in colour and in the first-hit
+    albedo, normal and depth, so the blur stops at edges. As in SVGF
+    (Schied et al. 2017) the colour term is scaled by the pixel's own
+    variance estimate, which is filtered along with the colour: converged
+    pixels keep their detail and noisy ones are smoothed hard.
+
+    Colour is divided by albedo before filtering and multiplied back
+    afterwards, so surface colour edges do not need to survive the blur.
+    Everything is stored as one float plane per channel and filtered a row
+    at a time; for each tap the inner loop walks a contiguous span of the
+    row, which the compiler can vectorise.
+*/
+
+struct denoise_settings {
+    int iterations;
+    // in standard deviations of the centre pixel
+    float sigma_color;
+    float sigma_normal;
+    float sigma_albedo;
+    float sigma_depth;
+    // keeps the albedo division away from zero in dark channels
+    float albedo_floor;
+    denoise_settings()
+    : iterations(3), sigma_color(6.0f), sigma_normal(0.2f), sigma_albedo(0.1f), sigma_depth(0.05f), albedo_floor(0.1f) {}
+};
+
+// exp(-a) for a >= 0; close enough for weights and simple enough to vectorise
+inline float weight_from_distance(float a) {
+    float b = 0.25f * a;
+    float w = 1.0f / (1.0f + b * (1.0f + b * (0.5f + b * (1.0f / 6.0f))));
+    w *= w;
+    return w * w;
+}
+
+class atrous_denoiser {
+    public:
+        atrous_denoiser(int width, int height, const denoise_settings& s) : nx(width), ny(height), settings(s) {}
+        // filters the mean colour of fb into colour; fb must keep the
+        // depth, normal, albedo and variance outputs
+        void run(const framebuffer& fb, std::vector<vec3>& colour, thread_pool& pool);
+
+    private:
+        void pass(int step, int row0, int row1);
+
+    private:
+        int nx, ny;
+        denoise_settings settings;
+        // planes: 0-2 current colour, 3-5 next colour, 6-8 albedo, 9-11 normal,
+        // 12 depth, 13 current variance, 14 next variance
+        std::vector<float> planes[15];
+};
+
+void atrous_denoiser::run(const framebuffer& fb, std::vector<vec3>& colour, thread_pool& pool) {
+    size_t n = size_t(nx) * ny;
+    colour.resize(n);
+    for (int p = 0; p < 15; p++)
+        planes[p].assign(n, 0.0f);
+    const double floor = settings.albedo_floor;
+    for (size_t i = 0; i < n; i++) {
+        vec3 a = fb.albedo(i);
+        vec3 divisor(std::max(a[0], floor), std::max(a[1], floor), std::max(a[2], floor));
+        vec3 col = fb.colour(i);
+        vec3 normal = fb.normal(i);
+        for (int c = 0; c < 3; c++) {
+            planes[c][i] = float(col[c] / divisor[c]);
+            planes[6+c][i] = float(a[c]);
+            planes[9+c][i] = float(normal[c]);
+        }
+        planes[12][i] = float(fb.depth(i));
+        double l = luminance(divisor);
+        planes[13][i] = float(fb.variance(i) / (l * l));
+    }
+
+    const int rows_per_job = 8;
+    int jobs = (ny + rows_per_job - 1) / rows_per_job;
+    for (int it = 0; it < settings.iterations; it++) {
+        int step = 1 << it;
+        pool.parallel_for(jobs, [&](int job, int) {
+            int row0 = job * rows_per_job;
+            int row1 = std::min(ny, row0 + rows_per_job);
+            pass(step, row0, row1);
+        });
+        for (int c = 0; c < 3; c++)
+            planes[c].swap(planes[3+c]);
+        planes[13].swap(planes[14]);
+    }
+
+    for (size_t i = 0; i < n; i++)
+        for (int c = 0; c < 3; c++)
+            colour[i][c] = planes[c][i] * std::max(planes[6+c][i], float(floor));
+}
+
+void atrous_denoiser::pass(int step, int row0, int row1) {
+    static const float h[5] = { 1.0f/16, 1.0f/4, 3.0f/8, 1.0f/4, 1.0f/16 };
+    const float sc2 = settings.sigma_color * settings.sigma_color;
+    const float in = 1.0f / (settings.sigma_normal * settings.sigma_normal);
+    const float ia = 1.0f / (settings.sigma_albedo * settings.sigma_albedo);
+    const float id = 1.0f / (settings.sigma_depth * settings.sigma_depth);
+
+    std::vector<float> sum_r(nx), sum_g(nx), sum_b(nx), sum_w(nx), sum_v(nx), ic(nx);
+    for (int y = row0; y < row1; y++) {
+        std::fill(sum_r.begin(), sum_r.end(), 0.0f);
+        std::fill(sum_g.begin(), sum_g.end(), 0.0f);
+        std::fill(sum_b.begin(), sum_b.end(), 0.0f);
+        std::fill(sum_w.begin(), sum_w.end(), 0.0f);
+        std::fill(sum_v.begin(), sum_v.end(), 0.0f);
+        size_t row = size_t(y) * nx;
+        const float* cr = &planes[0][row];
+        const float* cg = &planes[1][row];
+        const float* cb = &planes[2][row];
+        const float* ar = &planes[6][row];
+        const float* ag = &planes[7][row];
+        const float* ab = &planes[8][row];
+        const float* nxp = &planes[9][row];
+        const float* nyp = &planes[10][row];
+        const float* nzp = &planes[11][row];
+        const float* dp = &planes[12][row];
+        const float* vp = &planes[13][row];
+        for (int x = 0; x < nx; x++)
+            ic[x] = 1.0f / (sc2 * vp[x] + 1e-6f);
+
+        for (int ky = -2; ky <= 2; ky++) {
+            int qy = y + ky * step;
+            if (qy < 0 || qy >= ny)
+                continue;
+            size_t qrow = size_t(qy) * nx;
+            for (int kx = -2; kx <= 2; kx++) {
+                // taps that would fall outside the image are skipped
+                int off = kx * step;
+                int x0 = std::max(0, -off);
+                int x1 = std::min(nx, nx - off);
+                float k = h[ky+2] * h[kx+2];
+                const float* qr = planes[0].data() + qrow;
+                const float* qg = planes[1].data() + qrow;
+                const float* qb = planes[2].data() + qrow;
+                const float* qar = planes[6].data() + qrow;
+                const float* qag = planes[7].data() + qrow;
+                const float* qab = planes[8].data() + qrow;
+                const float* qnx = planes[9].data() + qrow;
+                const float* qny = planes[10].data() + qrow;
+                const float* qnz = planes[11].data() + qrow;
+                const float* qd = planes[12].data() + qrow;
+                const float* qv = planes[13].data() + qrow;
+                for (int x = x0; x < x1; x++) {
+                    float dl = 0.2126f * (cr[x] - qr[x+off]) + 0.7152f * (cg[x] - qg[x+off]) + 0.0722f * (cb[x] - qb[x+off]);
+                    float dar = ar[x] - qar[x+off], dag = ag[x] - qag[x+off], dab = ab[x] - qab[x+off];
+                    float dnx = nxp[x] - qnx[x+off], dny = nyp[x] - qny[x+off], dnz = nzp[x] - qnz[x+off];
+                    float dd = (dp[x] - qd[x+off]) / (dp[x] + 1e-3f);
+                    float a = dl*dl * ic[x]
+                            + (dnx*dnx + dny*dny + dnz*dnz) * in
+                            + (dar*dar + dag*dag + dab*dab) * ia
+                            + dd*dd * id;
+                    float w = k * weight_from_distance(a);
+                    sum_r[x] += w * qr[x+off];
+                    sum_g[x] += w * qg[x+off];
+                    sum_b[x] += w * qb[x+off];
+                    sum_w[x] += w;
+                    sum_v[x] += w * w * qv[x+off];
+                }
+            }
+        }
+        float* out_r = &planes[3][row];
+        float* out_g = &planes[4][row];
+        float* out_b = &planes[5][row];
+        float* out_v = &planes[14][row];
+        for (int x = 0; x < nx; x++) {
+            float inv = 1.0f / sum_w[x];
+            out_r[x] = sum_r[x] * inv;
+            out_g[x] = sum_g[x] * inv;
+            out_b[x] = sum_b[x] * inv;
+            out_v[x] = sum_v[x] * inv * inv;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,360 @@
+#ifndef DISTRIBUTEDH
+#define DISTRIBUTEDH
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "render.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define DISTRIBUTED_RENDER 1
+#endif
+
+/*
+    Coordinator and worker processes. The coordinator forks the workers
+    once the scene is compiled, so each one starts with the same scene,
+    camera and light, and talks to it over a socketpair. Work goes out as
+    units of one tile and a range of sample indices. A worker takes those
+    samples with render_pixel, like a local render does, and sends back
+    the per-pixel sums and what its stats counters gained. The coordinator
+    adds them into its framebuffer and stats.
+    Sums and counts just add up, so ranges from different workers merge
+    without any weighting.
+
+    Each worker has one unit at a time. When a worker's socket closes
+    before its result is complete, the worker is taken to be dead and the
+    unit goes back in the queue for the others. A worker that sits on a
+    unit for too long is killed and treated the same way. Partial results
+    are never merged. If every worker dies, the coordinator finishes the
+    rest itself.
+*/
+
+// sample indices [s0, s1) for every pixel of the tile
+struct work_unit {
+    int32_t x0, y0, x1, y1, s0, s1;
+};
+
+// units are split so a worker never holds more than this many samples per pixel
+const int samples_per_unit = 64;
+
+// a unit is overdue after this long, or after 10 times the slowest unit
+// finished so far if that is longer
+const double unit_timeout = 60;
+
+#ifdef DISTRIBUTED_RENDER
+
+// read and write all of n bytes; false on EOF or error
+inline bool read_full(int fd, void* buf, size_t n) {
+    char* p = static_cast<char*>(buf);
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        p += got;
+        n -= size_t(got);
+    }
+    return true;
+}
+
+inline bool write_full(int fd, const void* buf, size_t n) {
+    const char* p = static_cast<const char*>(buf);
+    while (n > 0) {
+        ssize_t put = write(fd, p, n);
+        if (put < 0 && errno == EINTR)
+            continue;
+        if (put <= 0)
+            return false;
+        p += put;
+        n -= size_t(put);
+    }
+    return true;
+}
+
+inline size_t unit_pixels(const work_unit& u) {
+    return size_t(u.x1 - u.x0) * (u.y1 - u.y0);
+}
+
+// runs in the forked child until the coordinator closes the socket
+inline void worker_main(int fd, const scene& world, const camera& cam, const light_list& l, int nx, int ny, sampler& smp) {
+    // the registry's copy is the coordinator's; counting there would mean
+    // taking its lock, which a thread that did not survive the fork may hold
+    thread_stats& counts = unlisted_local_stats();
+    work_unit u;
+    std::vector<pixel_sums> sums;
+    while (read_full(fd, &u, sizeof(u))) {
+        stats_snapshot before = counts.read();
+        sums.resize(unit_pixels(u));
+        size_t k = 0;
+        for (int y = u.y0; y < u.y1; y++)
+            for (int i = u.x0; i < u.x1; i++)
+                sums[k++] = render_pixel(world, cam, l, nx, ny, i, y, u.s0, u.s1, smp);
+        stats_snapshot counted = counts.read().minus(before);
+        if (!write_full(fd, sums.data(), sums.size() * sizeof(pixel_sums))
+            || !write_full(fd, &counted, sizeof(counted)))
+            break;
+    }
+}
+
+struct worker_process {
+    pid_t pid;
+    int fd;
+    bool busy;
+    work_unit unit;
+    // result bytes of the current unit received so far
+    std::vector<char> received;
+    // when the unit went out, for the timeout and the trace
+    std::chrono::steady_clock::time_point sent;
+    double sent_at;
+};
+
+#endif
+
+/*
+    Renders every tile up to ns samples with worker processes. progress is
+    called with the units done and the total after each one is merged. Once
+    stop returns true no more units go out; those already out are merged.
+    Returns false and sets error if no worker could be started.
+*/
+inline bool render_with_workers(const scene& world, const camera& cam, const light_list& l, const std::vector<tile>& tiles, int ns,
+                                const std::string& sampler_name, int workers, framebuffer& image,
+                                const std::function<void(int, int)>& progress, const std::function<bool()>& stop,
+                                std::string& error) {
+#ifdef DISTRIBUTED_RENDER
+    static_assert(std::is_trivially_copyable<pixel_sums>::value, "pixel_sums is sent as raw bytes");
+    const int nx = image.width();
+    const int ny = image.height();
+    std::unique_ptr<sampler> local_sampler(make_sampler(sampler_name, ns, 0));
+
+    // a resumed tile can hold pixels with different counts (emptied after a
+    // kill); those are finished here so every unit covers a whole tile
+    std::deque<work_unit> queue;
+    for (size_t t = 0; t < tiles.size(); t++) {
+        const tile& tl = tiles[t];
+        float lo = float(ns), hi = 0;
+        for (int y = tl.y0; y < tl.y1; y++)
+            for (int x = tl.x0; x < tl.x1; x++) {
+                float n = image.samples(size_t(y) * nx + x);
+                lo = std::min(lo, n);
+                hi = std::max(hi, n);
+            }
+        if (lo != hi && lo < ns) {
+            trace_span span("tile", "render");
+            render_tile(world, cam, l, tl, ns, *local_sampler, image);
+            lo = float(ns);
+        }
+        for (int s0 = int(lo); s0 < ns; s0 += samples_per_unit) {
+            work_unit u = { tl.x0, tl.y0, tl.x1, tl.y1, s0, std::min(ns, s0 + samples_per_unit) };
+            queue.push_back(u);
+        }
+    }
+    int total = int(queue.size());
+    int left = total;
+
+    // a write to a dead worker should fail, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+    std::cout.flush();
+    std::cerr.flush();
+    std::vector<worker_process> procs;
+    for (int w = 0; w < workers; w++) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+            break;
+        pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            for (size_t i = 0; i < procs.size(); i++)
+                close(procs[i].fd);
+            std::unique_ptr<sampler> smp(make_sampler(sampler_name, ns, 0));
+            worker_main(fds[1], world, cam, l, nx, ny, *smp);
+            _exit(0);
+        }
+        close(fds[1]);
+        worker_process p;
+        p.pid = pid;
+        p.fd = fds[0];
+        p.busy = false;
+        p.unit = work_unit();
+        p.sent_at = 0;
+        procs.push_back(p);
+        if (trace_log::global().enabled()) {
+            std::ostringstream name;
+            name << "worker process " << pid;
+            trace_log::global().name_track(int(pid), name.str());
+        }
+    }
+    if (procs.empty()) {
+        error = std::string("could not start workers: ") + strerror(errno);
+        return false;
+    }
+    std::cerr << "Workers: " << procs.size() << " (pids";
+    for (size_t i = 0; i < procs.size(); i++)
+        std::cerr << ' ' << procs[i].pid;
+    std::cerr << ")\n";
+
+    // a worker whose socket fails is reaped and its unit handed to someone else
+    auto drop = [&](size_t i, const char* what) {
+        worker_process& p = procs[i];
+        std::cerr << "\nworker " << p.pid << ' ' << what << "; its unit goes back in the queue\n";
+        if (p.busy)
+            queue.push_front(p.unit);
+        close(p.fd);
+        waitpid(p.pid, 0, 0);
+        procs.erase(procs.begin() + i);
+    };
+
+    std::chrono::duration<double> slowest(0);
+    std::vector<pixel_sums> sums;
+    std::vector<pollfd> fds;
+    while (left > 0 && !procs.empty()) {
+        // past the stop the queued units are skipped, and with them any
+        // unit handed back by a worker that died since
+        if (!queue.empty() && stop && stop()) {
+            left -= int(queue.size());
+            queue.clear();
+            progress(total - left, total);
+            continue;
+        }
+        for (size_t i = procs.size(); i-- > 0;) {
+            worker_process& p = procs[i];
+            if (p.busy || queue.empty())
+                continue;
+            p.unit = queue.front();
+            queue.pop_front();
+            p.received.clear();
+            p.busy = true;
+            p.sent = std::chrono::steady_clock::now();
+            if (trace_log::global().enabled())
+                p.sent_at = trace_log::global().now();
+            if (!write_full(p.fd, &p.unit, sizeof(p.unit)))
+                drop(i, "died");
+        }
+        if (procs.empty())
+            break;
+
+        // wait until a result comes in or the first busy unit is overdue
+        std::chrono::duration<double> limit = std::max(std::chrono::duration<double>(unit_timeout), 10 * slowest);
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        int wait_ms = -1;
+        fds.resize(procs.size());
+        for (size_t i = 0; i < procs.size(); i++) {
+            fds[i].fd = procs[i].fd;
+            fds[i].events = POLLIN;
+            fds[i].revents = 0;
+            if (procs[i].busy) {
+                double left_ms = std::chrono::duration<double, std::milli>(procs[i].sent + limit - now).count();
+                int ms = int(std::max(0.0, std::ceil(left_ms)));
+                wait_ms = wait_ms < 0 ? ms : std::min(wait_ms, ms);
+            }
+        }
+        if (poll(fds.data(), nfds_t(fds.size()), wait_ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (size_t i = procs.size(); i-- > 0;) {
+            worker_process& p = procs[i];
+            if (!fds[i].revents)
+                continue;
+            if (!p.busy) {
+                // an idle worker only becomes readable when it exits
+                drop(i, "died");
+                continue;
+            }
+            size_t want = unit_pixels(p.unit) * sizeof(pixel_sums) + sizeof(stats_snapshot);
+            size_t have = p.received.size();
+            p.received.resize(want);
+            ssize_t got = read(p.fd, p.received.data() + have, want - have);
+            if (got <= 0 && !(got < 0 && errno == EINTR)) {
+                drop(i, "died");
+                continue;
+            }
+            p.received.resize(have + size_t(std::max<ssize_t>(got, 0)));
+            if (p.received.size() < want)
+                continue;
+
+            sums.resize(unit_pixels(p.unit));
+            size_t sum_bytes = sums.size() * sizeof(pixel_sums);
+            std::memcpy(sums.data(), p.received.data(), sum_bytes);
+            stats_snapshot counted;
+            std::memcpy(&counted, p.received.data() + sum_bytes, sizeof(counted));
+            stats_registry::global().add_remote(counted);
+            size_t k = 0;
+            for (int y = p.unit.y0; y < p.unit.y1; y++)
+                for (int x = p.unit.x0; x < p.unit.x1; x++)
+                    image.add(x, y, sums[k++]);
+            if (trace_log::global().enabled()) {
+                // the unit's time at the worker, as the coordinator saw it
+                std::ostringstream args;
+                args << "\"x\": " << p.unit.x0 << ", \"y\": " << p.unit.y0 << ", \"s0\": " << p.unit.s0 << ", \"s1\": " << p.unit.s1;
+                trace_event e = { "unit", "render", p.sent_at, trace_log::global().now() - p.sent_at, int(p.pid), args.str() };
+                trace_log::global().add(e);
+            }
+            slowest = std::max(slowest, std::chrono::duration<double>(std::chrono::steady_clock::now() - p.sent));
+            p.busy = false;
+            --left;
+            progress(total - left, total);
+        }
+
+        now = std::chrono::steady_clock::now();
+        for (size_t i = procs.size(); i-- > 0;)
+            if (procs[i].busy && now - procs[i].sent >= limit) {
+                kill(procs[i].pid, SIGKILL);
+                drop(i, "timed out");
+            }
+    }
+
+    // closing the socket tells a worker to exit
+    for (size_t i = 0; i < procs.size(); i++) {
+        close(procs[i].fd);
+        waitpid(procs[i].pid, 0, 0);
+    }
+    if (left > 0) {
+        std::cerr << "\nno workers left; rendering the last " << left << " units here\n";
+        for (size_t i = 0; i < procs.size(); i++)
+            if (procs[i].busy)
+                queue.push_back(procs[i].unit);
+        for (size_t i = 0; i < queue.size(); i++) {
+            if (stop && stop())
+                break;
+            const work_unit& u = queue[i];
+            for (int y = u.y0; y < u.y1; y++)
+                for (int x = u.x0; x < u.x1; x++)
+                    image.add(x, y, render_pixel(world, cam, l, nx, ny, x, y, u.s0, u.s1, *local_sampler));
+            --left;
+            progress(total - left, total);
+        }
+    }
+    return true;
+#else
+    (void)world; (void)cam; (void)l; (void)tiles; (void)ns; (void)sampler_name;
+    (void)workers; (void)image; (void)progress; (void)stop;
+    error = "worker processes need fork and sockets, which this platform does not have";
+    return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef ENVIRONMENTH
+#define ENVIRONMENTH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "vec3.h"
+#include "sampler.h"
+
+/*
+    Environment map: a float image in lat-long layout lighting the scene
+    from infinitely far away. Column 0 faces -z and the top row is +y.
+    Texels are stored in 8x8 tiles, so neighbouring directions share cache
+    lines whichever way a lookup moves across the image.
+
+    For importance sampling an alias table holds every texel weighted by
+    its luminance times the solid angle it covers. sample() then picks a
+    direction in constant time with a density that follows the radiance,
+    so a small bright sun is found by the shadow rays rather than waiting
+    for a bounce to hit it.
+*/
+
+const int env_tile_bits = 3;
+const int env_tile = 1 << env_tile_bits;
+
+// Reads a PFM (colour "PF" or grey "Pf") into rgb, top row first. False
+// with error if the file cannot be read.
+inline bool load_pfm(const std::string& path, int& width, int& height, std::vector<float>& rgb, std::string& error) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::string magic;
+    double scale;
+    if (!(in >> magic >> width >> height >> scale) || (magic != "PF" && magic != "Pf") || width < 1 || height < 1) {
+        error = "cannot read PFM " + path;
+        return false;
+    }
+    in.get();
+    int channels = magic == "PF" ? 3 : 1;
+    std::vector<float> raw(size_t(width) * height * channels);
+    if (!in.read(reinterpret_cast<char*>(raw.data()), raw.size() * sizeof(float))) {
+        error = "truncated PFM " + path;
+        return false;
+    }
+    // a positive scale means big-endian data
+    const uint16_t probe = 1;
+    bool little_host = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    if ((scale < 0) != little_host) {
+        for (size_t i = 0; i < raw.size(); i++) {
+            uint32_t v;
+            std::memcpy(&v, &raw[i], 4);
+            v = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+            std::memcpy(&raw[i], &v, 4);
+        }
+    }
+    // PFM rows run bottom to top
+    rgb.resize(size_t(width) * height * 3);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            for (int c = 0; c < 3; c++)
+                rgb[(size_t(y) * width + x) * 3 + c] = raw[(size_t(height - 1 - y) * width + x) * channels + (channels == 3 ? c : 0)];
+    return true;
+}
+
+class environment_map {
+    public:
+        environment_map() : nx(0), ny(0), tiles_x(0) {}
+
+        // loads the map at path, scaled by scale; false with error otherwise
+        bool load(const std::string& path, double scale, std::string& error);
+
+        // radiance arriving from direction d (unit length)
+        vec3 radiance(const vec3& d) const;
+        // Picks a direction with a density that follows the radiance. Sets
+        // the radiance from there and the pdf per solid angle.
+        vec3 sample(sampler& smp, vec3& l, double& pdf) const;
+        // the pdf sample() has for direction d
+        double pdf(const vec3& d) const;
+
+    private:
+        size_t tiled(int x, int y) const {
+            size_t tile = size_t(y >> env_tile_bits) * tiles_x + (x >> env_tile_bits);
+            return (tile << (2 * env_tile_bits)) + ((y & (env_tile - 1)) << env_tile_bits) + (x & (env_tile - 1));
+        }
+        vec3 texel(int x, int y) const {
+            const float* t = &texels[3 * tiled(x, y)];
+            return vec3(t[0], t[1], t[2]);
+        }
+        // position of direction d on the map, both in [0, 1]
+        void locate(const vec3& d, double& u, double& v) const;
+
+    private:
+        int nx, ny, tiles_x;
+        std::vector<float> texels;
+        alias_table table;
+};
+
+inline bool environment_map::load(const std::string& path, double scale, std::string& error) {
+    std::vector<float> rgb;
+    if (!load_pfm(path, nx, ny, rgb, error))
+        return false;
+    tiles_x = (nx + env_tile - 1) / env_tile;
+    int tiles_y = (ny + env_tile - 1) / env_tile;
+    texels.assign(size_t(tiles_x) * tiles_y * env_tile * env_tile * 3, 0.0f);
+    std::vector<double> weights(size_t(nx) * ny);
+    for (int y = 0; y < ny; y++) {
+        double sin_theta = sin(pi * (y + 0.5) / ny);
+        for (int x = 0; x < nx; x++) {
+            const float* src = &rgb[(size_t(y) * nx + x) * 3];
+            float* dst = &texels[3 * tiled(x, y)];
+            for (int c = 0; c < 3; c++)
+                dst[c] = float(src[c] * scale);
+            weights[size_t(y) * nx + x] = luminance(texel(x, y)) * sin_theta;
+        }
+    }
+    table.build(weights);
+    return true;
+}
+
+inline void environment_map::locate(const vec3& d, double& u, double& v) const {
+    u = 0.5 + atan2(d.x(), -d.z()) / (2 * pi);
+    v = acos(std::max(-1.0, std::min(1.0, d.y()))) / pi;
+}
+
+inline vec3 environment_map::radiance(const vec3& d) const {
+    double u, v;
+    locate(d, u, v);
+    int x = std::min(nx - 1, std::max(0, int(u * nx)));
+    int y = std::min(ny - 1, std::max(0, int(v * ny)));
+    return texel(x, y);
+}
+
+inline vec3 environment_map::sample(sampler& smp, vec3& l, double& pdf) const {
+    double texel_pdf;
+    int k = table.pick(smp.get_1d(), texel_pdf);
+    double du, dv;
+    smp.get_2d(du, dv);
+    int x = k % nx, y = k / nx;
+    double phi = ((x + du) / nx - 0.5) * 2 * pi;
+    double theta = (y + dv) / ny * pi;
+    double sin_theta = sin(theta);
+    vec3 d(sin_theta * sin(phi), cos(theta), -sin_theta * cos(phi));
+    l = texel(x, y);
+    // uniform within the texel; a unit of map area covers 2 pi^2 sin(theta) steradians
+    pdf = sin_theta > 0 ? texel_pdf * nx * ny / (2 * pi * pi * sin_theta) : 0.0;
+    return d;
+}
+
+inline double environment_map::pdf(const vec3& d) const {
+    double u, v;
+    locate(d, u, v);
+    int x = std::min(nx - 1, std::max(0, int(u * nx)));
+    int y = std::min(ny - 1, std::max(0, int(v * ny)));
+    double sin_theta = sin(v * pi);
+    return sin_theta > 0 ? table.pdf(y * nx + x) * nx * ny / (2 * pi * pi * sin_theta) : 0.0;
+}
+
+#endif
@@ -0,0 +1,463 @@
+#ifndef FRAMEBUFFERH
+#define FRAMEBUFFERH
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "vec3.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FRAMEBUFFER_MMAP 1
+#endif
+
+/*
+    Float accumulation buffer for a render. Every channel is its own plane
+    of width*height floats, row 0 at the top, and holds the sum over all
+    samples taken so far; means are taken when reading. Colour and the
+    per-pixel sample count are always kept. The other outputs (AOVs) are
+    kept only when asked for, and cost nothing otherwise.
+
+    The planes can live in a memory-mapped file instead (map_file), so a
+    render that is killed keeps everything added so far. The samplers are
+    deterministic per pixel and sample index, so a pixel's sample count is
+    also all the sampler state needed to carry on where it stopped.
+*/
+
+enum aov_flags {
+    AOV_DEPTH = 1,
+    AOV_NORMAL = 2,
+    AOV_ALBEDO = 4,
+    AOV_SAMPLES = 8,
+    AOV_DIRECT = 16,
+    AOV_INDIRECT = 32,
+    AOV_VARIANCE = 64,
+    AOV_COST = 128,
+    AOV_ALL = 255
+};
+
+enum fb_channel {
+    CH_R, CH_G, CH_B,
+    CH_SAMPLES,
+    CH_DEPTH,
+    CH_NORMAL_X, CH_NORMAL_Y, CH_NORMAL_Z,
+    CH_ALBEDO_R, CH_ALBEDO_G, CH_ALBEDO_B,
+    CH_DIRECT_R, CH_DIRECT_G, CH_DIRECT_B,
+    CH_INDIRECT_R, CH_INDIRECT_G, CH_INDIRECT_B,
+    // luminance squared, for the variance estimate
+    CH_LUM_SQ,
+    // render time in nanoseconds and intersection tests, for profiling
+    CH_COST_TIME, CH_COST_TESTS,
+    CH_COUNT
+};
+
+// what one pixel gathered over a batch of samples, as sums
+struct pixel_sums {
+    vec3 colour, albedo, normal, direct, indirect;
+    double depth;
+    double lum_sq;
+    double time_ns, tests;
+    int count;
+    pixel_sums() : depth(0), lum_sq(0), time_ns(0), tests(0), count(0) {}
+};
+
+// parses a comma separated list such as "depth,normal"; returns false on an unknown name
+inline bool parse_aovs(const std::string& list, unsigned& mask) {
+    static const char* names[] = { "depth", "normal", "albedo", "samples", "direct", "indirect", "variance", "cost" };
+    mask = 0;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        std::string name = list.substr(start, end - start);
+        if (name == "all") {
+            mask |= AOV_ALL;
+        } else {
+            int i = 0;
+            while (i < 8 && name != names[i])
+                i++;
+            if (i == 8)
+                return false;
+            mask |= 1u << i;
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+// start of an accumulation file; the kept planes follow in channel order
+struct framebuffer_file_header {
+    char magic[8];
+    uint32_t width, height, aovs, header_bytes;
+    // how the samples were taken (sampler, seed, a hash of the scene, camera
+    // and integrator); a resumed render must match
+    char settings[96];
+};
+
+class framebuffer {
+    public:
+        framebuffer(int width, int height, unsigned aov_mask = 0);
+        ~framebuffer();
+        framebuffer(const framebuffer&) = delete;
+        framebuffer& operator=(const framebuffer&) = delete;
+
+        int width() const { return nx; }
+        int height() const { return ny; }
+        bool has(unsigned aov) const { return (mask & aov) != 0; }
+
+        // adds a batch of samples to pixel (x, y); outputs that are not kept are dropped
+        void add(int x, int y, const pixel_sums& s);
+
+        // means over the samples taken so far, p = y * width + x
+        float samples(size_t p) const { return planes[CH_SAMPLES][p]; }
+        vec3 colour(size_t p) const { return mean3(CH_R, p); }
+        vec3 albedo(size_t p) const { return mean3(CH_ALBEDO_R, p); }
+        vec3 normal(size_t p) const { return mean3(CH_NORMAL_X, p); }
+        vec3 direct(size_t p) const { return mean3(CH_DIRECT_R, p); }
+        vec3 indirect(size_t p) const { return mean3(CH_INDIRECT_R, p); }
+        double depth(size_t p) const { return planes[CH_DEPTH][p] / std::max(1.0f, samples(p)); }
+        // variance of the mean luminance
+        double variance(size_t p) const;
+        // nanoseconds and intersection tests per sample
+        double cost_time(size_t p) const { return planes[CH_COST_TIME][p] / std::max(1.0f, samples(p)); }
+        double cost_tests(size_t p) const { return planes[CH_COST_TESTS][p] / std::max(1.0f, samples(p)); }
+        // RMS standard error of the pixel means relative to the mean
+        // luminance of the image; needs the variance output
+        double noise_level() const;
+
+        // writes colour and every kept AOV as one uncompressed OpenEXR file,
+        // one float channel per plane
+        bool write_exr(const std::string& path) const;
+
+        // Moves the planes into the file at path. A new file starts empty;
+        // with resume the file must already exist with the same size,
+        // outputs and settings, and its samples are kept. Returns false and
+        // sets error otherwise.
+        bool map_file(const std::string& path, const std::string& settings, bool resume, std::string& error);
+        // waits until the mapped planes are on disk
+        void checkpoint();
+
+    private:
+        vec3 mean3(int first, size_t p) const;
+        void keep(int first, int count);
+        void repair_torn_pixels();
+
+    private:
+        int nx, ny;
+        unsigned mask;
+        // null for outputs that are not kept
+        float* planes[CH_COUNT];
+        std::vector<float> storage;
+        // bit c set when channel c is kept
+        uint32_t kept;
+        void* mapping;
+        size_t mapping_bytes;
+};
+
+inline framebuffer::framebuffer(int width, int height, unsigned aov_mask)
+: nx(width), ny(height), mask(aov_mask), kept(0), mapping(0), mapping_bytes(0) {
+    for (int c = 0; c < CH_COUNT; c++)
+        planes[c] = 0;
+    keep(CH_R, 4);
+    if (has(AOV_DEPTH))
+        keep(CH_DEPTH, 1);
+    if (has(AOV_NORMAL))
+        keep(CH_NORMAL_X, 3);
+    if (has(AOV_ALBEDO))
+        keep(CH_ALBEDO_R, 3);
+    if (has(AOV_DIRECT))
+        keep(CH_DIRECT_R, 3);
+    if (has(AOV_INDIRECT))
+        keep(CH_INDIRECT_R, 3);
+    if (has(AOV_VARIANCE))
+        keep(CH_LUM_SQ, 1);
+    if (has(AOV_COST))
+        keep(CH_COST_TIME, 2);
+    size_t n = size_t(nx) * ny;
+    int count = 0;
+    for (int c = 0; c < CH_COUNT; c++)
+        count += (kept >> c) & 1;
+    storage.assign(count * n, 0.0f);
+    for (int c = 0, k = 0; c < CH_COUNT; c++)
+        if (kept & (1u << c))
+            planes[c] = &storage[k++ * n];
+}
+
+inline framebuffer::~framebuffer() {
+#ifdef FRAMEBUFFER_MMAP
+    if (mapping)
+        munmap(mapping, mapping_bytes);
+#endif
+}
+
+inline void framebuffer::keep(int first, int count) {
+    for (int c = first; c < first + count; c++)
+        kept |= 1u << c;
+}
+
+inline vec3 framebuffer::mean3(int first, size_t p) const {
+    float inv = 1.0f / std::max(1.0f, samples(p));
+    return vec3(planes[first][p] * inv, planes[first+1][p] * inv, planes[first+2][p] * inv);
+}
+
+inline double framebuffer::variance(size_t p) const {
+    double n = samples(p);
+    if (n < 2)
+        return 0.0;
+    double mean = luminance(colour(p));
+    return std::max(0.0, planes[CH_LUM_SQ][p] / n - mean * mean) / (n - 1);
+}
+
+inline double framebuffer::noise_level() const {
+    size_t n = size_t(nx) * ny;
+    double var = 0, lum = 0;
+    for (size_t p = 0; p < n; p++) {
+        var += variance(p);
+        lum += luminance(colour(p));
+    }
+    return lum > 0 ? sqrt(var / n) / (lum / n) : 0.0;
+}
+
+inline void framebuffer::add(int x, int y, const pixel_sums& s) {
+    size_t p = size_t(y) * nx + x;
+    // the count goes negative while the sums change, so a pixel caught
+    // half-written by a kill can be told apart when the file is reopened
+    float count = planes[CH_SAMPLES][p];
+    planes[CH_SAMPLES][p] = -1.0f - count;
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    const vec3* sources[] = { &s.colour, &s.normal, &s.albedo, &s.direct, &s.indirect };
+    const int firsts[] = { CH_R, CH_NORMAL_X, CH_ALBEDO_R, CH_DIRECT_R, CH_INDIRECT_R };
+    for (int i = 0; i < 5; i++) {
+        if (!planes[firsts[i]])
+            continue;
+        for (int c = 0; c < 3; c++)
+            planes[firsts[i] + c][p] += float((*sources[i])[c]);
+    }
+    if (planes[CH_DEPTH])
+        planes[CH_DEPTH][p] += float(s.depth);
+    if (planes[CH_LUM_SQ])
+        planes[CH_LUM_SQ][p] += float(s.lum_sq);
+    if (planes[CH_COST_TIME]) {
+        planes[CH_COST_TIME][p] += float(s.time_ns);
+        planes[CH_COST_TESTS][p] += float(s.tests);
+    }
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+    planes[CH_SAMPLES][p] = count + float(s.count);
+}
+
+// little-endian writers for the EXR header and pixel data
+inline void put_u32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; i++)
+        out += char((v >> (8 * i)) & 0xff);
+}
+
+inline void put_u64(std::string& out, uint64_t v) {
+    for (int i = 0; i < 8; i++)
+        out += char((v >> (8 * i)) & 0xff);
+}
+
+inline void put_f32(std::string& out, float f) {
+    uint32_t v;
+    std::memcpy(&v, &f, 4);
+    put_u32(out, v);
+}
+
+inline void put_attribute(std::string& out, const char* name, const char* type, const std::string& value) {
+    out += name;
+    out += '\0';
+    out += type;
+    out += '\0';
+    put_u32(out, uint32_t(value.size()));
+    out += value;
+}
+
+inline bool framebuffer::write_exr(const std::string& path) const {
+    // resolved output channels; EXR wants them sorted by name
+    std::vector<std::pair<std::string, std::vector<float> > > channels;
+    size_t n = size_t(nx) * ny;
+    struct layer { unsigned aov; const char* names[3]; int first; int count; };
+    const layer layers[] = {
+        { 0, { "R", "G", "B" }, CH_R, 3 },
+        { AOV_DEPTH, { "Z" }, CH_DEPTH, 1 },
+        { AOV_NORMAL, { "normal.X", "normal.Y", "normal.Z" }, CH_NORMAL_X, 3 },
+        { AOV_ALBEDO, { "albedo.R", "albedo.G", "albedo.B" }, CH_ALBEDO_R, 3 },
+        { AOV_DIRECT, { "direct.R", "direct.G", "direct.B" }, CH_DIRECT_R, 3 },
+        { AOV_INDIRECT, { "indirect.R", "indirect.G", "indirect.B" }, CH_INDIRECT_R, 3 },
+        { AOV_COST, { "cost.time", "cost.tests" }, CH_COST_TIME, 2 },
+    };
+    for (size_t l = 0; l < sizeof(layers) / sizeof(layers[0]); l++) {
+        if (layers[l].aov && !has(layers[l].aov))
+            continue;
+        for (int c = 0; c < layers[l].count; c++) {
+            std::vector<float> values(n);
+            const float* sums = planes[layers[l].first + c];
+            for (size_t p = 0; p < n; p++)
+                values[p] = sums[p] / std::max(1.0f, samples(p));
+            channels.push_back(std::make_pair(std::string(layers[l].names[c]), values));
+        }
+    }
+    if (has(AOV_SAMPLES))
+        channels.push_back(std::make_pair(std::string("samples"), std::vector<float>(planes[CH_SAMPLES], planes[CH_SAMPLES] + n)));
+    if (has(AOV_VARIANCE)) {
+        std::vector<float> values(n);
+        for (size_t p = 0; p < n; p++)
+            values[p] = float(variance(p));
+        channels.push_back(std::make_pair(std::string("variance.Y"), values));
+    }
+    std::sort(channels.begin(), channels.end());
+
+    std::string header;
+    put_u32(header, 20000630);
+    put_u32(header, 2);
+    std::string chlist;
+    for (size_t c = 0; c < channels.size(); c++) {
+        chlist += channels[c].first;
+        chlist += '\0';
+        put_u32(chlist, 2);  // FLOAT
+        put_u32(chlist, 0);  // pLinear and reserved
+        put_u32(chlist, 1);
+        put_u32(chlist, 1);
+    }
+    chlist += '\0';
+    put_attribute(header, "channels", "chlist", chlist);
+    put_attribute(header, "compression", "compression", std::string(1, '\0'));
+    std::string window;
+    put_u32(window, 0);
+    put_u32(window, 0);
+    put_u32(window, uint32_t(nx - 1));
+    put_u32(window, uint32_t(ny - 1));
+    put_attribute(header, "dataWindow", "box2i", window);
+    put_attribute(header, "displayWindow", "box2i", window);
+    put_attribute(header, "lineOrder", "lineOrder", std::string(1, '\0'));
+    std::string value;
+    put_f32(value, 1.0f);
+    put_attribute(header, "pixelAspectRatio", "float", value);
+    value.clear();
+    put_f32(value, 0.0f);
+    put_f32(value, 0.0f);
+    put_attribute(header, "screenWindowCenter", "v2f", value);
+    value.clear();
+    put_f32(value, 1.0f);
+    put_attribute(header, "screenWindowWidth", "float", value);
+    header += '\0';
+
+    // one scanline per chunk, channels one after another within it
+    uint32_t line_bytes = uint32_t(channels.size() * nx * 4);
+    uint64_t chunk_start = header.size() + 8 * uint64_t(ny);
+    for (int y = 0; y < ny; y++)
+        put_u64(header, chunk_start + uint64_t(y) * (8 + line_bytes));
+
+    std::ofstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        return false;
+    file.write(header.data(), header.size());
+    std::string line;
+    for (int y = 0; y < ny; y++) {
+        line.clear();
+        put_u32(line, uint32_t(y));
+        put_u32(line, line_bytes);
+        for (size_t c = 0; c < channels.size(); c++)
+            for (int x = 0; x < nx; x++)
+                put_f32(line, channels[c].second[size_t(y) * nx + x]);
+        file.write(line.data(), line.size());
+    }
+    return bool(file);
+}
+
+inline bool framebuffer::map_file(const std::string& path, const std::string& settings, bool resume, std::string& error) {
+#ifdef FRAMEBUFFER_MMAP
+    framebuffer_file_header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "RTACCUM1", 8);
+    header.width = uint32_t(nx);
+    header.height = uint32_t(ny);
+    header.aovs = mask;
+    header.header_bytes = 128;
+    if (settings.size() >= sizeof(header.settings)) {
+        error = "settings too long";
+        return false;
+    }
+    std::memcpy(header.settings, settings.data(), settings.size());
+    size_t plane_bytes = storage.size() * sizeof(float);
+    size_t bytes = header.header_bytes + plane_bytes;
+
+    int fd = open(path.c_str(), resume ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error = "cannot open " + path + ": " + strerror(errno);
+        return false;
+    }
+    if (resume) {
+        framebuffer_file_header found;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) != bytes
+            || pread(fd, &found, sizeof(found), 0) != ssize_t(sizeof(found))
+            || std::memcmp(&found, &header, sizeof(header)) != 0) {
+            close(fd);
+            error = path + " was not made by a render of the same scene, camera, size, outputs and sampler";
+            return false;
+        }
+    } else if (ftruncate(fd, off_t(bytes)) != 0 || pwrite(fd, &header, sizeof(header), 0) != ssize_t(sizeof(header))) {
+        close(fd);
+        error = "cannot size " + path + ": " + strerror(errno);
+        return false;
+    }
+    void* m = mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        error = "cannot map " + path + ": " + strerror(errno);
+        return false;
+    }
+
+    float* base = reinterpret_cast<float*>(static_cast<char*>(m) + header.header_bytes);
+    if (!resume)
+        std::memcpy(base, storage.data(), plane_bytes);
+    size_t n = size_t(nx) * ny;
+    for (int c = 0, k = 0; c < CH_COUNT; c++)
+        if (kept & (1u << c))
+            planes[c] = base + k++ * n;
+    std::vector<float>().swap(storage);
+    if (mapping)
+        munmap(mapping, mapping_bytes);
+    mapping = m;
+    mapping_bytes = bytes;
+    if (resume)
+        repair_torn_pixels();
+    return true;
+#else
+    (void)path; (void)settings; (void)resume;
+    error = "accumulation files need mmap, which this platform does not have";
+    return false;
+#endif
+}
+
+inline void framebuffer::checkpoint() {
+#ifdef FRAMEBUFFER_MMAP
+    if (mapping)
+        msync(mapping, mapping_bytes, MS_SYNC);
+#endif
+}
+
+// a pixel that was being added to when the last run died has lost track of
+// what it holds; it is emptied and gets all its samples again
+inline void framebuffer::repair_torn_pixels() {
+    size_t n = size_t(nx) * ny;
+    for (size_t p = 0; p < n; p++) {
+        if (planes[CH_SAMPLES][p] >= 0)
+            continue;
+        for (int c = 0; c < CH_COUNT; c++)
+            if (planes[c])
+                planes[c][p] = 0.0f;
+    }
+}
+
+#endif
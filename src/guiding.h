@@ -0,0 +1,345 @@
+#ifndef GUIDINGH
+#define GUIDINGH
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "vec3.h"
+#include "sampler.h"
+
+/*
+    Path guiding, after Mueller et al. 2017 ("practical path guiding").
+    When a room is lit through a small opening, cosine sampling sends most
+    bounces where no light comes from. The guide learns where light
+    arrives from at each place in the scene, and the path integrator sends
+    part of its bounces that way.
+
+    Each diffuse bounce of a pass leaves a sample: where it started, the
+    direction it took, and the light the rest of the path brought back
+    along it, times the cosine there, over the pdf of the direction. Every
+    thread keeps a fixed number of them as a reservoir, so memory stays put
+    however long the pass and the kept samples are spread over the whole
+    image.
+
+    Between passes update() pools the reservoirs and sorts them by the way
+    the surface faced, the axis its normal is closest to, so a floor and
+    the wall beside it learn apart. For each of those six it splits space
+    with a kd-tree at the median of the samples, until each leaf holds few
+    enough. Each leaf maps directions to the unit square by z and the angle
+    around z, which keeps areas, and splits the square as a quadtree
+    wherever more than a small share of the light came through, so the
+    bright directions get small cells. The cells that are not split go into
+    an alias table by their light. A little weight spread evenly keeps
+    every direction possible.
+
+    Only the latest pass builds the tree. Passes double their samples, so
+    each rebuild sees as many as all the passes before it together.
+*/
+
+// samples kept per pass, over all threads
+const int guide_samples = 1 << 20;
+// a spatial leaf is split while it holds more samples than this
+const int guide_leaf_samples = 16384;
+const int guide_max_depth = 24;
+// a direction cell is split while more than this share of its leaf's light
+// came through it, and it holds a few samples to say so
+const double guide_split_share = 0.01;
+const int guide_split_samples = 8;
+const int guide_max_quad_depth = 10;
+// share of a leaf's weight spread evenly over the sphere
+const double guide_uniform = 0.1;
+// share of diffuse bounces sampled from the guide; the rest are cosine sampled
+const double guide_fraction = 0.5;
+
+class path_guide {
+    public:
+        // the directions learnt for one region of space
+        struct leaf {
+            // quadtree over the square; a split node's children are at
+            // child .. child + 3, the others hold their alias table index
+            struct quad {
+                float x, y, size;
+                int child, cell;
+            };
+            std::vector<quad> quads;
+            alias_table table;
+            // the quad of each cell
+            std::vector<int> cell_quad;
+        };
+
+        // threads is how many threads will record, to share the samples out
+        path_guide(int threads = 1);
+
+        // the leaf for p on a surface with normal n, or 0 if none has been learnt
+        const leaf* find(const vec3& p, const vec3& n) const;
+        // Picks a direction from the leaf and sets its pdf per solid angle.
+        // pick chooses the cell and (u, v) the place in it, all in [0, 1).
+        vec3 sample(const leaf& f, double pick, double u, double v, double& pdf) const;
+        // the pdf sample() has for the unit direction d
+        double pdf(const leaf& f, const vec3& d) const;
+
+        // Notes that light arrived at p, normal n, from direction d, with
+        // weight as described above. Safe from any thread.
+        void record(const vec3& p, const vec3& n, const vec3& d, double weight);
+        // rebuilds the tree from what was recorded since the last update;
+        // call it between passes, while nothing records
+        void update();
+
+        int leaves() const { return int(leaf_list.size()); }
+
+    private:
+        struct entry {
+            float p[3];
+            // direction as a point of the unit square
+            float x, y;
+            float weight;
+            int side;
+        };
+        struct reservoir {
+            std::vector<entry> kept;
+            uint64_t seen;
+            uint64_t rng;
+        };
+        // interior nodes split at split along axis, children at child and
+        // child + 1; a leaf has axis -1 and its leaf_list index in child
+        struct node {
+            int axis;
+            float split;
+            int child;
+        };
+
+        // 0 to 5 for normals closest to +x, -x, +y, -y, +z, -z
+        static int side(const vec3& n) {
+            int axis = 0;
+            for (int k = 1; k < 3; k++)
+                if (fabs(n[k]) > fabs(n[axis]))
+                    axis = k;
+            return 2 * axis + (n[axis] < 0 ? 1 : 0);
+        }
+        static void to_square(const vec3& d, double& x, double& y) {
+            x = std::min(1.0, std::max(0.0, (d.z() + 1) * 0.5));
+            y = std::min(1.0, std::max(0.0, (atan2(d.y(), d.x()) + pi) / (2 * pi)));
+        }
+        reservoir& local_reservoir();
+        // fills in node index from pool[begin, end)
+        void build(std::vector<entry>& pool, size_t begin, size_t end, int depth, int index);
+        // fills in quad q of f from pool[begin, end), whose light is total
+        void build_quad(leaf& f, std::vector<double>& weights, std::vector<entry>& pool, size_t begin, size_t end,
+                        double total, int depth, int q);
+
+    private:
+        // tells this guide's per-thread reservoirs from another guide's
+        uint64_t id;
+        int reservoir_size;
+        std::mutex lock;
+        std::vector<std::unique_ptr<reservoir> > reservoirs;
+        std::vector<node> nodes;
+        // the root node of each side, -1 where nothing was recorded
+        int roots[6];
+        std::vector<leaf> leaf_list;
+};
+
+inline path_guide::path_guide(int threads) : reservoir_size(guide_samples / std::max(1, threads)) {
+    static std::atomic<uint64_t> next_id(1);
+    id = next_id++;
+    for (int k = 0; k < 6; k++)
+        roots[k] = -1;
+}
+
+inline path_guide::reservoir& path_guide::local_reservoir() {
+    thread_local uint64_t owner = 0;
+    thread_local reservoir* mine = 0;
+    if (owner != id) {
+        std::lock_guard<std::mutex> guard(lock);
+        reservoirs.push_back(std::unique_ptr<reservoir>(new reservoir));
+        mine = reservoirs.back().get();
+        mine->seen = 0;
+        mine->rng = 0x9e3779b97f4a7c15ull ^ (uint64_t(reservoirs.size()) << 32);
+        owner = id;
+    }
+    return *mine;
+}
+
+inline void path_guide::record(const vec3& p, const vec3& n, const vec3& d, double weight) {
+    if (!(weight >= 0) || weight > 1e30)
+        return;
+    reservoir& r = local_reservoir();
+    entry e;
+    for (int k = 0; k < 3; k++)
+        e.p[k] = float(p[k]);
+    double x, y;
+    to_square(d, x, y);
+    e.x = float(x);
+    e.y = float(y);
+    e.weight = float(weight);
+    e.side = side(n);
+    r.seen++;
+    if (r.kept.size() < size_t(reservoir_size)) {
+        r.kept.push_back(e);
+        return;
+    }
+    // every sample seen stays with the same chance
+    r.rng ^= r.rng << 13;
+    r.rng ^= r.rng >> 7;
+    r.rng ^= r.rng << 17;
+    uint64_t slot = r.rng % r.seen;
+    if (slot < uint64_t(reservoir_size))
+        r.kept[slot] = e;
+}
+
+inline void path_guide::update() {
+    std::vector<entry> pool;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t t = 0; t < reservoirs.size(); t++) {
+            reservoir& r = *reservoirs[t];
+            // a kept sample stands for all those its thread saw
+            float scale = r.kept.empty() ? 0.0f : float(double(r.seen) / r.kept.size());
+            for (size_t k = 0; k < r.kept.size(); k++) {
+                pool.push_back(r.kept[k]);
+                pool.back().weight *= scale;
+            }
+            r.kept.clear();
+            r.seen = 0;
+        }
+    }
+    if (pool.empty())
+        return;
+    nodes.clear();
+    leaf_list.clear();
+    std::sort(pool.begin(), pool.end(), [](const entry& a, const entry& b) { return a.side < b.side; });
+    size_t begin = 0;
+    for (int k = 0; k < 6; k++) {
+        size_t end = begin;
+        while (end < pool.size() && pool[end].side == k)
+            end++;
+        roots[k] = -1;
+        if (end > begin) {
+            roots[k] = int(nodes.size());
+            nodes.push_back(node());
+            build(pool, begin, end, 0, roots[k]);
+        }
+        begin = end;
+    }
+}
+
+inline void path_guide::build(std::vector<entry>& pool, size_t begin, size_t end, int depth, int index) {
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++) {
+        lo[k] = pool[begin].p[k];
+        hi[k] = lo[k];
+    }
+    for (size_t i = begin; i < end; i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], pool[i].p[k]);
+            hi[k] = std::max(hi[k], pool[i].p[k]);
+        }
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+        if (hi[k] - lo[k] > hi[axis] - lo[axis])
+            axis = k;
+
+    if (end - begin > size_t(guide_leaf_samples) && depth < guide_max_depth && hi[axis] > lo[axis]) {
+        size_t mid = begin + (end - begin) / 2;
+        std::nth_element(pool.begin() + begin, pool.begin() + mid, pool.begin() + end,
+                         [axis](const entry& a, const entry& b) { return a.p[axis] < b.p[axis]; });
+        int child = int(nodes.size());
+        nodes[index].axis = axis;
+        nodes[index].split = pool[mid].p[axis];
+        nodes[index].child = child;
+        nodes.resize(nodes.size() + 2);
+        build(pool, begin, mid, depth + 1, child);
+        build(pool, mid, end, depth + 1, child + 1);
+        return;
+    }
+
+    nodes[index].axis = -1;
+    nodes[index].child = int(leaf_list.size());
+    leaf_list.push_back(leaf());
+    leaf& f = leaf_list.back();
+    double total = 0;
+    for (size_t i = begin; i < end; i++)
+        total += pool[i].weight;
+    leaf::quad root = { 0, 0, 1, -1, -1 };
+    f.quads.push_back(root);
+    std::vector<double> weights;
+    build_quad(f, weights, pool, begin, end, total, 0, 0);
+    // the even share goes by area; with no light at all it is everything
+    double even = total > 0 ? guide_uniform * total : 1.0;
+    for (size_t q = 0; q < f.quads.size(); q++)
+        if (f.quads[q].child < 0)
+            weights[f.quads[q].cell] += even * f.quads[q].size * f.quads[q].size;
+    f.table.build(weights);
+    f.cell_quad.resize(weights.size());
+    for (size_t q = 0; q < f.quads.size(); q++)
+        if (f.quads[q].child < 0)
+            f.cell_quad[f.quads[q].cell] = int(q);
+}
+
+inline void path_guide::build_quad(leaf& f, std::vector<double>& weights, std::vector<entry>& pool, size_t begin, size_t end,
+                                   double total, int depth, int q) {
+    double light = 0;
+    for (size_t i = begin; i < end; i++)
+        light += pool[i].weight;
+    if (depth < guide_max_quad_depth && end - begin >= size_t(guide_split_samples) && light > guide_split_share * total) {
+        float x = f.quads[q].x, y = f.quads[q].y, half = f.quads[q].size / 2;
+        int child = int(f.quads.size());
+        f.quads[q].child = child;
+        for (int c = 0; c < 4; c++) {
+            leaf::quad sub = { x + (c & 1) * half, y + (c >> 1) * half, half, -1, -1 };
+            f.quads.push_back(sub);
+        }
+        // children in the order (low x, low y), (high x, low y), (low x, high y), (high x, high y)
+        float mx = x + half, my = y + half;
+        std::vector<entry>::iterator first = pool.begin() + begin, last = pool.begin() + end;
+        std::vector<entry>::iterator ys = std::partition(first, last, [my](const entry& e) { return e.y < my; });
+        std::vector<entry>::iterator xs0 = std::partition(first, ys, [mx](const entry& e) { return e.x < mx; });
+        std::vector<entry>::iterator xs1 = std::partition(ys, last, [mx](const entry& e) { return e.x < mx; });
+        size_t bounds[5] = { begin, size_t(xs0 - pool.begin()), size_t(ys - pool.begin()), size_t(xs1 - pool.begin()), end };
+        for (int c = 0; c < 4; c++)
+            build_quad(f, weights, pool, bounds[c], bounds[c + 1], total, depth + 1, child + c);
+        return;
+    }
+    f.quads[q].cell = int(weights.size());
+    weights.push_back(light);
+}
+
+inline const path_guide::leaf* path_guide::find(const vec3& p, const vec3& n) const {
+    int k = roots[side(n)];
+    if (k < 0)
+        return 0;
+    while (nodes[k].axis >= 0)
+        k = nodes[k].child + (p[nodes[k].axis] < nodes[k].split ? 0 : 1);
+    return &leaf_list[nodes[k].child];
+}
+
+inline vec3 path_guide::sample(const leaf& f, double pick, double u, double v, double& pdf) const {
+    double cell_pdf;
+    int k = f.table.pick(pick, cell_pdf);
+    const leaf::quad& c = f.quads[f.cell_quad[k]];
+    double z = 2 * (c.x + u * c.size) - 1;
+    double phi = 2 * pi * (c.y + v * c.size) - pi;
+    double r = sqrt(std::max(0.0, 1 - z * z));
+    // the square maps onto the sphere keeping areas, 4 pi steradians in all
+    pdf = cell_pdf / (c.size * c.size) / (4 * pi);
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline double path_guide::pdf(const leaf& f, const vec3& d) const {
+    double x, y;
+    to_square(d, x, y);
+    int q = 0;
+    while (f.quads[q].child >= 0) {
+        const leaf::quad& c = f.quads[q];
+        double half = c.size / 2;
+        q = c.child + (x >= c.x + half ? 1 : 0) + (y >= c.y + half ? 2 : 0);
+    }
+    const leaf::quad& c = f.quads[q];
+    return f.table.pdf(c.cell) / (c.size * c.size) / (4 * pi);
+}
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef HEATMAPH
+#define HEATMAPH
+
+#include <algorithm>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "framebuffer.h"
+#include "render.h"
+
+/*
+    Cost heatmaps. With the cost AOV kept, every pixel holds the time its
+    samples took and the intersection tests they made. write_heatmap shows
+    one of the two per sample as a false-colour PPM, black through red and
+    yellow to white, and writes the raw values next to it as a greyscale
+    PFM. The ramp tops out at the 99th percentile so a few stray pixels do
+    not wash out the rest.
+*/
+
+enum heatmap_metric { HEAT_TIME, HEAT_TESTS };
+
+// black -> red -> yellow -> white for t in [0, 1]
+inline vec3 heat_colour(double t) {
+    t = std::min(1.0, std::max(0.0, t)) * 3;
+    return vec3(std::min(1.0, t), std::min(1.0, std::max(0.0, t - 1)), std::max(0.0, t - 2));
+}
+
+// raw floats as a little-endian greyscale PFM, rows bottom to top as the format wants
+inline bool write_pfm(const std::string& path, const std::vector<float>& values, int nx, int ny) {
+    std::ofstream out(path.c_str(), std::ios::binary);
+    out << "Pf\n" << nx << ' ' << ny << "\n-1.0\n";
+    std::string row;
+    for (int y = ny - 1; y >= 0; y--) {
+        row.clear();
+        for (int x = 0; x < nx; x++)
+            put_f32(row, values[size_t(y) * nx + x]);
+        out.write(row.data(), row.size());
+    }
+    return bool(out);
+}
+
+// writes the heatmap to path and the raw values to path with a .pfm
+// extension; a summary of the cost goes to log
+inline bool write_heatmap(const framebuffer& fb, heatmap_metric metric, const std::string& path, std::ostream& log) {
+    const int nx = fb.width();
+    const int ny = fb.height();
+    size_t n = size_t(nx) * ny;
+    std::vector<float> values(n);
+    double total = 0;
+    size_t hottest = 0;
+    for (size_t p = 0; p < n; p++) {
+        values[p] = float(metric == HEAT_TIME ? fb.cost_time(p) : fb.cost_tests(p));
+        total += values[p];
+        if (values[p] > values[hottest])
+            hottest = p;
+    }
+
+    std::vector<float> sorted(values);
+    std::nth_element(sorted.begin(), sorted.begin() + (n * 99) / 100, sorted.end());
+    float top = std::max(sorted[(n * 99) / 100], 1e-6f);
+    std::vector<vec3> colour(n);
+    for (size_t p = 0; p < n; p++) {
+        // write_ppm applies gamma 2, so the ramp is squared to come out as is
+        vec3 c = heat_colour(values[p] / top);
+        colour[p] = c * c;
+    }
+
+    const char* unit = metric == HEAT_TIME ? " ns" : " tests";
+    log << "Cost per sample: mean " << total / n << unit << ", 99th percentile " << top << unit
+        << ", max " << values[hottest] << unit << " at (" << hottest % nx << ", " << hottest / nx << ")\n";
+
+    std::string raw = path;
+    size_t dot = raw.find_last_of("./");
+    if (dot != std::string::npos && raw[dot] == '.')
+        raw.erase(dot);
+    raw += ".pfm";
+    return write_ppm_file(path, colour, nx, ny) && write_pfm(raw, values, nx, ny);
+}
+
+#endif
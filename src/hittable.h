@@ -4,17 +4,26 @@
 #include "ray.h"
 
 class material;
+class scene;
 
 struct hit_record {
     double t;
     vec3 p;
     vec3 normal;
     material *mat_ptr;
+    // id into the material arrays of a compiled scene (see scene.h)
+    int mat_id;
+    // texture coordinates, and how many of their units one unit of
+    // distance on the surface covers, for picking a texture's level
+    double u, v;
+    double uv_scale;
 };
 
 class hittable {
     public:
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+        // lowers this object into the flat arrays of a scene
+        virtual void compile(scene& s) const = 0;
 };
 
-#endif
\ No newline at end of file
+#endif
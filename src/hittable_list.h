@@ -8,6 +8,7 @@ class hittable_list: public hittable {
         hittable_list() {}
         hittable_list(hittable **l, int n) : list(l), list_size(n) {}
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void compile(scene& s) const;
 
     public:
         hittable **list;
@@ -15,14 +16,13 @@ class hittable_list: public hittable {
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+    // hit() only writes rec on success, so each closer hit simply overwrites it
     bool hit_anything = false;
     double closest_so_far = t_max;
     for (int i = 0; i < list_size; i++) {
-        if (list[i]->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (list[i]->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
     return hit_anything;
@@ -0,0 +1,165 @@
+#ifndef IRRADIANCEH
+#define IRRADIANCEH
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include "vec3.h"
+#include "sampler.h"
+
+/*
+    Irradiance cache (Ward et al. 1988). Indirect diffuse light changes
+    slowly across a surface, so it is estimated with many rays at a few
+    points and interpolated in between. A record keeps the mean radiance
+    arriving over the hemisphere of its normal, cosine weighted, and the
+    radius it stays valid in. A lookup blends the records near the point
+    whose error estimate
+
+        |p - p_i| / radius_i + sqrt(1 - n.n_i) / max_error
+
+    is below 1. A record's radius follows the distance to what its rays
+    saw (the harmonic mean, times max_error), so records crowd into
+    corners and thin out across open floors. It is clamped to a few
+    pixels' footprint so records neither smear detail nor bunch up.
+
+    Records sit in a hash grid with one level per power-of-two radius. A
+    record goes into every cell of its level that its sphere touches, at
+    most eight, and a lookup reads one cell per level in use. Inserts
+    push onto a cell's list with a compare-and-swap and readers walk the
+    lists without locks; a record is written out before it is linked in
+    and never changes after. Two threads may both compute a record for
+    the same spot, which only costs time. What is cached depends on the
+    order threads get to points, so renders with the cache are not
+    bit-for-bit repeatable.
+*/
+
+// rays per record, as a jittered square grid over the hemisphere
+const int irradiance_grid = 16;
+// radius clamps, in pixel footprints at the record
+const double irradiance_min_pixels = 1.5;
+const double irradiance_max_pixels = 20;
+
+class irradiance_cache {
+    public:
+        irradiance_cache(double max_error, int max_records = 1 << 18);
+
+        double max_error() const { return error; }
+        int size() const { return std::min(record_count.load(std::memory_order_relaxed), capacity); }
+
+        // blends the records valid at p with normal n; false if there are none
+        bool lookup(const vec3& p, const vec3& n, vec3& value) const;
+        // Adds a record. distance is the harmonic mean distance its rays
+        // saw and footprint the width of a pixel at p. Once the cache is
+        // full, nothing is added.
+        void insert(const vec3& p, const vec3& n, const vec3& value, double distance, double footprint);
+
+    private:
+        struct record {
+            vec3 p, n, value;
+            double radius;
+        };
+        static const int bucket_bits = 20;
+        // a record touches at most eight cells, most of them fewer
+        static const int links_per_record = 6;
+
+        uint32_t bucket(int level, int64_t x, int64_t y, int64_t z) const {
+            uint32_t h = hash_combine(hash_combine(hash_combine(uint32_t(level), uint32_t(x)), uint32_t(y)), uint32_t(z));
+            return h & ((1u << bucket_bits) - 1);
+        }
+        static int level_of(double radius) {
+            return int(ceil(log2(2 * radius)));
+        }
+
+    private:
+        double error;
+        int capacity;
+        std::unique_ptr<record[]> records;
+        std::atomic<int> record_count;
+        // list links: the record each one points at and the link after it
+        std::unique_ptr<int[]> link_record, link_next;
+        std::atomic<int> link_count;
+        std::unique_ptr<std::atomic<int>[]> heads;
+        // the range of grid levels holding records
+        std::atomic<int> min_level, max_level;
+};
+
+inline irradiance_cache::irradiance_cache(double max_error, int max_records)
+: error(max_error), capacity(max_records), records(new record[max_records]), record_count(0),
+  link_record(new int[size_t(max_records) * links_per_record]), link_next(new int[size_t(max_records) * links_per_record]),
+  link_count(0), heads(new std::atomic<int>[size_t(1) << bucket_bits]), min_level(1 << 30), max_level(-(1 << 30)) {
+    for (size_t b = 0; b < (size_t(1) << bucket_bits); b++)
+        heads[b].store(-1, std::memory_order_relaxed);
+}
+
+inline bool irradiance_cache::lookup(const vec3& p, const vec3& n, vec3& value) const {
+    int lo = min_level.load(std::memory_order_acquire);
+    int hi = max_level.load(std::memory_order_acquire);
+    vec3 sum(0,0,0);
+    double total = 0;
+    for (int level = lo; level <= hi; level++) {
+        double cell = ldexp(1.0, level);
+        int64_t x = int64_t(floor(p.x() / cell)), y = int64_t(floor(p.y() / cell)), z = int64_t(floor(p.z() / cell));
+        for (int k = heads[bucket(level, x, y, z)].load(std::memory_order_acquire); k >= 0; k = link_next[k]) {
+            const record& r = records[link_record[k]];
+            vec3 d = p - r.p;
+            // a record in front of the surface at p sees other things
+            if (dot(d, r.n + n) < -0.05 * r.radius)
+                continue;
+            double e = d.length() / r.radius + sqrt(std::max(0.0, 1 - dot(n, r.n))) / error;
+            if (e >= 1)
+                continue;
+            // falls to zero at the edge, so the blend has no seams
+            double w = std::min(1e6, 1 / std::max(e, 1e-6) - 1);
+            sum += w * r.value;
+            total += w;
+        }
+    }
+    if (total <= 0)
+        return false;
+    value = sum / total;
+    return true;
+}
+
+inline void irradiance_cache::insert(const vec3& p, const vec3& n, const vec3& value, double distance, double footprint) {
+    int slot = record_count.fetch_add(1, std::memory_order_relaxed);
+    if (slot >= capacity)
+        return;
+    record& r = records[slot];
+    r.p = p;
+    r.n = n;
+    r.value = value;
+    r.radius = std::min(irradiance_max_pixels * footprint, std::max(irradiance_min_pixels * footprint, error * distance));
+    if (!(r.radius > 0))
+        r.radius = 1e-6;
+
+    int level = level_of(r.radius);
+    double cell = ldexp(1.0, level);
+    int64_t x0 = int64_t(floor((p.x() - r.radius) / cell)), x1 = int64_t(floor((p.x() + r.radius) / cell));
+    int64_t y0 = int64_t(floor((p.y() - r.radius) / cell)), y1 = int64_t(floor((p.y() + r.radius) / cell));
+    int64_t z0 = int64_t(floor((p.z() - r.radius) / cell)), z1 = int64_t(floor((p.z() + r.radius) / cell));
+    // widen the level range before linking, so a reader that finds the
+    // record also looks at its level
+    int lo = min_level.load(std::memory_order_relaxed);
+    while (level < lo && !min_level.compare_exchange_weak(lo, level, std::memory_order_release)) {}
+    int hi = max_level.load(std::memory_order_relaxed);
+    while (level > hi && !max_level.compare_exchange_weak(hi, level, std::memory_order_release)) {}
+    for (int64_t x = x0; x <= x1; x++) {
+        for (int64_t y = y0; y <= y1; y++) {
+            for (int64_t z = z0; z <= z1; z++) {
+                int k = link_count.fetch_add(1, std::memory_order_relaxed);
+                if (k >= capacity * links_per_record)
+                    return;
+                link_record[k] = slot;
+                std::atomic<int>& head = heads[bucket(level, x, y, z)];
+                int next = head.load(std::memory_order_relaxed);
+                do {
+                    link_next[k] = next;
+                } while (!head.compare_exchange_weak(next, k, std::memory_order_release, std::memory_order_relaxed));
+            }
+        }
+    }
+}
+
+#endif
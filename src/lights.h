@@ -0,0 +1,69 @@
+#ifndef LIGHTSH
+#define LIGHTSH
+
+#include <memory>
+#include <vector>
+#include "environment.h"
+#include "material.h"
+#include "sampler.h"
+
+/*
+    The lights of a scene. A shading point traces one shadow ray to one
+    light, so its cost does not grow with the number of lights. The light
+    is picked in proportion to its power from an alias table, which takes
+    one sampler dimension and constant time, and the light's contribution
+    is divided by the chance it had of being picked. A scene with a single
+    light draws nothing from the sampler and renders exactly as it did
+    before there were several.
+
+    The environment map, when the scene has one, lights the scene from
+    every direction. It is sampled on its own (see environment.h).
+*/
+
+class light_list {
+    public:
+        void add(const light& l) { lights.push_back(l); }
+        // builds the alias table; call it once all lights are added
+        void build();
+
+        int size() const { return int(lights.size()); }
+        const light& operator[](int i) const { return lights[i]; }
+
+        // picks the light for one shading point and sets pdf to the chance it had
+        const light& pick(sampler& smp, double& pdf) const;
+
+        // replaces the sky gradient when set
+        std::shared_ptr<const environment_map> environment;
+
+    private:
+        static double power(const light& l);
+
+    private:
+        std::vector<light> lights;
+        alias_table table;
+};
+
+// what a light gives off, up to a common factor; a spot only lights its cone
+inline double light_list::power(const light& l) {
+    double p = luminance(l.lightColour);
+    if (l.type == LIGHT_SPOT)
+        p *= 0.5 * (1 - l.cosOuter);
+    return p;
+}
+
+inline void light_list::build() {
+    std::vector<double> powers(lights.size());
+    for (size_t i = 0; i < lights.size(); i++)
+        powers[i] = power(lights[i]);
+    table.build(powers);
+}
+
+inline const light& light_list::pick(sampler& smp, double& pdf) const {
+    if (lights.size() == 1) {
+        pdf = 1.0;
+        return lights[0];
+    }
+    return lights[table.pick(smp.get_1d(), pdf)];
+}
+
+#endif
@@ -2,6 +2,14 @@
 #include <random>
 #include <limits>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
 
 #include "torus.h"
 #include "sphere.h"
@@ -10,47 +18,25 @@
 #include "camera.h"
 #include "hittable_list.h"
 #include "material.h"
+#include "scene.h"
+#include "arena.h"
+#include "sampler.h"
+#include "render.h"
+#include "denoise.h"
+#include "heatmap.h"
+#include "thread_pool.h"
+#include "framebuffer.h"
+#include "distributed.h"
+#include "scene_file.h"
+#include "daemon.h"
+#include "stats.h"
+#include "trace.h"
+#include "texture.h"
 
-
-vec3 ray_color(const ray& r, hittable *world, light l, int depth) {
-    hit_record rec;
-    if (depth > 50)
-        return vec3(0,0,0);
-    if (world->hit(r, 0.001, std::numeric_limits<double>::infinity(), rec)) {
-        ray scattered;
-        vec3 attenuation;
-
-        vec3 lightPos = l.lightVector;
-        vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-        vec3 lightColour = l.lightColour;
-        vec3 viewVector = unit_vector(-r.direction());
-        vec3 specular;
-        double NLAngle;
-        ray shadowRay;
-
-        rec.mat_ptr->blinn(rec, l, viewVector, shadowRay, specular, NLAngle);
-        double contribution = 1.0;
-
-        hit_record temp = rec;
-        if (world->hit(shadowRay, 0.001, std::numeric_limits<double>::infinity(), temp)) {
-            contribution = 0.2;
-            specular *= 0.0;
-        }
-        contribution = (NLAngle == 1.0) ? contribution : NLAngle;
-        if (rec.mat_ptr->scatter(r, rec, contribution, attenuation, scattered)) {
-            return attenuation * ray_color(scattered, world, l, depth+1) + specular;
-        } 
-        return vec3(0,0,0);
-    }
-    vec3 unit_direction = unit_vector(r.direction());
-    double t = 0.5 * (unit_direction.y() + 1.0);
-    return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t*vec3(0.5, 0.7, 1.0);
-}
-
-hittable *random_scene() {
+hittable *random_scene(arena& scene_arena) {
     int n = 500;
-    hittable **list = new hittable*[n+1];
-    list[0] = new sphere(vec3(0,-1000,0), 1000, new lambertian((vec3(0.5,0.5,0.5))));
+    hittable **list = scene_arena.make_array<hittable*>(n+1);
+    list[0] = scene_arena.make<sphere>(vec3(0,-1000,0), 1000, scene_arena.make<lambertian>(vec3(0.5,0.5,0.5)));
     int i = 1;
     for (int a = -11; a < 11; a++) {
         for (int b = -11; b < 11; b++) {
@@ -59,72 +45,466 @@ hittable *random_scene() {
             if ((center - vec3(4,2,0)).length() > 0.9) {
                 if (choose_mat < 0.8) {     
                     //diffuse
-                    list[i++] = new sphere(center, 0.2, new lambertian(vec3(
+                    list[i++] = scene_arena.make<sphere>(center, 0.2, scene_arena.make<lambertian>(vec3(
                         random_double()*random_double(),random_double()*random_double(),random_double()*random_double())));
                 } 
                 else if (choose_mat < 0.95) {   
                     //metal
-                    list[i++] = new sphere(center, 0.2, new metal(vec3(
+                    list[i++] = scene_arena.make<sphere>(center, 0.2, scene_arena.make<metal>(vec3(
                         0.5*(1+random_double()),0.5*(1+random_double()),0.5*(1+random_double())), 0.5*random_double()));
                 }
                 else { 
                     //glass
-                    list[i++] = new sphere(center, 0.2, new dielectric(1.5));
+                    list[i++] = scene_arena.make<sphere>(center, 0.2, scene_arena.make<dielectric>(1.5));
                 }
             }
         }
     }
 
-    list[i++] = new sphere(vec3(0,1,0), 1.0, new dielectric(1.5));
-    list[i++] = new sphere(vec3(-4,1,0), 1.0, new lambertian(vec3(0.4,0.2,0.1)));
-    list[i++] = new sphere(vec3(4,1,0), 1.0, new metal(vec3(0.7,0.6,0.0), 0.0));
+    list[i++] = scene_arena.make<sphere>(vec3(0,1,0), 1.0, scene_arena.make<dielectric>(1.5));
+    list[i++] = scene_arena.make<sphere>(vec3(-4,1,0), 1.0, scene_arena.make<lambertian>(vec3(0.4,0.2,0.1)));
+    list[i++] = scene_arena.make<sphere>(vec3(4,1,0), 1.0, scene_arena.make<metal>(vec3(0.7,0.6,0.0), 0.0));
 
-    return new hittable_list(list, i);
+    return scene_arena.make<hittable_list>(list, i);
 }
 
-int main () {
-    int nx = 600; 
-    int ny = 300;
-    int ns = 150;
-
-    std::cout << "P3\n" << nx << ' ' << ny << "\n255\n";
-
-    light l = {1, vec3(0,6,0), vec3(1,1,1)};
-    hittable *list[5];
-    list[0] = new sphere(vec3(0,-101.5,-2), 100, new lambertian(vec3(0.8,0.8,0.0)));
-    list[1] = new sphere(vec3(2,-1,-1), 0.5, new blinn_metal(vec3(0.8,0.6,0.2), 0, 20.0));
-    list[2] = new sphere(vec3(-2,-1,-1), 0.5, new blinn_dielectric(1.5,20.0));
-    list[3] = new sphere(vec3(0,-1,1), 0.5, new blinn_lambertian(vec3(0.2,0.2,0.8), 20.0));
-    list[4] = new cube(vec3(-0.5,-0.5,-2),vec3(-0.5,-1.5,-2),vec3(0.5,-1.5,-2),new blinn_lambertian(vec3(1.0,0,0), 20.0));
-    //list[1] = new torus(vec3(0,0,0),vec3(0,0,1), 1, 0.5, new blinn_lambertian(vec3(0.7,0.7,0.9), 20.0));
-    hittable *world = new hittable_list(list, 5);
-    //world = random_scene();
-
-    vec3 lookfrom = vec3(-3, 1, 5);
-    vec3 lookat = vec3(0,-0.5,-1);
-    double dist_to_focus = (lookfrom-lookat).length();
-    double apeture = 0.1;
-    camera cam = camera(lookfrom, lookat, vec3(0,1,0), 40, double(nx)/double(ny), apeture, dist_to_focus);
-
-    for (int j = ny-1; j >= 0; j--) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush;
-    	for (int i = 0; i < nx; i++) {
-            vec3 col = vec3(0,0,0);
-            for (int s = 0; s < ns; s++) {
-                double u = double(i + random_double()) / double(nx);
-                double v = double(j + random_double()) / double(ny);
-                ray r = cam.get_ray(u,v);
-                vec3 p = r.point_at_parameter(2.0);
-                col += ray_color(r, world, l, 0);
+int main (int argc, char **argv) {
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    render_job job;
+    int threads = 0;
+    std::string aov_path;
+    unsigned aovs = 0;
+    std::string checkpoint_path;
+    bool resume = false;
+    double checkpoint_every = 30;
+    int workers = 0;
+    std::string daemon_socket;
+    std::string submit_socket;
+    std::string output_path;
+    double time_budget = 0;
+    double target_noise = 0;
+    bool stats_to_stderr = false;
+    std::string stats_json;
+    double stats_every = 1;
+    std::string heatmap_path;
+    heatmap_metric heat_metric = HEAT_TIME;
+    std::string trace_path;
+    // -1 keeps the scene's own choice
+    int integrator = -1;
+    std::string texture_in, texture_out;
+    double texture_cache_mb = 64;
+    std::string chunks_in, chunks_out;
+    double geometry_cache_mb = 1024;
+    double irradiance_error = 0;
+    bool guiding = false;
+    int photon_count = 0;
+    int bvh_bits = 8;
+
+    for (int a = 1; a < argc; a++) {
+        std::string arg = argv[a];
+        if (arg == "--scene" && a+1 < argc) {
+            job.scene_name = argv[++a];
+        } else if (arg == "--width" && a+1 < argc) {
+            job.nx = atoi(argv[++a]);
+        } else if (arg == "--height" && a+1 < argc) {
+            job.ny = atoi(argv[++a]);
+        } else if (arg == "--spp" && a+1 < argc) {
+            job.ns = atoi(argv[++a]);
+        } else if (arg == "--sampler" && a+1 < argc) {
+            job.sampler_name = argv[++a];
+        } else if (arg == "--threads" && a+1 < argc) {
+            threads = atoi(argv[++a]);
+        } else if (arg == "--denoise") {
+            job.denoise = true;
+        } else if (arg == "--aov-file" && a+1 < argc) {
+            aov_path = argv[++a];
+        } else if (arg == "--aovs" && a+1 < argc && parse_aovs(argv[a+1], aovs)) {
+            a++;
+        } else if (arg == "--checkpoint" && a+1 < argc) {
+            checkpoint_path = argv[++a];
+        } else if (arg == "--checkpoint-every" && a+1 < argc) {
+            checkpoint_every = atof(argv[++a]);
+        } else if (arg == "--resume") {
+            resume = true;
+        } else if (arg == "--workers" && a+1 < argc) {
+            workers = atoi(argv[++a]);
+        } else if (arg == "--daemon" && a+1 < argc) {
+            daemon_socket = argv[++a];
+        } else if (arg == "--submit" && a+1 < argc) {
+            submit_socket = argv[++a];
+        } else if (arg == "--output" && a+1 < argc) {
+            output_path = argv[++a];
+        } else if (arg == "--time-budget" && a+1 < argc) {
+            time_budget = atof(argv[++a]);
+        } else if (arg == "--target-noise" && a+1 < argc) {
+            target_noise = atof(argv[++a]);
+        } else if (arg == "--stats") {
+            stats_to_stderr = true;
+        } else if (arg == "--stats-json" && a+1 < argc) {
+            stats_json = argv[++a];
+        } else if (arg == "--stats-every" && a+1 < argc) {
+            stats_every = atof(argv[++a]);
+        } else if (arg == "--integrator" && a+1 < argc && (std::string(argv[a+1]) == "blinn" || std::string(argv[a+1]) == "path")) {
+            integrator = std::string(argv[++a]) == "path" ? INTEGRATOR_PATH : INTEGRATOR_BLINN;
+        } else if (arg == "--trace" && a+1 < argc) {
+            trace_path = argv[++a];
+        } else if (arg == "--heatmap" && a+1 < argc) {
+            heatmap_path = argv[++a];
+        } else if (arg == "--heatmap-metric" && a+1 < argc && (std::string(argv[a+1]) == "time" || std::string(argv[a+1]) == "tests")) {
+            heat_metric = std::string(argv[++a]) == "time" ? HEAT_TIME : HEAT_TESTS;
+        } else if (arg == "--make-texture" && a+2 < argc) {
+            texture_in = argv[++a];
+            texture_out = argv[++a];
+        } else if (arg == "--irradiance-cache" && a+1 < argc) {
+            irradiance_error = atof(argv[++a]);
+        } else if (arg == "--guide") {
+            guiding = true;
+        } else if (arg == "--photons" && a+1 < argc) {
+            photon_count = atoi(argv[++a]);
+        } else if (arg == "--bvh" && a+1 < argc && (std::string(argv[a+1]) == "8" || std::string(argv[a+1]) == "16"
+                                                     || std::string(argv[a+1]) == "off")) {
+            bvh_bits = atoi(argv[++a]);
+        } else if (arg == "--make-chunks" && a+2 < argc) {
+            chunks_in = argv[++a];
+            chunks_out = argv[++a];
+        } else if (arg == "--geometry-cache" && a+1 < argc) {
+            geometry_cache_mb = atof(argv[++a]);
+        } else if (arg == "--texture-cache" && a+1 < argc) {
+            texture_cache_mb = atof(argv[++a]);
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--scene default|FILE] [--width N] [--height N]"
+                      << " [--spp N] [--sampler random|stratified|sobol|bluenoise]"
+                      << " [--threads N] [--denoise] [--aov-file FILE.exr]"
+                      << " [--aovs depth,normal,albedo,samples,direct,indirect,variance,cost|all]"
+                      << " [--checkpoint FILE [--resume] [--checkpoint-every SECONDS]] [--workers N]"
+                      << " [--daemon SOCKET | --submit SOCKET < JOB] [--output FILE.ppm]"
+                      << " [--time-budget SECONDS] [--target-noise LEVEL]"
+                      << " [--stats] [--stats-json FILE] [--stats-every SECONDS]"
+                      << " [--heatmap FILE.ppm [--heatmap-metric time|tests]] [--trace FILE.json]"
+                      << " [--integrator blinn|path] [--guide] [--photons N] [--irradiance-cache ERROR] [--bvh 8|16|off] [--texture-cache MB] [--make-texture IMAGE FILE.tex]"
+                      << " [--geometry-cache MB] [--make-chunks PARTICLES FILE.pck]\n";
+            return 1;
+        }
+    }
+    if (resume && checkpoint_path.empty()) {
+        std::cerr << "--resume needs --checkpoint FILE\n";
+        return 1;
+    }
+    if (job.nx < 1 || job.ny < 1) {
+        std::cerr << "bad image size\n";
+        return 1;
+    }
+
+    if (!texture_in.empty()) {
+        std::string error;
+        if (!make_texture(texture_in, texture_out, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    texture_cache::global().set_capacity(size_t(std::max(1.0, texture_cache_mb) * 1024 * 1024));
+    if (!chunks_in.empty()) {
+        std::string error;
+        if (!make_chunks(chunks_in, chunks_out, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+    chunk_cache::global().set_capacity(size_t(std::max(1.0, geometry_cache_mb) * 1024 * 1024));
+
+    if (!submit_socket.empty()) {
+        std::ostringstream request;
+        request << std::cin.rdbuf();
+        std::string error;
+        if (!submit_job(submit_socket, request.str(), std::cout, std::cerr, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!trace_path.empty()) {
+        trace_log::global().start();
+        trace_thread_name("main");
+    }
+    thread_pool pool(threads);
+    if (!daemon_socket.empty()) {
+        render_daemon daemon(pool);
+        std::string error;
+        if (!daemon.serve(daemon_socket, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+        return 0;
+    }
+
+    int nx = job.nx;
+    int ny = job.ny;
+    int ns = job.ns;
+    // one sampler per thread; they carry per-path state
+    std::vector<std::unique_ptr<sampler> > samplers;
+    for (int t = 0; t < pool.size(); t++)
+        samplers.push_back(std::unique_ptr<sampler>(make_sampler(job.sampler_name, ns, 0)));
+    if (!samplers[0] || ns < 1) {
+        std::cerr << "unknown sampler '" << job.sampler_name << "' or bad sample count\n";
+        return 1;
+    }
+
+    // the hittables only describe the scene; once compiled they are released together
+    arena scene_arena;
+    hittable *world;
+    light_list l;
+    std::string scene_text, scene_error;
+    int scene_integrator;
+    {
+        trace_span span("load scene", "scene");
+        if (!scene_source(job.scene_name, scene_text, scene_error)
+            || !parse_scene(scene_text, scene_arena, world, l, scene_integrator, scene_error)) {
+            std::cerr << scene_error << "\n";
+            return 1;
+        }
+    }
+    //world = random_scene(scene_arena);
+    scene world_scene;
+    world_scene.bvh_bits = bvh_bits;
+    {
+        trace_span span("compile scene", "scene");
+        world->compile(world_scene);
+    }
+    world_scene.integrator = integrator >= 0 ? integrator : scene_integrator;
+    if (irradiance_error > 0)
+        world_scene.irradiance = std::shared_ptr<irradiance_cache>(new irradiance_cache(irradiance_error));
+    if (guiding) {
+        // the guide learns from the bounces of this process only
+        if (world_scene.integrator != INTEGRATOR_PATH || workers > 0) {
+            std::cerr << "--guide needs the path integrator and no --workers\n";
+            return 1;
+        }
+        world_scene.guiding = std::shared_ptr<path_guide>(new path_guide(pool.size()));
+    }
+    if (photon_count > 0) {
+        if (world_scene.integrator != INTEGRATOR_PATH) {
+            std::cerr << "--photons needs the path integrator\n";
+            return 1;
+        }
+        // forked workers inherit the map
+        trace_span span("trace photons", "scene");
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        world_scene.photons = trace_caustic_photons(world_scene, l, photon_count, pool);
+        std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+        span.arg("stored", world_scene.photons->size());
+        std::cerr << "Photons: " << world_scene.photons->size() << " caustic photons stored of " << photon_count << " traced, "
+                  << world_scene.photons->bytes_used() / 1024.0 << " KB, " << took.count() << " ms\n";
+    }
+    size_t particle_count = 0;
+    uint64_t streamed_bytes = 0;
+    int streamed_chunks = 0;
+    for (size_t c = 0; c < world_scene.clouds.size(); c++) {
+        particle_count += world_scene.clouds[c].size();
+        if (world_scene.clouds[c].chunks) {
+            streamed_bytes += world_scene.clouds[c].chunks->bytes_on_disk();
+            streamed_chunks += world_scene.clouds[c].chunks->chunk_count();
+        }
+    }
+    if (streamed_bytes > 0)
+        std::cerr << "Streaming: " << streamed_chunks << " chunks, " << streamed_bytes / 1048576.0
+                  << " MB of chunks through a " << std::max(1.0, geometry_cache_mb) << " MB cache\n";
+    std::cerr << "Scene: " << world_scene.spheres.size() << " spheres, "
+              << world_scene.triangles.size() << " triangles, "
+              << world_scene.tori.size() << " tori, "
+              << world_scene.boxes.size() << " boxes, "
+              << particle_count << " particles, "
+              << world_scene.materials.size() << " materials, "
+              << world_scene.accel.node_count() << " BVH nodes, "
+              << world_scene.bytes_used() / 1024.0 << " KB"
+              << " (front-end arena " << scene_arena.bytes_used() / 1024.0 << " KB used, "
+              << scene_arena.bytes_reserved() / 1024.0 << " KB reserved)\n";
+    scene_arena.release();
+
+    camera cam = job.make_camera();
+
+    // the denoiser needs its guides whether or not they are written out
+    if (!aov_path.empty() && aovs == 0)
+        aovs = AOV_ALL;
+    if (job.denoise)
+        aovs |= AOV_DEPTH | AOV_NORMAL | AOV_ALBEDO | AOV_VARIANCE;
+    if (target_noise > 0)
+        aovs |= AOV_VARIANCE;
+    if (!heatmap_path.empty())
+        aovs |= AOV_COST;
+    // a checkpoint keeps every output, so a resumed run may ask for any of them
+    if (!checkpoint_path.empty())
+        aovs = AOV_ALL;
+    framebuffer image(nx, ny, aovs);
+    if (!checkpoint_path.empty()) {
+        // samples only add up if they are of the same image: same scene,
+        // camera and integrator. Stratified samples are laid out for one
+        // sample count, so a stratified checkpoint cannot take more.
+        std::ostringstream job_text;
+        job_text.precision(17);
+        job_text << content_hash(scene_text) << ' ' << job.lookfrom << ' ' << job.lookat << ' ' << job.vfov << ' ' << job.aperture
+                 << " integrator=" << world_scene.integrator << " photons=" << photon_count << " guide=" << guiding
+                 << " irradiance=" << irradiance_error;
+        std::ostringstream settings;
+        settings << "sampler=" << job.sampler_name << " seed=0";
+        if (job.sampler_name == "stratified")
+            settings << " spp=" << ns;
+        settings << " job=" << std::hex << content_hash(job_text.str());
+        std::string error;
+        if (!image.map_file(checkpoint_path, settings.str(), resume, error)) {
+            std::cerr << error << "\n";
+            return 1;
+        }
+    }
+    std::mutex progress_lock;
+    std::chrono::steady_clock::time_point last_checkpoint = std::chrono::steady_clock::now();
+    std::function<void(int, int)> progress = [&](int done, int total) {
+        stats_registry::global().set_progress(done, total);
+        std::lock_guard<std::mutex> guard(progress_lock);
+        if (!stats_to_stderr)
+            std::cerr << "\rTiles remaining: " << total - done << ' ' << std::flush;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (!checkpoint_path.empty() && std::chrono::duration<double>(now - last_checkpoint).count() >= checkpoint_every) {
+            trace_span span("checkpoint", "output");
+            image.checkpoint();
+            last_checkpoint = now;
+        }
+    };
+    std::function<bool(int, const std::function<bool()>&)> render_pass = [&](int target, const std::function<bool()>& stop) {
+        trace_span span("pass", "render");
+        span.arg("spp", target);
+        if (workers > 0) {
+            std::string error;
+            if (!render_with_workers(world_scene, cam, l, make_tiles(nx, ny, 32), target, job.sampler_name, workers, image, progress, stop, error)) {
+                std::cerr << error << "\n";
+                return false;
+            }
+        } else {
+            render_tiles(world_scene, cam, l, target, samplers, pool, image, progress, stop);
+        }
+        std::cerr << "\n";
+        if (!checkpoint_path.empty()) {
+            trace_span flush("checkpoint", "output");
+            image.checkpoint();
+        }
+        // the last pass has nothing left to guide
+        if (world_scene.guiding && target < ns) {
+            trace_span learn("update guide", "render");
+            world_scene.guiding->update();
+            span.arg("guide_leaves", world_scene.guiding->leaves());
+        }
+        return true;
+    };
+    // the mean colour, denoised if asked for
+    std::function<std::vector<vec3>()> resolve = [&]() {
+        std::vector<vec3> colour(size_t(nx) * ny);
+        for (size_t p = 0; p < colour.size(); p++)
+            colour[p] = image.colour(p);
+        if (job.denoise) {
+            trace_span span("denoise", "denoise");
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            atrous_denoiser denoiser(nx, ny, denoise_settings());
+            denoiser.run(image, colour, pool);
+            std::chrono::duration<double, std::milli> took = std::chrono::steady_clock::now() - start;
+            std::cerr << "Denoise: " << took.count() << " ms\n";
+        }
+        return colour;
+    };
+
+    stats_reporter reporter(stats_every, stats_to_stderr, stats_json);
+    if (stats_to_stderr || !stats_json.empty())
+        reporter.start();
+
+    // the guide learns between passes, so a guided render is progressive too
+    bool progressive = time_budget > 0 || target_noise > 0 || guiding;
+    if (!progressive) {
+        if (!render_pass(ns, std::function<bool()>()))
+            return 1;
+    } else {
+        // Progressive: passes double the samples per pixel, up to ns, and the
+        // image is written after each one. A pass that would run past the
+        // deadline is cut down to the samples that should still fit, and
+        // tiles not started by the deadline are skipped. The first pass is
+        // always finished, so even a budget spent on loading the scene
+        // leaves one sample in every pixel.
+        typedef std::chrono::steady_clock clock;
+        clock::time_point deadline = started + std::chrono::microseconds((long long)(time_budget * 1e6));
+        std::function<bool()> past_deadline = [&]() { return time_budget > 0 && clock::now() >= deadline; };
+        int done = 0;
+        double render_seconds = 0;
+        for (int pass = 1; done < ns; pass++) {
+            int target = std::min(ns, std::max(1, 2 * done));
+            if (time_budget > 0 && done > 0) {
+                double per_sample = render_seconds / done;
+                double left = std::chrono::duration<double>(deadline - clock::now()).count();
+                // clamped before the conversion; left / per_sample can be past any int
+                target = int(std::min<double>(target, done + left / std::max(per_sample, 1e-9)));
+                if (target <= done)
+                    break;
+            }
+            clock::time_point pass_start = clock::now();
+            if (!render_pass(target, done > 0 ? past_deadline : std::function<bool()>()))
+                return 1;
+            std::chrono::duration<double> took = clock::now() - pass_start;
+            render_seconds += took.count();
+            done = target;
+            bool cut = past_deadline();
+
+            std::cerr << "Pass " << pass << ": " << done << " spp, " << took.count() * 1000 << " ms";
+            double noise = 0;
+            if (image.has(AOV_VARIANCE)) {
+                noise = image.noise_level();
+                std::cerr << ", noise " << noise;
             }
-            col /= double(ns);
-            col = vec3(sqrt(col[0]), sqrt(col[1]), sqrt(col[2]));
-    		int ir = int(255.99*col[0]);
-    		int ig = int(255.99*col[1]);
-    		int ib = int(255.99*col[2]);
-    		std::cout << ir << " " << ig << " " << ib << "\n";
-    	}
-    }
-	
+            std::cerr << (cut ? " (deadline)" : "") << "\n";
+            if (!output_path.empty()) {
+                std::vector<vec3> colour = resolve();
+                trace_span span("write image", "output");
+                if (!write_ppm_file(output_path, colour, nx, ny)) {
+                    std::cerr << "could not write " << output_path << "\n";
+                    return 1;
+                }
+            }
+            // two or three samples say too little about the noise to stop on
+            if (cut || (target_noise > 0 && done >= 4 && noise <= target_noise))
+                break;
+        }
+    }
+
+    reporter.stop();
+
+    if (!aov_path.empty()) {
+        trace_span span("write aovs", "output");
+        if (!image.write_exr(aov_path)) {
+            std::cerr << "could not write " << aov_path << "\n";
+            return 1;
+        }
+    }
+    if (!heatmap_path.empty()) {
+        trace_span span("write heatmap", "output");
+        if (!write_heatmap(image, heat_metric, heatmap_path, std::cerr)) {
+            std::cerr << "could not write " << heatmap_path << "\n";
+            return 1;
+        }
+    }
+
+    // a progressive render has written its file after every pass already
+    if (output_path.empty() || !progressive) {
+        std::vector<vec3> colour = resolve();
+        trace_span span("write image", "output");
+        if (output_path.empty()) {
+            write_ppm(std::cout, colour, nx, ny);
+            std::cout.flush();
+        } else if (!write_ppm_file(output_path, colour, nx, ny)) {
+            std::cerr << "could not write " << output_path << "\n";
+            return 1;
+        }
+    }
+    if (!trace_path.empty() && !trace_log::global().write(trace_path)) {
+        std::cerr << "could not write " << trace_path << "\n";
+        return 1;
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -1,311 +1,254 @@
 #ifndef MATERIALH
 #define MATERIALH
 
-#include <vector>
 #include "ray.h"
 #include "hittable.h"
+#include "sampler.h"
 
-struct hit_record;
+enum light_type {
+    LIGHT_DIRECTIONAL,
+    LIGHT_POINT,
+    LIGHT_SPOT,
+    // a ball of the given radius; shadow rays aim anywhere inside it
+    LIGHT_SPHERE
+};
 
 struct light {
-    // 0 = directional
-    // 1 = point
     int type;
+    // position, or the direction towards a directional light
     vec3 lightVector;
     vec3 lightColour;
+    // shadow rays aim at a random point within this distance of lightVector
+    double radius;
+    // spot lights: the axis of the cone, and the cosines of the angles where
+    // the falloff starts and where the light ends
+    vec3 spotDirection;
+    double cosInner, cosOuter;
 };
+
+inline light make_light(int type, const vec3& v, const vec3& colour, double radius = 1.0) {
+    light l;
+    l.type = type;
+    l.lightVector = v;
+    l.lightColour = colour;
+    l.radius = radius;
+    l.spotDirection = vec3(0,-1,0);
+    l.cosInner = l.cosOuter = -1;
+    return l;
+}
+
+// how much of a light reaches p: the spot cone with a smooth edge, 1 otherwise
+inline double light_reach(const light& l, const vec3& p) {
+    if (l.type != LIGHT_SPOT)
+        return 1.0;
+    double c = dot(unit_vector(p - l.lightVector), l.spotDirection);
+    if (c >= l.cosInner)
+        return 1.0;
+    if (c <= l.cosOuter)
+        return 0.0;
+    double t = (c - l.cosOuter) / (l.cosInner - l.cosOuter);
+    return t * t * (3 - 2 * t);
+}
 double max(double a, double b) {
-    return (a>b) ? a : b; 
+    return (a>b) ? a : b;
 }
 
-class material {
-    public:
-        virtual bool scatter(
-            const ray& r_in, const hit_record& rec, double c, vec3& attenuation, ray& scattered
-        ) const = 0;
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const = 0;
+// Which lobes a material evaluates. Exactly one of DIFFUSE, REFLECT and
+// REFRACT picks the scattered ray; SPECULAR adds the Blinn highlight and
+// COSINE makes the light term follow N.L instead of staying constant.
+// EMIT makes a light source that gives off emission and scatters nothing.
+enum material_flags {
+    MAT_DIFFUSE  = 1,
+    MAT_REFLECT  = 2,
+    MAT_REFRACT  = 4,
+    MAT_SPECULAR = 8,
+    MAT_COSINE   = 16,
+    MAT_EMIT     = 32
 };
 
-class lambertian : public material {
-    public: 
-        lambertian(const vec3& a) : albedo(a) {}
-        virtual bool scatter
-        (const ray& r_in, const hit_record& rec, double c, vec3& attenuation, ray& scattered) 
-        const {
-            vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-            scattered = ray(rec.p, target-rec.p);
-            attenuation = albedo;
-            attenuation *= c;
-            return true;
-        }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            specular = vec3();
-            NLAngle = 1.0;
-        }
-    
-    public: 
-        vec3 albedo;
+struct material_params {
+    vec3 albedo;
+    double fuzz;
+    double ref_inx;
+    double shininess;
+    // light term is max(nl_floor, N.L) with MAT_COSINE, nl_floor without
+    double nl_floor;
+    // radiance given off, for MAT_EMIT
+    vec3 emission;
+    int flags;
+    // texture_cache id of an image multiplied into albedo, or -1
+    int texture;
 };
 
-class metal : public material {
-    public: 
-        metal(const vec3& a, double f) : albedo(a) { 
-            if (f < 1) {
-                fuzz = f;
-            } else {
-                fuzz = 1;
-            }
-        }
-        virtual bool scatter
-        (const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered) 
-        const {
-            vec3 reflected = reflect(unit_vector(r.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
-            attenuation = albedo;
-            attenuation *= c;
-            return (dot(scattered.direction(), rec.normal));
+inline material_params make_material(int flags, const vec3& albedo, double fuzz, double ref_inx, double shininess, double nl_floor) {
+    material_params m;
+    m.albedo = albedo;
+    m.fuzz = fuzz;
+    m.ref_inx = ref_inx;
+    m.shininess = shininess;
+    m.nl_floor = nl_floor;
+    m.emission = vec3(0,0,0);
+    m.flags = flags;
+    m.texture = -1;
+    return m;
+}
+
+// ordering used to merge identical materials in a scene's table
+inline bool operator<(const material_params& a, const material_params& b) {
+    if (a.flags != b.flags) return a.flags < b.flags;
+    if (a.texture != b.texture) return a.texture < b.texture;
+    for (int i = 0; i < 3; i++)
+        if (a.albedo[i] != b.albedo[i]) return a.albedo[i] < b.albedo[i];
+    if (a.fuzz != b.fuzz) return a.fuzz < b.fuzz;
+    if (a.ref_inx != b.ref_inx) return a.ref_inx < b.ref_inx;
+    if (a.shininess != b.shininess) return a.shininess < b.shininess;
+    for (int i = 0; i < 3; i++)
+        if (a.emission[i] != b.emission[i]) return a.emission[i] < b.emission[i];
+    return a.nl_floor < b.nl_floor;
+}
+
+inline double schlick(double cosine, double ref_inx) {
+    double r0 = (1-ref_inx) / (1+ref_inx);
+    r0 = r0 * r0;
+    return r0 + (1-r0) * pow((1 - cosine), 5);
+}
+
+inline bool material_scatter(
+    const material_params& m, const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered, sampler& smp
+) {
+    if (m.flags & MAT_EMIT)
+        return false;
+    if (m.flags & MAT_REFRACT) {
+        vec3 outward_normal;
+        vec3 reflected = reflect(r.direction(), rec.normal);
+        double ni_over_nt;
+        vec3 refracted;
+        double reflect_prob;
+        double cosine;
+        attenuation = m.albedo;
+        if (dot(r.direction(), rec.normal) > 0) {
+            outward_normal = -rec.normal;
+            ni_over_nt = m.ref_inx;
+            cosine = m.ref_inx * dot(r.direction(), rec.normal / r.direction().length());
+        }
+        else {
+            outward_normal = rec.normal;
+            ni_over_nt = 1.0 / m.ref_inx;
+            cosine = -dot(r.direction(), rec.normal / r.direction().length());
+        }
+        if (refract(r.direction(), outward_normal, ni_over_nt, refracted)) {
+            reflect_prob = schlick(cosine, m.ref_inx);
+        }
+        else {
+            reflect_prob = 1.0;
+        }
+        scattered = ray(rec.p, (smp.get_1d() < reflect_prob) ? reflected : refracted);
+        return true;
+    }
+
+    attenuation = m.albedo;
+    attenuation *= c;
+    if (m.flags & MAT_REFLECT) {
+        vec3 reflected = reflect(unit_vector(r.direction()), rec.normal);
+        scattered = ray(rec.p, reflected + m.fuzz*sample_ball(smp));
+        return (dot(scattered.direction(), rec.normal));
+    }
+    scattered = ray(rec.p, rec.normal + sample_ball(smp));
+    return true;
+}
+
+inline void material_blinn(
+    const material_params& m, const hit_record& rec, const light& l, const vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle,
+    sampler& smp
+) {
+    vec3 shadowLightPos = l.lightVector + l.radius * sample_ball(smp);
+    vec3 lightDir = l.lightVector;
+    if (l.type != LIGHT_DIRECTIONAL) {
+        shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
+        lightDir -= rec.p;
+    } else {
+        shadowRay = ray(rec.p, unit_vector(shadowLightPos));
+    }
+    specular = vec3();
+    NLAngle = m.nl_floor;
+    if (!(m.flags & (MAT_SPECULAR | MAT_COSINE)))
+        return;
+
+    lightDir = unit_vector(lightDir);
+    if (m.flags & MAT_COSINE)
+        NLAngle = max(m.nl_floor, dot(unit_vector(rec.normal), lightDir));
+    if (m.flags & MAT_SPECULAR) {
+        double specAmount = pow(max(0.0, dot(rec.normal, unit_vector(lightDir + viewVector))), m.shininess);
+        specular = specAmount * l.lightColour;
+    }
+}
+
+// The classes below only describe a material; they all share the
+// parameter record and the two kernels above.
+class material {
+    public:
+        material(const material_params& p) : params(p) {}
+        bool scatter(
+            const ray& r_in, const hit_record& rec, double c, vec3& attenuation, ray& scattered, sampler& smp
+        ) const {
+            return material_scatter(params, r_in, rec, c, attenuation, scattered, smp);
         }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
+        void blinn(
+            const hit_record& rec, const light& l, const vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle,
+            sampler& smp
         ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            specular = vec3();
-            NLAngle = 0.0;
+            material_blinn(params, rec, l, viewVector, shadowRay, specular, NLAngle, smp);
         }
-    
-    public: 
-        vec3 albedo;
-        double fuzz;
+
+    public:
+        material_params params;
 };
 
-class dielectric : public material {
-    public: 
-        dielectric(double ri) : ref_inx(ri) {}
+class lambertian : public material {
+    public:
+        lambertian(const vec3& a)
+        : material(make_material(MAT_DIFFUSE, a, 0, 0, 0, 1.0)) {}
+};
 
-        virtual bool scatter
-        (const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered)  
-        const {
-            vec3 outward_normal;
-            vec3 reflected = reflect(r.direction(), rec.normal);
-            double ni_over_nt;
-            attenuation = vec3(1,1,1);
-            vec3 refracted;
-            double reflect_prob;
-            double cosine;
-            if (dot(r.direction(), rec.normal) > 0) {
-                outward_normal = -rec.normal;
-                ni_over_nt = ref_inx;
-                cosine = ref_inx * dot(r.direction(), rec.normal / r.direction().length());
-            } 
-            else {
-                outward_normal = rec.normal;
-                ni_over_nt = 1.0 / ref_inx;
-                cosine = -dot(r.direction(), rec.normal / r.direction().length());
-            }
-            if (refract(r.direction(), outward_normal, ni_over_nt, refracted)) {
-                reflect_prob = schlick(cosine, ref_inx);
-                scattered = ray(rec.p, refracted);
-            } 
-            else {
-                reflect_prob = 1.0;
-            }
-            if (random_double() < reflect_prob) {
-                scattered = ray(rec.p, reflected);
-            }
-            else {
-                scattered = ray(rec.p, refracted);
-            }
-            return true;
-        }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            specular = vec3();
-            NLAngle = 1.0;
-        }
-    
-    public: 
-        double ref_inx;
+class metal : public material {
+    public:
+        metal(const vec3& a, double f)
+        : material(make_material(MAT_REFLECT, a, (f < 1) ? f : 1, 0, 0, 0.0)) {}
+};
 
-    private:
-        static double schlick(double cosine, double ref_inx) {
-            double r0 = (1-ref_inx) / (1+ref_inx);
-            r0 = r0 * r0;
-            return r0 + (1-r0) * pow((1 - cosine), 5);
-        }
+class dielectric : public material {
+    public:
+        dielectric(double ri)
+        : material(make_material(MAT_REFRACT, vec3(1,1,1), 0, ri, 0, 1.0)) {}
 };
 
 class blinn_lambertian : public material {
-    public: 
-        blinn_lambertian(const vec3& a, double s) : albedo(a), shininess(s) {}
-        virtual bool scatter
-        (const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered) 
-        const {
-            vec3 target = rec.p + rec.normal + random_in_unit_sphere();
-            scattered = ray(rec.p, target-rec.p);
-            attenuation = albedo;
-            attenuation *= c;
-            return true;
-        }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-                lightPos -= rec.p;
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            vec3 n = unit_vector(rec.normal);
-            lightPos = unit_vector(lightPos);
-            NLAngle = max(0.1, dot(n, lightPos));
-            vec3 halfVector = lightPos + viewVector;
-            double specAmount = pow(max(0.0, dot(rec.normal, unit_vector(halfVector))), shininess);
-            specular = specAmount * l.lightColour;
-        }
-    
-    public: 
-        vec3 albedo;
-        double shininess;
+    public:
+        blinn_lambertian(const vec3& a, double s)
+        : material(make_material(MAT_DIFFUSE | MAT_SPECULAR | MAT_COSINE, a, 0, 0, s, 0.1)) {}
 };
 
 class blinn_metal : public material {
-    public: 
-        blinn_metal(const vec3& a, double f, double s) : albedo(a), shininess(s) { 
-            if (f < 1) {
-                fuzz = f;
-            } else {
-                fuzz = 1;
-            }
-        }
-        virtual bool scatter
-        (const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered) 
-        const {
-            vec3 reflected = reflect(unit_vector(r.direction()), rec.normal);
-            scattered = ray(rec.p, reflected + fuzz*random_in_unit_sphere());
-            attenuation = albedo;
-            attenuation *= c;
-            return (dot(scattered.direction(), rec.normal));
-        }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-                lightPos -= rec.p;
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            vec3 n = unit_vector(rec.normal);
-            lightPos = unit_vector(lightPos);
-            NLAngle = 1.0;
-            vec3 halfVector = unit_vector(lightPos) + viewVector;
-            double specAmount = pow(max(0.0, dot(rec.normal, unit_vector(halfVector))), shininess);
-            specular = specAmount * l.lightColour;
-        }
-    
-    public: 
-        vec3 albedo;
-        double fuzz;
-        double shininess;
+    public:
+        blinn_metal(const vec3& a, double f, double s)
+        : material(make_material(MAT_REFLECT | MAT_SPECULAR, a, (f < 1) ? f : 1, 0, s, 1.0)) {}
 };
 
-class blinn_dielectric : public material {
-    public: 
-        blinn_dielectric(double ri, double s) : ref_inx(ri), shininess(s) {}
-
-        virtual bool scatter
-        (const ray& r, const hit_record& rec, double c, vec3& attenuation, ray& scattered) 
-        const {
-            vec3 outward_normal;
-            vec3 reflected = reflect(r.direction(), rec.normal);
-            double ni_over_nt;
-            attenuation = vec3(1,1,1);
-            vec3 refracted;
-            double reflect_prob;
-            double cosine;
-            if (dot(r.direction(), rec.normal) > 0) {
-                outward_normal = -rec.normal;
-                ni_over_nt = ref_inx;
-                cosine = ref_inx * dot(r.direction(), rec.normal / r.direction().length());
-            } 
-            else {
-                outward_normal = rec.normal;
-                ni_over_nt = 1.0 / ref_inx;
-                cosine = -dot(r.direction(), rec.normal / r.direction().length());
-            }
-            if (refract(r.direction(), outward_normal, ni_over_nt, refracted)) {
-                reflect_prob = schlick(cosine, ref_inx);
-                scattered = ray(rec.p, refracted);
-            } 
-            else {
-                reflect_prob = 1.0;
-            }
-            if (random_double() < reflect_prob) {
-                scattered = ray(rec.p, reflected);
-            }
-            else {
-                scattered = ray(rec.p, refracted);
-            }
-            return true;
-        }
-        virtual void blinn(
-            const hit_record& rec, const light l, vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle
-        ) const {
-            vec3 lightPos = l.lightVector;
-            vec3 shadowLightPos = lightPos + random_in_unit_sphere();
-            if (l.type == 1) {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos - rec.p));
-                lightPos -= rec.p;
-            } else {
-                shadowRay = ray(rec.p, unit_vector(shadowLightPos));
-            }
-            vec3 n = unit_vector(rec.normal);
-            lightPos = unit_vector(lightPos);
-            NLAngle = max(0.0, dot(n, lightPos));
-            vec3 halfVector = unit_vector(lightPos) + viewVector;
-            double specAmount = pow(max(0.0, dot(rec.normal, unit_vector(halfVector))), shininess);
-            specular = specAmount * l.lightColour;
+// an area light: any sphere or triangle made of it is sampled as a light
+// by the path integrator
+class emissive : public material {
+    public:
+        emissive(const vec3& radiance)
+        : material(make_material(MAT_EMIT, vec3(0,0,0), 0, 0, 0, 1.0)) {
+            params.emission = radiance;
         }
-    
-    public: 
-        double ref_inx;
-        double shininess;
+};
 
-    private:
-        static double schlick(double cosine, double ref_inx) {
-            double r0 = (1-ref_inx) / (1+ref_inx);
-            r0 = r0 * r0;
-            return r0 + (1-r0) * pow((1 - cosine), 5);
-        }
+// scatter ignores the light term for refraction, so no MAT_COSINE here
+class blinn_dielectric : public material {
+    public:
+        blinn_dielectric(double ri, double s)
+        : material(make_material(MAT_REFRACT | MAT_SPECULAR, vec3(1,1,1), 0, ri, s, 1.0)) {}
 };
 
 #endif
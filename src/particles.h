@@ -0,0 +1,397 @@
+#ifndef PARTICLESH
+#define PARTICLESH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+#include "bvh.h"
+#include "hittable.h"
+#include "sphere.h"
+#include "stats.h"
+
+/*
+    Particle clouds: millions of small spheres, as simulations write them
+    out. A particle is a float centre and radius, and an index into the
+    cloud's own list of materials, stored only when the cloud has more
+    than one. Nothing is kept per particle on the hittable side, so a
+    cloud never passes through the scene arena.
+
+    A cloud brings its own BVH: median splits along the widest axis of
+    the centres, eight particles to a leaf, nodes in depth-first order
+    with the first child next to its parent. Traversal visits the child
+    on the side the ray comes from first and shrinks t_max as it finds
+    hits. With quantize, a leaf keeps its particles as 16-bit offsets
+    inside its own box, which is widened by a step so the rounded
+    spheres stay inside it, and halves what the particles take.
+
+    The file is a 16-byte header ("RTPTS1", two zero bytes, then the
+    particle count as a little-endian 64-bit integer) followed by 20-byte
+    records: x, y, z and radius as little-endian floats and the material
+    index as a little-endian 32-bit integer. It is read in chunks
+    straight into the cloud. A cloud too big for memory can be cut into
+    chunks on disk instead, and streamed (see chunks.h).
+*/
+
+const int particle_header_bytes = 16;
+const int particle_record_bytes = 20;
+// records read from the file at a time
+const int particle_chunk = 1 << 16;
+const int particle_leaf_size = 8;
+// particles a scene can address (see scene.h)
+const uint64_t particle_max_count = uint64_t(1) << 28;
+
+struct particle {
+    float center[3];
+    float radius;
+};
+
+// a particle as offsets into the box of its leaf, in steps of 1/65535
+struct packed_particle {
+    uint16_t center[3];
+    uint16_t radius;
+};
+
+struct particle_node {
+    float lo[3], hi[3];
+    // a leaf's first particle, or an inner node's second child
+    int offset;
+    // particles in a leaf; -1 - split axis for an inner node
+    int count;
+};
+
+// The arrays of a built cloud, wherever they are kept: in a particle_set,
+// or in a chunk mapped from a file (chunks.h). particles is null when the
+// cloud is quantised, packed when it is not; materials is null when the
+// cloud has one material.
+struct particle_view {
+    const particle_node* nodes;
+    const particle* particles;
+    const packed_particle* packed;
+    const uint16_t* materials;
+    int node_count;
+
+    // Closest particle hit in (t_min, t_max): its index and the leaf
+    // holding it, which get() needs. With any, the first hit will do.
+    // tests counts the particles tested.
+    bool intersect(const ray& r, double t_min, double t_max, bool any, double& t, int& index, int& leaf, uint64_t& tests) const;
+    void get(int index, int leaf, vec3& center, double& radius) const;
+    int material(int index) const { return materials ? materials[index] : 0; }
+    // the box around every particle
+    void bounds(vec3& lo, vec3& hi) const;
+};
+
+class particle_set {
+    public:
+        particle_set() : quantized(false) {}
+
+        // Streams the particles of a file in. Material indices must be
+        // below palette_size. False with error otherwise.
+        bool load(const std::string& path, int palette_size, std::string& error);
+        // Appends count records read from in, which is at the first of
+        // them; path names the file in error.
+        bool read(std::istream& in, uint64_t count, int palette_size, const std::string& path, std::string& error);
+        // builds the BVH, and packs the particles into their leaves if asked
+        void build(bool quantize);
+
+        int size() const { return int(quantized ? packed.size() : particles.size()); }
+        size_t bytes_used() const {
+            return nodes.capacity() * sizeof(particle_node) + particles.capacity() * sizeof(particle)
+                 + packed.capacity() * sizeof(packed_particle) + materials.capacity() * sizeof(uint16_t);
+        }
+        particle_view view() const {
+            particle_view v = { nodes.data(), quantized ? 0 : particles.data(), quantized ? packed.data() : 0,
+                                materials.empty() ? 0 : materials.data(), int(nodes.size()) };
+            return v;
+        }
+        // empty before build
+        void bounds(vec3& lo, vec3& hi) const { view().bounds(lo, hi); }
+        bool intersect(const ray& r, double t_min, double t_max, bool any, double& t, int& index, int& leaf, uint64_t& tests) const {
+            return view().intersect(r, t_min, t_max, any, t, index, leaf, tests);
+        }
+        void get(int index, int leaf, vec3& center, double& radius) const { view().get(index, leaf, center, radius); }
+        int material(int index) const { return materials.empty() ? 0 : materials[index]; }
+
+    private:
+        int build_node(std::vector<uint32_t>& order, int begin, int end, int depth);
+        void pack_leaf(particle_node& n);
+
+    private:
+        std::vector<particle_node> nodes;
+        std::vector<particle> particles;
+        std::vector<packed_particle> packed;
+        std::vector<uint16_t> materials;
+        bool quantized;
+};
+
+inline uint32_t particle_read_u32(const unsigned char* b) {
+    return uint32_t(b[0]) | (uint32_t(b[1]) << 8) | (uint32_t(b[2]) << 16) | (uint32_t(b[3]) << 24);
+}
+
+inline float particle_read_float(const unsigned char* b) {
+    uint32_t v = particle_read_u32(b);
+    float f;
+    std::memcpy(&f, &v, 4);
+    return f;
+}
+
+inline bool particle_set::load(const std::string& path, int palette_size, std::string& error) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    unsigned char header[particle_header_bytes];
+    if (!in.read(reinterpret_cast<char*>(header), sizeof(header)) || std::memcmp(header, "RTPTS1", 6) != 0) {
+        error = "cannot read particles " + path;
+        return false;
+    }
+    uint64_t count = 0;
+    for (int b = 0; b < 8; b++)
+        count |= uint64_t(header[8 + b]) << (8 * b);
+    if (count > particle_max_count) {
+        error = "too many particles in " + path;
+        return false;
+    }
+    particles.clear();
+    materials.clear();
+    return read(in, count, palette_size, path, error);
+}
+
+inline bool particle_set::read(std::istream& in, uint64_t count, int palette_size, const std::string& path, std::string& error) {
+    particles.reserve(particles.size() + size_t(count));
+    if (palette_size > 1)
+        materials.reserve(materials.size() + size_t(count));
+    std::vector<unsigned char> chunk(size_t(particle_chunk) * particle_record_bytes);
+    for (uint64_t done = 0; done < count; ) {
+        size_t n = size_t(std::min<uint64_t>(particle_chunk, count - done));
+        if (!in.read(reinterpret_cast<char*>(chunk.data()), std::streamsize(n * particle_record_bytes))) {
+            error = "truncated particles " + path;
+            return false;
+        }
+        for (size_t i = 0; i < n; i++) {
+            const unsigned char* rec = &chunk[i * particle_record_bytes];
+            particle p;
+            for (int k = 0; k < 4; k++)
+                (k < 3 ? p.center[k] : p.radius) = particle_read_float(rec + 4 * k);
+            uint32_t m = particle_read_u32(rec + 16);
+            if (!(p.radius > 0) || !std::isfinite(p.radius) || !std::isfinite(p.center[0]) || !std::isfinite(p.center[1])
+                || !std::isfinite(p.center[2]) || m >= uint32_t(palette_size)) {
+                error = "bad particle in " + path;
+                return false;
+            }
+            particles.push_back(p);
+            if (palette_size > 1)
+                materials.push_back(uint16_t(m));
+        }
+        done += n;
+    }
+    return true;
+}
+
+inline int particle_set::build_node(std::vector<uint32_t>& order, int begin, int end, int depth) {
+    int index = int(nodes.size());
+    nodes.push_back(particle_node());
+    double lo[3], hi[3], clo[3], chi[3];
+    for (int k = 0; k < 3; k++) {
+        lo[k] = clo[k] = std::numeric_limits<double>::infinity();
+        hi[k] = chi[k] = -std::numeric_limits<double>::infinity();
+    }
+    for (int i = begin; i < end; i++) {
+        const particle& p = particles[order[i]];
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], double(p.center[k]) - p.radius);
+            hi[k] = std::max(hi[k], double(p.center[k]) + p.radius);
+            clo[k] = std::min(clo[k], double(p.center[k]));
+            chi[k] = std::max(chi[k], double(p.center[k]));
+        }
+    }
+    for (int k = 0; k < 3; k++) {
+        nodes[index].lo[k] = float_below(lo[k]);
+        nodes[index].hi[k] = float_above(hi[k]);
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+        if (chi[k] - clo[k] > chi[axis] - clo[axis])
+            axis = k;
+    // a deep or shapeless range stays one leaf; the stack in intersect is 64 deep
+    if (end - begin <= particle_leaf_size || depth >= 48 || chi[axis] <= clo[axis]) {
+        nodes[index].offset = begin;
+        nodes[index].count = end - begin;
+        return index;
+    }
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](uint32_t a, uint32_t b) {
+        return particles[a].center[axis] < particles[b].center[axis];
+    });
+    nodes[index].count = -1 - axis;
+    build_node(order, begin, mid, depth + 1);
+    int second = build_node(order, mid, end, depth + 1);
+    nodes[index].offset = second;
+    return index;
+}
+
+inline void particle_set::pack_leaf(particle_node& n) {
+    // widened by two steps: rounding moves a centre and the radius by half a step each
+    double extent = 0;
+    for (int k = 0; k < 3; k++)
+        extent = std::max(extent, double(n.hi[k]) - n.lo[k]);
+    double pad = 2 * extent / 65535;
+    for (int k = 0; k < 3; k++) {
+        n.lo[k] = float_below(n.lo[k] - pad);
+        n.hi[k] = float_above(n.hi[k] + pad);
+    }
+    double step[3], radius_step = 0;
+    for (int k = 0; k < 3; k++) {
+        step[k] = (double(n.hi[k]) - n.lo[k]) / 65535;
+        radius_step = std::max(radius_step, step[k]);
+    }
+    for (int i = n.offset; i < n.offset + n.count; i++) {
+        const particle& p = particles[i];
+        packed_particle& q = packed[i];
+        for (int k = 0; k < 3; k++)
+            q.center[k] = uint16_t(std::min(65535.0, std::max(0.0, std::floor((p.center[k] - n.lo[k]) / step[k] + 0.5))));
+        q.radius = uint16_t(std::min(65535.0, std::max(1.0, std::floor(p.radius / radius_step + 0.5))));
+    }
+}
+
+inline void particle_set::build(bool quantize) {
+    nodes.clear();
+    packed.clear();
+    quantized = false;
+    if (particles.empty())
+        return;
+    std::vector<uint32_t> order(particles.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = uint32_t(i);
+    nodes.reserve(2 * particles.size() / particle_leaf_size + 1);
+    build_node(order, 0, int(particles.size()), 0);
+    nodes.shrink_to_fit();
+
+    // the particles and their materials go into leaf order
+    std::vector<particle> sorted(particles.size());
+    for (size_t i = 0; i < order.size(); i++)
+        sorted[i] = particles[order[i]];
+    particles.swap(sorted);
+    std::vector<particle>().swap(sorted);
+    if (!materials.empty()) {
+        std::vector<uint16_t> m(materials.size());
+        for (size_t i = 0; i < order.size(); i++)
+            m[i] = materials[order[i]];
+        materials.swap(m);
+    }
+    if (!quantize)
+        return;
+
+    packed.resize(particles.size());
+    for (size_t i = 0; i < nodes.size(); i++)
+        if (nodes[i].count > 0)
+            pack_leaf(nodes[i]);
+    // the leaves grew, so every inner node is fitted to its children again;
+    // children come after their parent
+    for (size_t i = nodes.size(); i-- > 0; ) {
+        particle_node& n = nodes[i];
+        if (n.count > 0)
+            continue;
+        const particle_node& a = nodes[i + 1];
+        const particle_node& b = nodes[n.offset];
+        for (int k = 0; k < 3; k++) {
+            n.lo[k] = std::min(a.lo[k], b.lo[k]);
+            n.hi[k] = std::max(a.hi[k], b.hi[k]);
+        }
+    }
+    std::vector<particle>().swap(particles);
+    quantized = true;
+}
+
+inline void particle_view::bounds(vec3& lo, vec3& hi) const {
+    if (node_count == 0) {
+        lo = hi = vec3(0,0,0);
+        return;
+    }
+    lo = vec3(nodes[0].lo[0], nodes[0].lo[1], nodes[0].lo[2]);
+    hi = vec3(nodes[0].hi[0], nodes[0].hi[1], nodes[0].hi[2]);
+}
+
+inline void particle_view::get(int index, int leaf, vec3& center, double& radius) const {
+    if (particles) {
+        const particle& p = particles[index];
+        center = vec3(p.center[0], p.center[1], p.center[2]);
+        radius = p.radius;
+        return;
+    }
+    const particle_node& n = nodes[leaf];
+    const packed_particle& q = packed[index];
+    double radius_step = 0;
+    for (int k = 0; k < 3; k++) {
+        double step = (double(n.hi[k]) - n.lo[k]) / 65535;
+        center[k] = n.lo[k] + q.center[k] * step;
+        radius_step = std::max(radius_step, step);
+    }
+    radius = q.radius * radius_step;
+}
+
+inline bool particle_view::intersect(const ray& r, double t_min, double t_max, bool any, double& t, int& index, int& leaf,
+                                     uint64_t& tests) const {
+    if (node_count == 0)
+        return false;
+    double o[3], inv[3];
+    for (int k = 0; k < 3; k++) {
+        o[k] = r.origin()[k];
+        inv[k] = 1 / r.direction()[k];
+    }
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    uint64_t visits = 0;
+    bool hit = false;
+    while (top > 0) {
+        int i = stack[--top];
+        const particle_node& n = nodes[i];
+        visits++;
+        double enter = t_min, leave = t_max;
+        for (int k = 0; k < 3; k++) {
+            double ta = (n.lo[k] - o[k]) * inv[k];
+            double tb = (n.hi[k] - o[k]) * inv[k];
+            if (ta > tb)
+                std::swap(ta, tb);
+            enter = std::max(enter, ta);
+            leave = std::min(leave, tb);
+        }
+        if (enter > leave)
+            continue;
+        if (n.count > 0) {
+            tests += n.count;
+            for (int p = n.offset; p < n.offset + n.count; p++) {
+                vec3 center;
+                double radius, found;
+                get(p, i, center, radius);
+                if (intersect_sphere(center, radius, r, t_min, t_max, found)) {
+                    hit = true;
+                    t = t_max = found;
+                    index = p;
+                    leaf = i;
+                    if (any)
+                        break;
+                }
+            }
+            if (hit && any)
+                break;
+            continue;
+        }
+        // the child on the side the ray comes from is popped first
+        int axis = -1 - n.count;
+        if (r.direction()[axis] > 0) {
+            stack[top++] = n.offset;
+            stack[top++] = i + 1;
+        } else {
+            stack[top++] = i + 1;
+            stack[top++] = n.offset;
+        }
+    }
+    count_stat(STAT_NODE_VISITS, visits);
+    return hit;
+}
+
+#endif
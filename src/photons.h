@@ -0,0 +1,191 @@
+#ifndef PHOTONSH
+#define PHOTONSH
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+#include "vec3.h"
+#include "thread_pool.h"
+
+/*
+    Caustic photon map (Jensen 1996). Before the render, photons are
+    traced from the lights through mirrors and glass (see render.h). Each
+    one is kept where it first lands on a diffuse surface. The caustic
+    light at a diffuse point is then the power of the photons nearest to
+    it, over the area of the disc they cover.
+
+    The photons are stored as a kd-tree in place, so the tree has no nodes
+    of its own. Each range has its median along its widest axis in the
+    middle, the smaller photons before it and the larger ones after. The
+    pool builds the ranges below the first few levels in parallel.
+
+    A gather walks the near half first and keeps the closest photons in a
+    max-heap, so the search radius shrinks as closer ones turn up. Only
+    photons that arrived on the side of the normal count, so light does
+    not leak through thin walls.
+*/
+
+// photons a gather averages over
+const int photon_gather = 50;
+// widest gather radius, as a fraction of the extent of the stored photons
+const double photon_max_radius = 0.02;
+
+struct photon {
+    float p[3];
+    // flux carried, and the direction back towards where it came from
+    float power[3];
+    float wi[3];
+    // split axis of the kd-tree range this photon is the middle of
+    int axis;
+};
+
+class photon_map {
+    public:
+        photon_map() : max_r2(0) {}
+
+        // takes the photons over and builds the tree on the pool
+        void build(std::vector<photon>& stored, thread_pool& pool);
+        int size() const { return int(photons.size()); }
+        size_t bytes_used() const { return photons.capacity() * sizeof(photon); }
+
+        // Calls each(photon) for the photon_gather photons nearest p that
+        // arrived on the side of n, or all of them within the widest
+        // radius if there are fewer. Returns the squared radius of the
+        // disc they are spread over.
+        template <class F>
+        double gather(const vec3& p, const vec3& n, F each) const;
+
+    private:
+        typedef std::pair<float, int> candidate;
+
+        // puts the median of [begin, end) along its widest axis in the middle
+        int split(int begin, int end);
+        void build_range(int begin, int end);
+        void nearest(const float q[3], const float n[3], int begin, int end, candidate* heap, int& found, float& r2) const;
+
+    private:
+        std::vector<photon> photons;
+        float max_r2;
+};
+
+inline int photon_map::split(int begin, int end) {
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++)
+        lo[k] = hi[k] = photons[begin].p[k];
+    for (int i = begin + 1; i < end; i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], photons[i].p[k]);
+            hi[k] = std::max(hi[k], photons[i].p[k]);
+        }
+    }
+    int axis = 0;
+    for (int k = 1; k < 3; k++)
+        if (hi[k] - lo[k] > hi[axis] - lo[axis])
+            axis = k;
+    int mid = (begin + end) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end,
+                     [axis](const photon& a, const photon& b) { return a.p[axis] < b.p[axis]; });
+    photons[mid].axis = axis;
+    return mid;
+}
+
+inline void photon_map::build_range(int begin, int end) {
+    if (end - begin < 1)
+        return;
+    int mid = split(begin, end);
+    build_range(begin, mid);
+    build_range(mid + 1, end);
+}
+
+inline void photon_map::build(std::vector<photon>& stored, thread_pool& pool) {
+    photons.swap(stored);
+    stored.clear();
+    max_r2 = 0;
+    if (photons.empty())
+        return;
+
+    float lo[3], hi[3];
+    for (int k = 0; k < 3; k++)
+        lo[k] = hi[k] = photons[0].p[k];
+    for (size_t i = 1; i < photons.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], photons[i].p[k]);
+            hi[k] = std::max(hi[k], photons[i].p[k]);
+        }
+    }
+    double extent2 = 0;
+    for (int k = 0; k < 3; k++)
+        extent2 += double(hi[k] - lo[k]) * (hi[k] - lo[k]);
+    max_r2 = float(photon_max_radius * photon_max_radius * extent2);
+
+    // the first levels are split here until there is a range for every
+    // thread a few times over
+    std::vector<std::pair<int, int> > ranges(1, std::make_pair(0, int(photons.size())));
+    while (ranges.size() < size_t(4 * pool.size())) {
+        std::vector<std::pair<int, int> > next;
+        for (size_t r = 0; r < ranges.size(); r++) {
+            int begin = ranges[r].first, end = ranges[r].second;
+            if (end - begin < 2) {
+                build_range(begin, end);
+                continue;
+            }
+            int mid = split(begin, end);
+            next.push_back(std::make_pair(begin, mid));
+            next.push_back(std::make_pair(mid + 1, end));
+        }
+        if (next.empty())
+            return;
+        ranges.swap(next);
+    }
+    pool.parallel_for(int(ranges.size()), [&](int r, int) {
+        build_range(ranges[r].first, ranges[r].second);
+    });
+}
+
+inline void photon_map::nearest(const float q[3], const float n[3], int begin, int end, candidate* heap, int& found, float& r2) const {
+    if (end - begin < 1)
+        return;
+    int mid = (begin + end) / 2;
+    const photon& ph = photons[mid];
+    float d = q[ph.axis] - ph.p[ph.axis];
+    if (d < 0)
+        nearest(q, n, begin, mid, heap, found, r2);
+    else
+        nearest(q, n, mid + 1, end, heap, found, r2);
+
+    float dx = q[0] - ph.p[0], dy = q[1] - ph.p[1], dz = q[2] - ph.p[2];
+    float dist2 = dx * dx + dy * dy + dz * dz;
+    if (dist2 < r2 && ph.wi[0] * n[0] + ph.wi[1] * n[1] + ph.wi[2] * n[2] > 0) {
+        heap[found++] = candidate(dist2, mid);
+        std::push_heap(heap, heap + found);
+        if (found > photon_gather) {
+            std::pop_heap(heap, heap + found);
+            found--;
+        }
+        if (found == photon_gather)
+            r2 = heap[0].first;
+    }
+
+    if (d * d < r2) {
+        if (d < 0)
+            nearest(q, n, mid + 1, end, heap, found, r2);
+        else
+            nearest(q, n, begin, mid, heap, found, r2);
+    }
+}
+
+template <class F>
+double photon_map::gather(const vec3& p, const vec3& n, F each) const {
+    float q[3] = { float(p.x()), float(p.y()), float(p.z()) };
+    float nq[3] = { float(n.x()), float(n.y()), float(n.z()) };
+    candidate heap[photon_gather + 1];
+    int found = 0;
+    float r2 = max_r2;
+    nearest(q, nq, 0, int(photons.size()), heap, found, r2);
+    for (int i = 0; i < found; i++)
+        each(photons[heap[i].second]);
+    return r2;
+}
+
+#endif
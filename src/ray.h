@@ -4,8 +4,8 @@
 
 class ray {
     public:
-        ray() {}
-        ray(const vec3& a, const vec3 &b) : A(a), B(b) {}
+        ray() : width(0), spread(0) {}
+        ray(const vec3& a, const vec3 &b) : A(a), B(b), width(0), spread(0) {}
         vec3 origin() const {
             return A;
         }
@@ -15,9 +15,16 @@ class ray {
         vec3 point_at_parameter(double t) const {
             return A + t*B;
         }
+        // width of the ray cone at parameter t
+        double width_at(double t) const {
+            return width + spread * t * B.length();
+        }
 
         vec3 A;
         vec3 B;
+        // Ray cone: the footprint is width across at the origin and grows
+        // by spread per unit of distance. Only texture filtering uses it.
+        double width, spread;
 };
 
 #endif
\ No newline at end of file
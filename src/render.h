@@ -0,0 +1,945 @@
+#ifndef RENDERH
+#define RENDERH
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+#include "camera.h"
+#include "scene.h"
+#include "lights.h"
+#include "sampler.h"
+#include "framebuffer.h"
+#include "thread_pool.h"
+#include "stats.h"
+#include "trace.h"
+
+// What a camera ray saw at its first rough hit, gathered for the denoiser
+// and the AOV outputs. Glass and polished metal are looked through, so the
+// denoiser sees the edges of whatever they reflect or refract. direct is
+// the light that reached the camera after at most one bounce: sky seen
+// straight on, highlights at the first hit and sky seen in it.
+struct first_hit {
+    vec3 albedo;
+    vec3 normal;
+    double depth;
+    vec3 direct;
+};
+
+/*
+    Mean radiance arriving at p over the hemisphere of nf, cosine
+    weighted. It comes from the scene's irradiance cache when records
+    close enough exist; otherwise it is gathered with a jittered grid of
+    rays and added to the cache. trace(r, smp, guide) gives the radiance
+    along r; the guide's depth tells how far away the ray's first hit was.
+    footprint is the width of a pixel at p.
+*/
+template <class F>
+vec3 cached_irradiance(const scene& world, const vec3& p, const vec3& nf, double footprint, F trace) {
+    count_stat(STAT_IRRADIANCE_LOOKUPS);
+    vec3 value;
+    if (world.irradiance->lookup(p, nf, value))
+        return value;
+    count_stat(STAT_IRRADIANCE_RECORDS);
+    // the gather rays draw from their own stream, seeded by the position
+    float coords[3] = { float(p.x()), float(p.y()), float(p.z()) };
+    uint32_t seed = 0;
+    for (int k = 0; k < 3; k++) {
+        uint32_t bits;
+        std::memcpy(&bits, &coords[k], 4);
+        seed = hash_combine(seed, bits);
+    }
+    random_sampler smp(1, seed);
+    vec3 t, b;
+    make_basis(nf, t, b);
+    vec3 sum(0,0,0);
+    double inverse_distance = 0;
+    const int n = irradiance_grid;
+    for (int k = 0; k < n * n; k++) {
+        smp.start_sample(k, 0, 0);
+        double u, v;
+        smp.get_2d(u, v);
+        vec3 local = map_to_hemisphere((k % n + u) / n, (k / n + v) / n);
+        ray r(p, local.x() * t + local.y() * b + local.z() * nf);
+        r.width = footprint;
+        first_hit g = { vec3(0,0,0), vec3(0,0,0), 0, vec3(0,0,0) };
+        sum += trace(r, smp, &g);
+        if (g.depth > 0)
+            inverse_distance += 1 / g.depth;
+    }
+    value = sum / (n * n);
+    double distance = inverse_distance > 0 ? (n * n) / inverse_distance : std::numeric_limits<double>::infinity();
+    world.irradiance->insert(p, nf, value, distance, footprint);
+    return value;
+}
+
+vec3 background(const ray& r, const light_list& l) {
+    vec3 unit_direction = unit_vector(r.direction());
+    if (l.environment)
+        return l.environment->radiance(unit_direction);
+    double t = 0.5 * (unit_direction.y() + 1.0);
+    return (1.0 - t) * vec3(1.0, 1.0, 1.0) + t*vec3(0.5, 0.7, 1.0);
+}
+
+// emitted, when given, receives the part of the result added at this
+// vertex rather than carried back from later bounces
+vec3 ray_color(const ray& r, const scene& world, const light_list& l, int depth, sampler& smp, first_hit* guide = 0, vec3* emitted = 0) {
+    hit_record rec;
+    if (depth > 50) {
+        count_stat(STAT_PATH_DEPTH + stats_depth_bins - 1);
+        if (guide)
+            *guide = first_hit();
+        if (emitted)
+            *emitted = vec3(0,0,0);
+        return vec3(0,0,0);
+    }
+    if (world.hit(r, 0.001, std::numeric_limits<double>::infinity(), rec)) {
+        ray scattered;
+        vec3 attenuation;
+
+        material_params textured;
+        const material_params& m = world.surface(r, rec, textured);
+        first_hit* next_guide = 0;
+        if (guide) {
+            guide->depth += rec.t * r.direction().length();
+            if ((m.flags & (MAT_REFLECT | MAT_REFRACT)) && m.fuzz == 0) {
+                next_guide = guide;
+            } else {
+                guide->albedo = m.albedo;
+                guide->normal = rec.normal;
+            }
+        }
+
+        if (m.flags & MAT_EMIT) {
+            if (guide) {
+                guide->albedo = m.emission;
+                if (depth == 0)
+                    guide->direct = m.emission;
+            }
+            if (emitted)
+                *emitted = m.emission;
+            count_stat(STAT_PATH_DEPTH + std::min(depth, stats_depth_bins - 1));
+            return m.emission;
+        }
+
+        vec3 viewVector = unit_vector(-r.direction());
+        vec3 specular;
+        double NLAngle;
+        ray shadowRay;
+        double contribution = 1.0;
+
+        if (l.size() == 0) {
+            // nothing lights the point, so it counts as shadowed
+            specular = vec3(0,0,0);
+            NLAngle = m.nl_floor;
+            contribution = 0.2;
+        } else {
+            double pick_pdf;
+            const light& lt = l.pick(smp, pick_pdf);
+            material_blinn(m, rec, lt, viewVector, shadowRay, specular, NLAngle, smp);
+
+            // a spot light only reaches inside its cone and fades out towards
+            // its edge; the picked light stands in for all of them
+            double reach = light_reach(lt, rec.p);
+            bool shadowed = reach <= 0;
+            if (!shadowed) {
+                count_stat(STAT_SHADOW_RAYS);
+                shadowed = world.occluded(shadowRay, 0.001, std::numeric_limits<double>::infinity());
+            }
+            if (shadowed) {
+                contribution = 0.2;
+                specular *= 0.0;
+            } else {
+                specular *= reach / pick_pdf;
+                if (reach < 1)
+                    contribution = 0.2 + 0.8 * reach;
+            }
+        }
+        if (emitted)
+            *emitted = specular;
+        contribution = (NLAngle == 1.0) ? contribution : NLAngle;
+        if (world.irradiance && depth == 0 && (m.flags & MAT_DIFFUSE)) {
+            // the bounce is looked up instead of traced; a diffuse
+            // material_scatter would have given albedo * contribution
+            vec3 nf = dot(rec.normal, r.direction()) > 0 ? -unit_vector(rec.normal) : unit_vector(rec.normal);
+            vec3 e = cached_irradiance(world, rec.p, nf, r.width_at(rec.t), [&](const ray& g, sampler& s, first_hit* h) {
+                return ray_color(g, world, l, 1, s, h);
+            });
+            if (guide)
+                guide->direct = specular;
+            count_stat(STAT_PATH_DEPTH);
+            return m.albedo * contribution * e + specular;
+        }
+        if (material_scatter(m, r, rec, contribution, attenuation, scattered, smp)) {
+            count_stat(STAT_BOUNCE_RAYS);
+            scattered.width = r.width_at(rec.t);
+            scattered.spread = r.spread;
+            vec3 next_emitted;
+            vec3 col = attenuation * ray_color(scattered, world, l, depth+1, smp, next_guide, &next_emitted) + specular;
+            if (guide && depth == 0)
+                guide->direct = specular + attenuation * next_emitted;
+            return col;
+        }
+        if (next_guide) {
+            next_guide->albedo = vec3(0,0,0);
+            next_guide->normal = rec.normal;
+        }
+        if (guide && depth == 0)
+            guide->direct = vec3(0,0,0);
+        count_stat(STAT_PATH_DEPTH + std::min(depth, stats_depth_bins - 1));
+        return vec3(0,0,0);
+    }
+    count_stat(STAT_PATH_DEPTH + std::min(depth, stats_depth_bins - 1));
+    vec3 sky = background(r, l);
+    if (guide) {
+        guide->albedo = sky;
+        guide->normal = vec3(0,0,0);
+        if (depth == 0)
+            guide->direct = sky;
+    }
+    if (emitted)
+        *emitted = sky;
+    return sky;
+}
+
+/*
+    The path integrator (INTEGRATOR_PATH). Diffuse surfaces are Lambertian,
+    and with MAT_SPECULAR they get a thin coat: a normalized Blinn-Phong
+    lobe that reflects coat_reflectance of the light, as a dielectric of
+    index 1.5 does head on. Mirrors and glass keep material_scatter.
+
+    At every diffuse vertex one shadow ray goes to a light of the list
+    (point, spot, sphere or directional; these are points or directions,
+    so nothing else can find them), a point on an emissive sphere or
+    triangle, or a direction of the environment map. When a bounce then
+    hits an emitter or the map, its light is weighted against the chance
+    the shadow ray had of finding it. The weights use the power heuristic,
+    so each of the two strategies counts most where it does best. Light
+    colours here are radiant intensities (irradiance for directional
+    lights); emission is radiance.
+*/
+
+const double coat_reflectance = 0.04;
+// a diffuse bounce of a path, kept until the path ends so the guide can be
+// told what came back along it
+struct guide_vertex {
+    vec3 p, n, wi;
+    // throughput and radiance gathered just after the bounce
+    vec3 throughput, radiance;
+    // the cosine at p over the pdf of wi
+    double weight;
+};
+
+inline double mis_weight(double pdf, double other_pdf) {
+    return pdf * pdf / (pdf * pdf + other_pdf * other_pdf);
+}
+
+// f(wo, wi) of a diffuse material, nf the normal on the side of wo
+inline vec3 diffuse_bsdf(const material_params& m, const vec3& nf, const vec3& wo, const vec3& wi) {
+    vec3 f = m.albedo / pi;
+    if (m.flags & MAT_SPECULAR) {
+        vec3 h = unit_vector(wo + wi);
+        double lobe = coat_reflectance * (m.shininess + 8) / (8 * pi) * pow(std::max(0.0, dot(nf, h)), m.shininess);
+        f = (1 - coat_reflectance) * f + vec3(lobe, lobe, lobe);
+    }
+    return f;
+}
+
+// how the shadow rays are split between the kinds of light a scene has
+struct light_shares {
+    int kinds;
+    double emitters, environment, lights;
+
+    light_shares(const scene& world, const light_list& l) {
+        kinds = int(!world.emitters.empty()) + int(bool(l.environment)) + int(l.size() > 0);
+        double each = kinds > 0 ? 1.0 / kinds : 0.0;
+        emitters = world.emitters.empty() ? 0.0 : each;
+        environment = l.environment ? each : 0.0;
+        lights = l.size() > 0 ? each : 0.0;
+    }
+};
+
+// one shadow ray from the diffuse point p; what it brings back, MIS weighted
+// unless mis is false, for when no bounce will look for the lights. cell is
+// the path guide's leaf at p when the bounce from p is guided.
+vec3 sample_direct(const scene& world, const light_list& l, const material_params& m, const vec3& p, const vec3& nf, const vec3& wo,
+                   sampler& smp, bool mis = true, const path_guide::leaf* cell = 0) {
+    light_shares share(world, l);
+    if (share.kinds == 0)
+        return vec3(0,0,0);
+    double u = share.kinds > 1 ? smp.get_1d() : 0.0;
+    bool to_emitter = u < share.emitters;
+    bool to_environment = !to_emitter && u < share.emitters + share.environment;
+    vec3 to_light, radiance;
+    double t_max = 0.999;
+    double light_pdf;
+    if (to_emitter) {
+        vec3 q;
+        if (!world.sample_emitter(p, smp, q, radiance, light_pdf))
+            return vec3(0,0,0);
+        to_light = q - p;
+        light_pdf *= share.emitters;
+    } else if (to_environment) {
+        to_light = l.environment->sample(smp, radiance, light_pdf);
+        light_pdf *= share.environment;
+        t_max = std::numeric_limits<double>::infinity();
+    } else {
+        const light& lt = l.pick(smp, light_pdf);
+        light_pdf *= share.lights;
+        if (lt.type == LIGHT_DIRECTIONAL) {
+            to_light = unit_vector(lt.lightVector);
+            radiance = lt.lightColour;
+            t_max = std::numeric_limits<double>::infinity();
+        } else {
+            vec3 pos = lt.lightVector;
+            if (lt.type == LIGHT_SPHERE) {
+                double u, v;
+                smp.get_2d(u, v);
+                pos += lt.radius * map_to_sphere(u, v);
+            }
+            to_light = pos - p;
+            radiance = lt.lightColour * (light_reach(lt, p) / to_light.squared_length());
+        }
+    }
+    vec3 wi = unit_vector(to_light);
+    double cos_p = dot(nf, wi);
+    if (cos_p <= 0 || light_pdf <= 0 || radiance.squared_length() == 0)
+        return vec3(0,0,0);
+    count_stat(STAT_SHADOW_RAYS);
+    if (world.occluded(ray(p, to_light), 0.001, t_max))
+        return vec3(0,0,0);
+    // lights of the list are points or directions, which a bounce never hits
+    double bounce_pdf = cos_p / pi;
+    if (cell)
+        bounce_pdf = guide_fraction * world.guiding->pdf(*cell, wi) + (1 - guide_fraction) * bounce_pdf;
+    double weight = mis && (to_emitter || to_environment) ? mis_weight(light_pdf, bounce_pdf) : 1.0;
+    return diffuse_bsdf(m, nf, wo, wi) * radiance * (cos_p * weight / light_pdf);
+}
+
+/*
+    Caustic photons (see photons.h). A photon starts at a light of the
+    list or at a point on an emissive sphere or triangle. It is aimed at
+    the bounding sphere of a mirror or glass primitive: uniformly within
+    the cone the sphere subtends, or through the disc it casts for a
+    directional light. A particle cloud with any mirror or glass in it is
+    one caster, the sphere around the whole cloud. The caster is picked
+    in proportion to the cone's solid angle, or the disc's area. The
+    photon's power is divided by the pdf of the whole mixture, so casters
+    that overlap are counted right.
+
+    A photon whose first hit is not mirror or glass is dropped. The rest
+    bounce as material_scatter says until they land on a diffuse surface.
+    Each photon draws from its own stream, seeded by its index, so the map
+    is the same for any number of threads. The environment map and
+    glowing tori and particles send no photons; their caustics are left
+    to bounces.
+*/
+
+const int photon_max_bounces = 16;
+// photons traced by one job of the pool
+const int photon_batch = 4096;
+
+// a mirror or glass primitive, as a sphere around it
+struct photon_caster {
+    vec3 center;
+    double radius;
+};
+
+// where photons leave from, a light of the list or an emitter (the
+// other is -1), and the chance each caster has of being aimed at
+struct photon_source {
+    int light, emitter;
+    alias_table casters;
+};
+
+// mirrors and glass, the primitives photons are aimed at
+inline bool casts_caustics(const material_params& m) {
+    return (m.flags & (MAT_REFLECT | MAT_REFRACT)) && !(m.flags & (MAT_DIFFUSE | MAT_EMIT));
+}
+
+// the solid angle caster c covers as seen from o
+inline double caster_solid_angle(const photon_caster& c, const vec3& o) {
+    double dist2 = (c.center - o).squared_length();
+    if (dist2 <= c.radius * c.radius)
+        return 4 * pi;
+    return 2 * pi * (1 - sqrt(1 - c.radius * c.radius / dist2));
+}
+
+// a direction from o, uniform in the cone that caster c subtends
+inline vec3 sample_caster(const photon_caster& c, const vec3& o, double u, double v) {
+    vec3 axis = c.center - o;
+    double dist2 = axis.squared_length();
+    if (dist2 <= c.radius * c.radius)
+        return map_to_sphere(u, v);
+    double cos_max = sqrt(1 - c.radius * c.radius / dist2);
+    double cos_t = 1 - u * (1 - cos_max);
+    double sin_t = sqrt(std::max(0.0, 1 - cos_t * cos_t));
+    double phi = 2 * pi * v;
+    vec3 w = axis / sqrt(dist2), t, b;
+    make_basis(w, t, b);
+    return cos(phi) * sin_t * t + sin(phi) * sin_t * b + cos_t * w;
+}
+
+// the pdf of direction d from o for a photon of source s
+inline double caster_mixture_pdf(const std::vector<photon_caster>& casters, const photon_source& s, const vec3& o, const vec3& d) {
+    double pdf = 0;
+    for (size_t c = 0; c < casters.size(); c++) {
+        vec3 axis = casters[c].center - o;
+        double dist2 = axis.squared_length();
+        double r2 = casters[c].radius * casters[c].radius;
+        if (dist2 > r2 && dot(d, axis) < sqrt(dist2 - r2))
+            continue;
+        pdf += s.casters.pdf(int(c)) / caster_solid_angle(casters[c], o);
+    }
+    return pdf;
+}
+
+// Traces count photons from the lights of the scene through its mirrors
+// and glass on the pool, and returns the map of where they landed.
+std::shared_ptr<photon_map> trace_caustic_photons(const scene& world, const light_list& l, int count, thread_pool& pool) {
+    const double infinity = std::numeric_limits<double>::infinity();
+    std::vector<photon_caster> casters;
+    for (size_t i = 0; i < world.spheres.size(); i++) {
+        const material_params& m = world.materials[world.spheres[i].mat_id];
+        if (casts_caustics(m)) {
+            photon_caster c = { world.spheres[i].center, world.spheres[i].radius };
+            casters.push_back(c);
+        }
+    }
+    vec3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+    for (size_t i = 0; i < world.spheres.size(); i++) {
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], world.spheres[i].center[k] - world.spheres[i].radius);
+            hi[k] = std::max(hi[k], world.spheres[i].center[k] + world.spheres[i].radius);
+        }
+    }
+    for (size_t i = 0; i < world.triangles.size(); i++) {
+        const triangle_prim& tr = world.triangles[i];
+        vec3 center = (tr.p1 + tr.p2 + tr.p3) / 3;
+        double radius = std::max((tr.p1 - center).length(), std::max((tr.p2 - center).length(), (tr.p3 - center).length()));
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], center[k] - radius);
+            hi[k] = std::max(hi[k], center[k] + radius);
+        }
+        const material_params& m = world.materials[tr.mat_id];
+        if (casts_caustics(m)) {
+            photon_caster c = { center, radius };
+            casters.push_back(c);
+        }
+    }
+    for (size_t i = 0; i < world.tori.size(); i++) {
+        // tori sit at the origin
+        double radius = world.tori[i].R1 + world.tori[i].R2;
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], -radius);
+            hi[k] = std::max(hi[k], radius);
+        }
+        const material_params& m = world.materials[world.tori[i].mat_id];
+        if (casts_caustics(m)) {
+            photon_caster c = { vec3(0,0,0), radius };
+            casters.push_back(c);
+        }
+    }
+    for (size_t i = 0; i < world.boxes.size(); i++) {
+        const box_prim& b = world.boxes[i];
+        const vec3* e = b.edge;
+        vec3 center = b.corner + 0.5 * (e[0] + e[1] + e[2]);
+        // half the longest diagonal
+        double radius = 0.5 * std::max(std::max((e[0] + e[1] + e[2]).length(), (e[0] + e[1] - e[2]).length()),
+                                       std::max((e[0] - e[1] + e[2]).length(), (-e[0] + e[1] + e[2]).length()));
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], center[k] - radius);
+            hi[k] = std::max(hi[k], center[k] + radius);
+        }
+        const material_params& m = world.materials[b.mat_id];
+        if (casts_caustics(m)) {
+            photon_caster c = { center, radius };
+            casters.push_back(c);
+        }
+    }
+    for (size_t i = 0; i < world.clouds.size(); i++) {
+        const cloud_prim& c = world.clouds[i];
+        vec3 clo, chi;
+        c.bounds(clo, chi);
+        vec3 center = 0.5 * (clo + chi);
+        double radius = 0.5 * (chi - clo).length();
+        bool casts = false;
+        for (size_t m = 0; m < c.mat_ids.size(); m++)
+            casts = casts || casts_caustics(world.materials[c.mat_ids[m]]);
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], clo[k]);
+            hi[k] = std::max(hi[k], chi[k]);
+        }
+        if (casts && c.size() > 0) {
+            photon_caster pc = { center, radius };
+            casters.push_back(pc);
+        }
+    }
+    std::shared_ptr<photon_map> map(new photon_map);
+    if (casters.empty())
+        return map;
+    // directional photons start this far back from the caster they aim at,
+    // which is outside the scene
+    double far = (hi - lo).length() + 1;
+
+    // every source weighs its casters as seen from its centre, and is
+    // itself picked by the power it sends towards them
+    std::vector<photon_source> sources;
+    std::vector<double> source_power;
+    std::vector<double> weights(casters.size());
+    for (int i = 0; i < l.size() + int(world.emitters.size()); i++) {
+        photon_source s;
+        s.light = i < l.size() ? i : -1;
+        s.emitter = i < l.size() ? -1 : world.emitters[i - l.size()];
+        double power;
+        if (s.light >= 0 && l[i].type == LIGHT_DIRECTIONAL) {
+            for (size_t c = 0; c < casters.size(); c++)
+                weights[c] = pi * casters[c].radius * casters[c].radius;
+            power = luminance(l[i].lightColour);
+        } else {
+            vec3 o;
+            if (s.light >= 0) {
+                o = l[i].lightVector;
+                power = luminance(l[i].lightColour);
+            } else {
+                int e = id_index(s.emitter);
+                int mat_id;
+                if (id_type(s.emitter) == PRIM_SPHERE) {
+                    o = world.spheres[e].center;
+                    mat_id = world.spheres[e].mat_id;
+                } else if (id_type(s.emitter) == PRIM_BOX) {
+                    const box_prim& b = world.boxes[e];
+                    o = b.corner + 0.5 * (b.edge[0] + b.edge[1] + b.edge[2]);
+                    mat_id = b.mat_id;
+                } else {
+                    o = (world.triangles[e].p1 + world.triangles[e].p2 + world.triangles[e].p3) / 3;
+                    mat_id = world.triangles[e].mat_id;
+                }
+                power = luminance(world.materials[mat_id].emission) * world.emitter_area(s.emitter);
+            }
+            for (size_t c = 0; c < casters.size(); c++)
+                weights[c] = caster_solid_angle(casters[c], o);
+        }
+        s.casters.build(weights);
+        double total = s.casters.total_weight();
+        if (power * total > 0) {
+            sources.push_back(s);
+            source_power.push_back(power * total);
+        }
+    }
+    if (sources.empty())
+        return map;
+    alias_table source_table;
+    source_table.build(source_power);
+
+    int batches = (count + photon_batch - 1) / photon_batch;
+    std::vector<std::vector<photon> > found(batches);
+    pool.parallel_for(batches, [&](int batch, int) {
+        random_sampler smp(1, 0);
+        int end = std::min(count, (batch + 1) * photon_batch);
+        for (int k = batch * photon_batch; k < end; k++) {
+            smp.start_sample(k, 0, 0);
+            double source_pdf, caster_pdf;
+            const photon_source& s = sources[source_table.pick(smp.get_1d(), source_pdf)];
+            const photon_caster& aim = casters[s.casters.pick(smp.get_1d(), caster_pdf)];
+            double u, v;
+            smp.get_2d(u, v);
+            vec3 o, d, power;
+            if (s.light >= 0 && l[s.light].type == LIGHT_DIRECTIONAL) {
+                const light& lt = l[s.light];
+                vec3 w = unit_vector(lt.lightVector), t, b;
+                make_basis(w, t, b);
+                vec3 disc = map_to_disk(u, v);
+                vec3 x = aim.center + aim.radius * (disc.x() * t + disc.y() * b);
+                // the pdf per area across the light, from every disc x is in
+                double area_pdf = 0;
+                for (size_t c = 0; c < casters.size(); c++) {
+                    vec3 off = x - casters[c].center;
+                    off -= dot(off, w) * w;
+                    if (off.squared_length() <= casters[c].radius * casters[c].radius)
+                        area_pdf += s.casters.pdf(int(c)) / (pi * casters[c].radius * casters[c].radius);
+                }
+                o = x + far * w;
+                d = -w;
+                power = lt.lightColour / area_pdf;
+            } else if (s.light >= 0) {
+                const light& lt = l[s.light];
+                o = lt.lightVector;
+                if (lt.type == LIGHT_SPHERE) {
+                    double a, b;
+                    smp.get_2d(a, b);
+                    o += lt.radius * map_to_sphere(a, b);
+                }
+                d = sample_caster(aim, o, u, v);
+                power = lt.lightColour * (light_reach(lt, lt.lightVector + d) / caster_mixture_pdf(casters, s, o, d));
+            } else {
+                double a, b;
+                smp.get_2d(a, b);
+                o = world.emitter_point(s.emitter, a, b);
+                d = sample_caster(aim, o, u, v);
+                double cos_q = fabs(dot(world.emitter_normal(s.emitter, o), d));
+                power = world.emitted(s.emitter, o, d)
+                      * (cos_q * world.emitter_area(s.emitter) / caster_mixture_pdf(casters, s, o, d));
+            }
+            power /= source_pdf * count;
+            if (power.squared_length() == 0)
+                continue;
+
+            ray r(o, d);
+            for (int bounce = 0; bounce < photon_max_bounces; bounce++) {
+                prim_hit h;
+                if (!world.intersect(r, 0.001, infinity, h))
+                    break;
+                hit_record rec;
+                world.finalize(r, h, rec);
+                material_params textured;
+                const material_params& m = world.surface(r, rec, textured);
+                if (m.flags & MAT_EMIT)
+                    break;
+                if (m.flags & MAT_DIFFUSE) {
+                    if (bounce > 0) {
+                        vec3 wi = -unit_vector(r.direction());
+                        photon ph = { { float(rec.p.x()), float(rec.p.y()), float(rec.p.z()) },
+                                      { float(power.x()), float(power.y()), float(power.z()) },
+                                      { float(wi.x()), float(wi.y()), float(wi.z()) }, 0 };
+                        found[batch].push_back(ph);
+                    }
+                    break;
+                }
+                vec3 attenuation;
+                ray scattered;
+                if (!material_scatter(m, r, rec, 1.0, attenuation, scattered, smp))
+                    break;
+                power *= attenuation;
+                r = scattered;
+            }
+        }
+    });
+    size_t total = 0;
+    for (int b = 0; b < batches; b++)
+        total += found[b].size();
+    std::vector<photon> stored;
+    stored.reserve(total);
+    for (int b = 0; b < batches; b++)
+        stored.insert(stored.end(), found[b].begin(), found[b].end());
+    map->build(stored, pool);
+    return map;
+}
+
+// the caustic light leaving the diffuse point p towards wo, from the photons around it
+vec3 photon_caustics(const scene& world, const material_params& m, const vec3& p, const vec3& nf, const vec3& wo) {
+    count_stat(STAT_PHOTON_GATHERS);
+    vec3 sum(0,0,0);
+    double r2 = world.photons->gather(p, nf, [&](const photon& ph) {
+        vec3 wi(ph.wi[0], ph.wi[1], ph.wi[2]);
+        sum += diffuse_bsdf(m, nf, wo, wi) * vec3(ph.power[0], ph.power[1], ph.power[2]);
+    });
+    return r2 > 0 ? sum / (pi * r2) : vec3(0,0,0);
+}
+
+// The same first_hit guides as ray_color fills in. With indirect_only the
+// light r finds straight away is left out where a shadow ray could have
+// found it (emitters and the environment map); the irradiance cache
+// gathers with it, since its points take that light from shadow rays.
+// The sky gradient and glowing tori and particles are only ever found by
+// bounces.
+vec3 path_color(const ray& camera_ray, const scene& world, const light_list& l, sampler& smp, first_hit* guide = 0, bool indirect_only = false) {
+    const double infinity = std::numeric_limits<double>::infinity();
+    light_shares share(world, l);
+    vec3 radiance(0,0,0), throughput(1,1,1);
+    ray r = camera_ray;
+    // pdf of the diffuse bounce that made r; 0 for camera rays and after mirrors and glass
+    double bsdf_pdf = 0;
+    // the guide is filled in at the first hit that is not a sharp mirror or glass
+    first_hit* open_guide = guide;
+    // the diffuse bounces so far, for the path guide to learn from
+    std::vector<guide_vertex> vertices;
+    // With caustic photons, a diffuse vertex takes its caustics from them,
+    // so an emitter found through mirrors and glass after it counts for
+    // nothing. The irradiance cache's gather rays leave a diffuse point.
+    bool gathered = indirect_only && world.photons;
+    bool caustic = false;
+    int depth = 0;
+    for (;; depth++) {
+        prim_hit h;
+        if (!world.intersect(r, 0.001, infinity, h)) {
+            vec3 sky = background(r, l);
+            double weight = (indirect_only && depth == 0 && l.environment) ? 0.0 : 1.0;
+            if (l.environment && bsdf_pdf > 0)
+                weight = mis_weight(bsdf_pdf, share.environment * l.environment->pdf(unit_vector(r.direction())));
+            radiance += throughput * sky * weight;
+            if (guide && depth <= 1)
+                guide->direct += throughput * sky * weight;
+            if (open_guide) {
+                open_guide->albedo = sky;
+                open_guide->normal = vec3(0,0,0);
+            }
+            break;
+        }
+        hit_record rec;
+        world.finalize(r, h, rec);
+        material_params textured;
+        const material_params& m = world.surface(r, rec, textured);
+        vec3 wo = -unit_vector(r.direction());
+        vec3 n = unit_vector(rec.normal);
+        vec3 nf = dot(n, wo) < 0 ? -n : n;
+        if (open_guide)
+            open_guide->depth += rec.t * r.direction().length();
+
+        if (m.flags & MAT_EMIT) {
+            double weight = (indirect_only && depth == 0 && world.emitter_pdf(r.origin(), h.prim_id, rec.p) > 0) ? 0.0 : 1.0;
+            if (bsdf_pdf > 0)
+                weight = mis_weight(bsdf_pdf, share.emitters * world.emitter_pdf(r.origin(), h.prim_id, rec.p));
+            if (caustic && sampled_emitter_type(id_type(h.prim_id)))
+                weight = 0.0;
+            vec3 e = throughput * world.emitted(h.prim_id, rec.mat_id, rec.p, wo) * weight;
+            radiance += e;
+            if (guide && depth <= 1)
+                guide->direct += e;
+            if (open_guide) {
+                open_guide->albedo = m.emission;
+                open_guide->normal = rec.normal;
+            }
+            break;
+        }
+        if (open_guide && !((m.flags & (MAT_REFLECT | MAT_REFRACT)) && m.fuzz == 0)) {
+            open_guide->albedo = m.albedo;
+            open_guide->normal = rec.normal;
+            open_guide = 0;
+        }
+        if (depth >= 50)
+            break;
+
+        vec3 attenuation;
+        ray scattered;
+        if (m.flags & MAT_DIFFUSE) {
+            // with the irradiance cache the first diffuse vertex ends the
+            // path: direct light from the shadow ray, the rest looked up
+            bool cached = world.irradiance && !indirect_only;
+            // with a guide, a share of the bounces go where it saw light
+            // come from; the pdf is that of the mix of both strategies
+            const path_guide::leaf* cell = world.guiding && !cached ? world.guiding->find(rec.p, nf) : 0;
+            vec3 d = throughput * sample_direct(world, l, m, rec.p, nf, wo, smp, !cached, cell);
+            radiance += d;
+            if (guide && depth == 0)
+                guide->direct += d;
+            if (world.photons)
+                radiance += throughput * photon_caustics(world, m, rec.p, nf, wo);
+            gathered = bool(world.photons);
+            caustic = false;
+            if (cached) {
+                vec3 e = cached_irradiance(world, rec.p, nf, r.width_at(rec.t), [&](const ray& g, sampler& s, first_hit* h) {
+                    return path_color(g, world, l, s, h, true);
+                });
+                // the coat's share of the bounce is left out
+                double diffuse = (m.flags & MAT_SPECULAR) ? 1 - coat_reflectance : 1.0;
+                radiance += throughput * m.albedo * e * diffuse;
+                break;
+            }
+            vec3 wi;
+            double cos_i;
+            // both strategies take the same draws, so a pixel's samples stay
+            // stratified whichever one each of them uses
+            double choice = cell ? smp.get_1d() : 1.0;
+            double u, v;
+            smp.get_2d(u, v);
+            if (choice < guide_fraction) {
+                double guide_pdf;
+                wi = world.guiding->sample(*cell, choice / guide_fraction, u, v, guide_pdf);
+                cos_i = dot(nf, wi);
+                count_stat(STAT_GUIDED_BOUNCES);
+            } else {
+                vec3 t, b;
+                make_basis(nf, t, b);
+                vec3 local = map_to_hemisphere(u, v);
+                wi = local.x() * t + local.y() * b + local.z() * nf;
+                cos_i = local.z();
+            }
+            if (cos_i <= 0)
+                break;
+            bsdf_pdf = cos_i / pi;
+            if (cell)
+                bsdf_pdf = guide_fraction * world.guiding->pdf(*cell, wi) + (1 - guide_fraction) * bsdf_pdf;
+            attenuation = diffuse_bsdf(m, nf, wo, wi) * (cos_i / bsdf_pdf);
+            scattered = ray(rec.p, wi);
+        } else {
+            if (!material_scatter(m, r, rec, 1.0, attenuation, scattered, smp))
+                break;
+            bsdf_pdf = 0;
+            caustic = gathered;
+        }
+        count_stat(STAT_BOUNCE_RAYS);
+        throughput *= attenuation;
+        if (world.guiding && bsdf_pdf > 0) {
+            guide_vertex gv = { rec.p, nf, scattered.direction(), throughput, radiance, dot(nf, scattered.direction()) / bsdf_pdf };
+            vertices.push_back(gv);
+        }
+        // Russian roulette once the path has had a few bounces
+        if (depth >= 3) {
+            double keep = std::min(0.95, std::max(throughput.x(), std::max(throughput.y(), throughput.z())));
+            if (smp.get_1d() >= keep)
+                break;
+            throughput /= keep;
+        }
+        // the cone keeps its spread through every bounce, as if each were a flat mirror
+        scattered.width = r.width_at(rec.t);
+        scattered.spread = r.spread;
+        r = scattered;
+    }
+    // what came back along each diffuse bounce is the radiance added since,
+    // over the throughput up to there
+    for (size_t k = 0; k < vertices.size(); k++) {
+        const guide_vertex& gv = vertices[k];
+        vec3 arrived = radiance - gv.radiance;
+        vec3 incident(gv.throughput.x() > 0 ? arrived.x() / gv.throughput.x() : 0.0,
+                      gv.throughput.y() > 0 ? arrived.y() / gv.throughput.y() : 0.0,
+                      gv.throughput.z() > 0 ? arrived.z() / gv.throughput.z() : 0.0);
+        world.guiding->record(gv.p, gv.n, gv.wi, luminance(incident) * gv.weight);
+    }
+    count_stat(STAT_PATH_DEPTH + std::min(depth, stats_depth_bins - 1));
+    return radiance;
+}
+
+// pixel rectangle [x0, x1) x [y0, y1); rows count down from the top of the image
+struct tile {
+    int x0, y0, x1, y1;
+};
+
+inline std::vector<tile> make_tiles(int nx, int ny, int size) {
+    std::vector<tile> tiles;
+    for (int y = 0; y < ny; y += size) {
+        for (int x = 0; x < nx; x += size) {
+            tile t = { x, y, std::min(nx, x + size), std::min(ny, y + size) };
+            tiles.push_back(t);
+        }
+    }
+    return tiles;
+}
+
+// takes samples [s0, s1) of pixel (i, y) of an nx x ny image, y counting
+// down from the top
+pixel_sums render_pixel(const scene& world, const camera& cam, const light_list& l, int nx, int ny, int i, int y, int s0, int s1, sampler& smp) {
+    // sampler and camera use j counting up from the bottom row
+    int j = ny - 1 - y;
+    pixel_sums px;
+    // what the pixel cost, for the cost AOV
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+    uint64_t tests = local_tests();
+    // the angle a pixel covers, which the ray cones start with
+    vec3 d0 = unit_vector(cam.get_ray((i + 0.5) / nx, (j + 0.5) / ny, vec3(0,0,0)).direction());
+    vec3 d1 = unit_vector(cam.get_ray((i + 0.5) / nx, (j + 1.5) / ny, vec3(0,0,0)).direction());
+    double spread = (d1 - d0).length();
+    for (int s = s0; s < s1; s++) {
+        smp.start_sample(i, j, s);
+        double du, dv;
+        smp.get_2d(du, dv);
+        double u = double(i + du) / double(nx);
+        double v = double(j + dv) / double(ny);
+        ray r = cam.get_ray(u, v, sample_disk(smp));
+        r.spread = spread;
+        first_hit g = { vec3(0,0,0), vec3(0,0,0), 0, vec3(0,0,0) };
+        vec3 c = world.integrator == INTEGRATOR_PATH ? path_color(r, world, l, smp, &g) : ray_color(r, world, l, 0, smp, &g);
+        double lum = luminance(c);
+        px.colour += c;
+        px.lum_sq += lum * lum;
+        px.albedo += g.albedo;
+        px.normal += g.normal;
+        px.depth += g.depth;
+        px.direct += g.direct;
+        px.indirect += c - g.direct;
+    }
+    px.count = s1 - s0;
+    count_stat(STAT_CAMERA_RAYS, px.count);
+    px.time_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+    px.tests = double(local_tests() - tests);
+    return px;
+}
+
+// brings every pixel of the tile up to ns samples, carrying on from the
+// samples it already holds
+void render_tile(const scene& world, const camera& cam, const light_list& l, const tile& t, int ns, sampler& smp, framebuffer& out) {
+    for (int y = t.y0; y < t.y1; y++) {
+        for (int i = t.x0; i < t.x1; i++) {
+            int first = int(out.samples(size_t(y) * out.width() + i));
+            if (first < ns)
+                out.add(i, y, render_pixel(world, cam, l, out.width(), out.height(), i, y, first, ns, smp));
+        }
+    }
+}
+
+// what to render: image size, sampling and view
+struct render_job {
+    std::string scene_name;
+    int nx, ny, ns;
+    std::string sampler_name;
+    bool denoise;
+    vec3 lookfrom, lookat;
+    double vfov, aperture;
+
+    render_job()
+    : scene_name("default"), nx(600), ny(300), ns(64), sampler_name("sobol"), denoise(false),
+      lookfrom(-3, 1, 5), lookat(0, -0.5, -1), vfov(40), aperture(0.1) {}
+
+    camera make_camera() const {
+        double dist_to_focus = (lookfrom - lookat).length();
+        return camera(lookfrom, lookat, vec3(0,1,0), vfov, double(nx)/double(ny), aperture, dist_to_focus);
+    }
+};
+
+// Renders every tile on the pool; samplers holds one sampler per pool
+// thread. progress gets the tiles done and the total after each one. Once
+// stop returns true the remaining tiles are skipped, which leaves them
+// with the samples they had.
+void render_tiles(const scene& world, const camera& cam, const light_list& l, int ns, std::vector<std::unique_ptr<sampler> >& samplers,
+                  thread_pool& pool, framebuffer& image, const std::function<void(int, int)>& progress,
+                  const std::function<bool()>& stop = std::function<bool()>()) {
+    std::vector<tile> tiles = make_tiles(image.width(), image.height(), 32);
+    std::atomic<int> tiles_done(0);
+    pool.parallel_for(int(tiles.size()), [&](int t, int thread) {
+        if (!stop || !stop()) {
+            trace_span span("tile", "render");
+            span.arg("x", tiles[t].x0);
+            span.arg("y", tiles[t].y0);
+            span.arg("spp", ns);
+            render_tile(world, cam, l, tiles[t], ns, *samplers[thread], image);
+        }
+        progress(++tiles_done, int(tiles.size()));
+    });
+}
+
+// plain-text PPM with gamma 2
+void write_ppm(std::ostream& out, const std::vector<vec3>& colour, int nx, int ny) {
+    out << "P3\n" << nx << ' ' << ny << "\n255\n";
+    for (size_t p = 0; p < colour.size(); p++) {
+        // emitters make radiance above 1 common; the PPM only goes to 255,
+        // and the unclamped values are in the AOV file
+        vec3 col;
+        for (int c = 0; c < 3; c++)
+            col[c] = sqrt(std::max(0.0, std::min(1.0, colour[p][c])));
+        int ir = int(255.99*col[0]);
+        int ig = int(255.99*col[1]);
+        int ib = int(255.99*col[2]);
+        out << ir << " " << ig << " " << ib << "\n";
+    }
+}
+
+// writes next to path and renames over it, so path always holds a whole image
+bool write_ppm_file(const std::string& path, const std::vector<vec3>& colour, int nx, int ny) {
+    std::string partial = path + ".partial";
+    {
+        std::ofstream out(partial.c_str());
+        write_ppm(out, colour, nx, ny);
+        if (!out.flush())
+            return false;
+    }
+    return std::rename(partial.c_str(), path.c_str()) == 0;
+}
+
+#endif
@@ -0,0 +1,447 @@
+#ifndef SAMPLERH
+#define SAMPLERH
+
+#include <algorithm>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "vec3.h"
+
+/*
+    Samplers hand out the numbers for one path at a time. start_sample()
+    picks the pixel and sample index, and every get_1d/get_2d call after it
+    moves on to the next dimension (pixel position, lens, then light and
+    scatter at every bounce). All of them are deterministic for a given
+    pixel, sample and seed, and keep no state shared between threads.
+*/
+
+inline uint32_t hash_u32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash_u32(seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2)));
+}
+
+inline double u32_to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+class sampler {
+    public:
+        sampler(int spp, uint32_t seed) : samples_per_pixel(spp), seed(seed) {}
+        virtual ~sampler() {}
+
+        void start_sample(int x, int y, int index) {
+            px = x;
+            py = y;
+            sample_index = index;
+            dimension = 0;
+            pixel_seed = hash_combine(hash_combine(seed, uint32_t(x)), uint32_t(y));
+            start();
+        }
+        virtual double get_1d() = 0;
+        virtual void get_2d(double& u, double& v) = 0;
+
+    protected:
+        virtual void start() {}
+        uint32_t dimension_seed() {
+            return hash_combine(pixel_seed, uint32_t(dimension++));
+        }
+
+    protected:
+        int samples_per_pixel;
+        uint32_t seed;
+        int px, py;
+        int sample_index;
+        int dimension;
+        uint32_t pixel_seed;
+};
+
+inline vec3 sample_disk(sampler& smp) {
+    double u, v;
+    smp.get_2d(u, v);
+    return map_to_disk(u, v);
+}
+
+inline vec3 sample_ball(sampler& smp) {
+    double u, v;
+    smp.get_2d(u, v);
+    return map_to_ball(u, v, smp.get_1d());
+}
+
+// Picks index i with probability weight[i] / sum from one uniform number
+// in constant time (Vose's alias method). With no weight at all every
+// index is equally likely.
+class alias_table {
+    public:
+        alias_table() : total(0) {}
+        void build(const std::vector<double>& weights);
+
+        int size() const { return int(weight.size()); }
+        double total_weight() const { return total; }
+        double pdf(int i) const { return total > 0 ? weight[i] / total : 1.0 / weight.size(); }
+        // u in [0, 1); pdf is set to the chance of the returned index
+        int pick(double u, double& pdf) const;
+
+    private:
+        std::vector<double> weight;
+        // column i keeps i with probability keep[i], else gives alias[i]
+        std::vector<double> keep;
+        std::vector<int> alias;
+        double total;
+};
+
+inline void alias_table::build(const std::vector<double>& weights) {
+    size_t n = weights.size();
+    weight = weights;
+    keep.assign(n, 1.0);
+    alias.resize(n);
+    total = 0;
+    for (size_t i = 0; i < n; i++)
+        total += weights[i];
+
+    // scaled so the average column holds 1; columns below 1 are topped up
+    // from one that has too much
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++) {
+        scaled[i] = total > 0 ? weights[i] * n / total : 1.0;
+        alias[i] = int(i);
+        (scaled[i] < 1 ? small : large).push_back(int(i));
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), g = large.back();
+        small.pop_back();
+        keep[s] = scaled[s];
+        alias[s] = g;
+        scaled[g] -= 1 - scaled[s];
+        if (scaled[g] < 1) {
+            large.pop_back();
+            small.push_back(g);
+        }
+    }
+}
+
+inline int alias_table::pick(double u, double& p) const {
+    double x = u * weight.size();
+    int column = std::min(int(x), int(weight.size()) - 1);
+    int i = (x - column < keep[column]) ? column : alias[column];
+    p = pdf(i);
+    return i;
+}
+
+// Independent uniform numbers, like random_double(), but from a PCG32
+// stream seeded per pixel and sample.
+class random_sampler : public sampler {
+    public:
+        random_sampler(int spp, uint32_t seed) : sampler(spp, seed), state(0) {}
+        virtual double get_1d() {
+            return u32_to_unit(next());
+        }
+        virtual void get_2d(double& u, double& v) {
+            u = get_1d();
+            v = get_1d();
+        }
+
+    protected:
+        virtual void start() {
+            state = 0;
+            next();
+            state += hash_combine(pixel_seed, uint32_t(sample_index));
+            next();
+        }
+        uint32_t next() {
+            uint64_t old = state;
+            state = old * 6364136223846793005ull + 1442695040888963407ull;
+            uint32_t xorshifted = uint32_t(((old >> 18u) ^ old) >> 27u);
+            uint32_t rot = uint32_t(old >> 59u);
+            return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+        }
+
+    private:
+        uint64_t state;
+};
+
+// Correlated multi-jittered sampling (Kensler 2013): every 2D dimension is
+// a jittered m x n grid that is also stratified in x and y separately, and
+// every 1D dimension is a shuffled, jittered set of spp strata. The
+// pattern is reshuffled per pixel and per dimension.
+class stratified_sampler : public sampler {
+    public:
+        stratified_sampler(int spp, uint32_t seed) : sampler(spp, seed) {
+            m = int(sqrt(double(spp)));
+            if (m < 1)
+                m = 1;
+            n = (spp + m - 1) / m;
+        }
+        virtual double get_1d() {
+            uint32_t p = dimension_seed();
+            uint32_t s = permute(uint32_t(sample_index), uint32_t(samples_per_pixel), p * 0x68bc21ebu);
+            return (s + jitter(uint32_t(sample_index), p * 0x02e5be93u)) / samples_per_pixel;
+        }
+        virtual void get_2d(double& u, double& v) {
+            uint32_t p = dimension_seed();
+            uint32_t s = permute(uint32_t(sample_index), uint32_t(samples_per_pixel), p * 0x51633e2du);
+            uint32_t sx = permute(s % m, m, p * 0x68bc21ebu);
+            uint32_t sy = permute(s / m, n, p * 0x02e5be93u);
+            double jx = jitter(s, p * 0x967a889bu);
+            double jy = jitter(s, p * 0x368cc8b7u);
+            u = std::min((s % m + (sy + jx) / n) / m, 1.0 - 1e-9);
+            v = std::min((s / m + (sx + jy) / m) / n, 1.0 - 1e-9);
+        }
+
+    private:
+        // a random permutation of [0, l) evaluated at i, by cycle walking
+        static uint32_t permute(uint32_t i, uint32_t l, uint32_t p) {
+            uint32_t w = l - 1;
+            w |= w >> 1;
+            w |= w >> 2;
+            w |= w >> 4;
+            w |= w >> 8;
+            w |= w >> 16;
+            do {
+                i ^= p; i *= 0xe170893d;
+                i ^= p >> 16;
+                i ^= (i & w) >> 4;
+                i ^= p >> 8; i *= 0x0929eb3f;
+                i ^= p >> 23;
+                i ^= (i & w) >> 1; i *= 1 | p >> 27;
+                i *= 0x6935fa69;
+                i ^= (i & w) >> 11; i *= 0x74dcb303;
+                i ^= (i & w) >> 2; i *= 0x9e501cc3;
+                i ^= (i & w) >> 2; i *= 0xc860a3df;
+                i &= w;
+                i ^= i >> 5;
+            } while (i >= l);
+            return (i + p) % l;
+        }
+        static double jitter(uint32_t i, uint32_t p) {
+            return u32_to_unit(hash_combine(p, i));
+        }
+
+    private:
+        uint32_t m, n;
+};
+
+// Sobol (0,2)-sequence for the first two dimensions. The hash-based
+// nested uniform scramble (Burley 2020) Owen-scrambles the values and
+// shuffles the sample order per pixel and per dimension.
+inline uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffu) << 8) | ((x & 0xff00ff00u) >> 8);
+    x = ((x & 0x0f0f0f0fu) << 4) | ((x & 0xf0f0f0f0u) >> 4);
+    x = ((x & 0x33333333u) << 2) | ((x & 0xccccccccu) >> 2);
+    x = ((x & 0x55555555u) << 1) | ((x & 0xaaaaaaaau) >> 1);
+    return x;
+}
+
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+inline void sobol_2d(uint32_t index, uint32_t& x, uint32_t& y) {
+    x = reverse_bits(index);
+    y = 0;
+    uint32_t v = 0x80000000u;
+    for (; index; index >>= 1, v ^= v >> 1)
+        if (index & 1)
+            y ^= v;
+}
+
+class sobol_sampler : public sampler {
+    public:
+        sobol_sampler(int spp, uint32_t seed) : sampler(spp, seed) {}
+        virtual double get_1d() {
+            uint32_t p = dimension_seed();
+            uint32_t i = nested_uniform_scramble(uint32_t(sample_index), p);
+            return u32_to_unit(nested_uniform_scramble(reverse_bits(i), hash_u32(p)));
+        }
+        virtual void get_2d(double& u, double& v) {
+            uint32_t p = dimension_seed();
+            uint32_t x, y;
+            sobol_2d(nested_uniform_scramble(uint32_t(sample_index), p), x, y);
+            u = u32_to_unit(nested_uniform_scramble(x, hash_u32(p)));
+            v = u32_to_unit(nested_uniform_scramble(y, hash_u32(p + 1)));
+        }
+};
+
+/*
+    Blue-noise dithered sampling (Georgiev and Fajardo 2016). Every pixel
+    uses the same scrambled Sobol points, shifted toroidally by a value
+    read from a blue-noise mask, so neighbouring pixels get decorrelated
+    errors and the remaining noise is high-frequency.
+*/
+class blue_noise_mask {
+    public:
+        // Ulichney's void-and-cluster method on a size x size torus
+        blue_noise_mask(int size, uint32_t seed);
+        double value(int x, int y) const {
+            return values[(y & (size - 1)) * size + (x & (size - 1))];
+        }
+
+    public:
+        int size;
+        std::vector<double> values;
+
+    private:
+        void splat(int i, double sign);
+        int tightest_cluster() const;
+        int largest_void() const;
+
+    private:
+        std::vector<double> kernel;
+        std::vector<double> energy;
+        std::vector<char> pattern;
+};
+
+blue_noise_mask::blue_noise_mask(int sz, uint32_t seed) : size(sz) {
+    int n = size * size;
+    const double sigma = 1.5;
+    kernel.resize(n);
+    for (int dy = 0; dy < size; dy++) {
+        for (int dx = 0; dx < size; dx++) {
+            int tx = std::min(dx, size - dx);
+            int ty = std::min(dy, size - dy);
+            kernel[dy*size + dx] = exp(-(tx*tx + ty*ty) / (2*sigma*sigma));
+        }
+    }
+
+    // initial pattern: about a tenth of the cells, then relaxed until the
+    // tightest cluster is already the largest void
+    energy.assign(n, 0.0);
+    pattern.assign(n, 0);
+    int ones = 0;
+    for (uint32_t k = 0; ones < n / 10; k++) {
+        int i = int(hash_combine(seed, k) % uint32_t(n));
+        if (!pattern[i]) {
+            pattern[i] = 1;
+            splat(i, 1);
+            ones++;
+        }
+    }
+    for (int iter = 0; iter < n; iter++) {
+        int c = tightest_cluster();
+        pattern[c] = 0;
+        splat(c, -1);
+        int v = largest_void();
+        pattern[v] = 1;
+        splat(v, 1);
+        if (v == c)
+            break;
+    }
+    std::vector<char> initial_pattern = pattern;
+    std::vector<double> initial_energy = energy;
+
+    std::vector<int> rank(n);
+    for (int r = ones - 1; r >= 0; r--) {
+        int c = tightest_cluster();
+        pattern[c] = 0;
+        splat(c, -1);
+        rank[c] = r;
+    }
+    pattern = initial_pattern;
+    energy = initial_energy;
+    for (int r = ones; r < n; r++) {
+        int v = largest_void();
+        pattern[v] = 1;
+        splat(v, 1);
+        rank[v] = r;
+    }
+
+    values.resize(n);
+    for (int i = 0; i < n; i++)
+        values[i] = (rank[i] + 0.5) / n;
+    kernel.clear();
+    energy.clear();
+    pattern.clear();
+}
+
+void blue_noise_mask::splat(int i, double sign) {
+    int ix = i % size;
+    int iy = i / size;
+    for (int y = 0; y < size; y++) {
+        const double* row = &kernel[((y - iy + size) % size) * size];
+        double* e = &energy[y * size];
+        for (int x = 0; x < size; x++)
+            e[x] += sign * row[(x - ix + size) % size];
+    }
+}
+
+int blue_noise_mask::tightest_cluster() const {
+    int best = -1;
+    for (size_t i = 0; i < pattern.size(); i++)
+        if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+            best = int(i);
+    return best;
+}
+
+int blue_noise_mask::largest_void() const {
+    int best = -1;
+    for (size_t i = 0; i < pattern.size(); i++)
+        if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+            best = int(i);
+    return best;
+}
+
+class blue_noise_sampler : public sampler {
+    public:
+        blue_noise_sampler(int spp, uint32_t seed) : sampler(spp, seed), mask(shared_mask()) {}
+        virtual double get_1d() {
+            int d = dimension++;
+            uint32_t p = hash_combine(seed, uint32_t(d));
+            double u = u32_to_unit(nested_uniform_scramble(reverse_bits(uint32_t(sample_index)), p));
+            return shift(u, d, 0);
+        }
+        virtual void get_2d(double& u, double& v) {
+            int d = dimension++;
+            uint32_t p = hash_combine(seed, uint32_t(d));
+            uint32_t x, y;
+            sobol_2d(uint32_t(sample_index), x, y);
+            u = shift(u32_to_unit(nested_uniform_scramble(x, p)), d, 0);
+            v = shift(u32_to_unit(nested_uniform_scramble(y, hash_u32(p))), d, 1);
+        }
+
+    private:
+        static const blue_noise_mask& shared_mask() {
+            static blue_noise_mask m(64, 0x2545f491u);
+            return m;
+        }
+        // each dimension and axis reads the mask at its own fixed offset
+        double shift(double u, int d, int axis) const {
+            int ox = int(hash_combine(uint32_t(d), uint32_t(axis)) & 63);
+            int oy = int(hash_combine(uint32_t(axis), uint32_t(d)) & 63);
+            double s = u + mask.value(px + ox, py + oy);
+            return s < 1.0 ? s : s - 1.0;
+        }
+
+    private:
+        const blue_noise_mask& mask;
+};
+
+// returns 0 for an unknown name
+inline sampler* make_sampler(const std::string& name, int spp, uint32_t seed) {
+    if (name == "random")
+        return new random_sampler(spp, seed);
+    if (name == "stratified")
+        return new stratified_sampler(spp, seed);
+    if (name == "sobol")
+        return new sobol_sampler(spp, seed);
+    if (name == "bluenoise")
+        return new blue_noise_sampler(spp, seed);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,724 @@
+#ifndef SCENEH
+#define SCENEH
+
+#include <vector>
+#include <map>
+#include <memory>
+#include "hittable_list.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "torus.h"
+#include "cube.h"
+#include "material.h"
+#include "stats.h"
+#include "texture.h"
+#include "irradiance.h"
+#include "guiding.h"
+#include "photons.h"
+#include "particles.h"
+#include "chunks.h"
+#include "bvh.h"
+#include "trace.h"
+
+/*
+    Flat scene representation. The hittable/material classes are only used
+    to describe a scene; compile() lowers them into typed arrays that are
+    walked without any virtual calls. Materials go into a single table of
+    parameter records, and identical records are stored once.
+
+    Traversal only keeps a prim_hit for the closest hit so far; position,
+    normal and material are filled in once, by finalize(), for the final one.
+    A particle hit keeps the particle itself, as its chunk may be unmapped
+    by then. A primitive id packs the type into the top bits and the array
+    index into the rest.
+
+    Texture coordinates of triangles are kept apart from the triangles,
+    since only finalize() reads them. A textured material is looked up by
+    surface(), which filters the texture over the ray's footprint.
+
+    Spheres, triangles and boxes with an emissive material are also
+    listed as emitters, with an alias table over their power, so the path
+    integrator can aim shadow rays at them.
+
+    A particle cloud is walked through its own BVH (particles.h) and is
+    shared with the hittable it came from, not copied. Its particles are
+    numbered on from the particles of the clouds before it. A streamed
+    cloud (chunks.h) is in parts, one per chunk, and a part of a cloud
+    is only tested when the ray meets its box.
+
+    compile() puts the primitives in a quantised BVH (bvh.h), one entry
+    per primitive and per part of a cloud, unless bvh_bits is 0; then
+    every ray is tested against everything, as before there was one.
+*/
+
+const int id_type_shift = 28;
+const int id_index_mask = (1 << id_type_shift) - 1;
+
+inline int make_id(int type, int index) { return (type << id_type_shift) | index; }
+inline int id_type(int id) { return id >> id_type_shift; }
+inline int id_index(int id) { return id & id_index_mask; }
+
+enum prim_type {
+    PRIM_SPHERE,
+    PRIM_TRIANGLE,
+    PRIM_TORUS,
+    PRIM_BOX,
+    PRIM_PARTICLE,
+    PRIM_TYPES
+};
+static_assert(PRIM_TYPES == stats_prim_types, "stats count tests per primitive type");
+static_assert(particle_max_count <= uint64_t(id_index_mask) + 1, "every particle needs an id");
+
+// tori and particles give off light when hit, but are not sampled
+inline bool sampled_emitter_type(int type) { return type == PRIM_SPHERE || type == PRIM_TRIANGLE || type == PRIM_BOX; }
+
+// how render_pixel turns a camera ray into colour (see render.h)
+enum integrator_type {
+    // the original shading: Blinn highlights and shadow darkening for the
+    // lights, indirect light and sky from the bounces
+    INTEGRATOR_BLINN,
+    // physically based path tracing with light sampling and MIS
+    INTEGRATOR_PATH
+};
+
+struct prim_hit {
+    double t;
+    int prim_id;
+    // parametric position on the primitive (barycentrics for triangles,
+    // the face crossed in u for boxes)
+    double u, v;
+    // a particle's sphere and table material, taken at the hit while a
+    // streamed cloud's chunk is still held
+    vec3 center;
+    double radius;
+    int mat_id;
+};
+
+struct sphere_prim {
+    vec3 center;
+    double radius;
+    int mat_id;
+};
+
+struct triangle_prim {
+    vec3 p1, p2, p3, normal;
+    int mat_id;
+};
+
+struct triangle_uv {
+    vec3 t1, t2, t3;
+    double scale;
+};
+
+struct torus_prim {
+    double R1;
+    double R2;
+    int mat_id;
+};
+
+// a box by a corner and its edges, with the inverse of the edges (cube.h)
+struct box_prim {
+    vec3 corner;
+    vec3 edge[3];
+    vec3 to_local[3];
+    int mat_id;
+};
+
+// a particle cloud and the table ids of the materials its particles pick from
+struct cloud_prim {
+    std::shared_ptr<const particle_set> particles;
+    // or, for a streamed cloud, the file of its chunks
+    std::shared_ptr<const chunked_particles> chunks;
+    std::vector<int> mat_ids;
+    // id index of its first particle
+    int first;
+
+    int size() const { return particles ? particles->size() : chunks->size(); }
+    void bounds(vec3& lo, vec3& hi) const {
+        if (particles)
+            particles->bounds(lo, hi);
+        else
+            chunks->bounds(lo, hi);
+    }
+};
+
+// a cloud, or one chunk of a streamed cloud (chunk -1 for the whole of
+// another cloud)
+struct cloud_part {
+    int cloud;
+    int chunk;
+};
+
+class scene {
+    public:
+        scene() : integrator(INTEGRATOR_BLINN), bvh_bits(8) {}
+
+        // returns the table index of m, adding it if no equal record exists
+        int add_material(const material_params& m);
+
+        bool intersect(const ray& r, double t_min, double t_max, prim_hit& h) const;
+        void finalize(const ray& r, const prim_hit& h, hit_record& rec) const;
+        bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+            prim_hit h;
+            if (!intersect(r, t_min, t_max, h))
+                return false;
+            finalize(r, h, rec);
+            return true;
+        }
+        // The material at the hit. A textured one is copied into textured,
+        // with the texture at the hit multiplied into its albedo.
+        const material_params& surface(const ray& r, const hit_record& rec, material_params& textured) const;
+        // true as soon as anything is hit; used for shadow rays
+        bool occluded(const ray& r, double t_min, double t_max) const;
+        // heap bytes held by the arrays and the material lookup
+        size_t bytes_used() const;
+
+        // lists the emissive spheres and triangles; compile() calls it
+        void find_emitters();
+        // puts the primitives in the BVH at bvh_bits; compile() calls it
+        void build_bvh();
+        // Picks an emitter by power and a point q on it, uniformly by area,
+        // as seen from p. Sets the emitted radiance towards p and the
+        // solid-angle pdf at p, picking included; false if nothing can
+        // be seen from p.
+        bool sample_emitter(const vec3& p, sampler& smp, vec3& q, vec3& radiance, double& pdf) const;
+        // the pdf sample_emitter would have had for point q on prim_id
+        double emitter_pdf(const vec3& p, int prim_id, const vec3& q) const;
+        // radiance given off at point q of prim_id towards the direction wo;
+        // for a hit, with the table material finalize found
+        vec3 emitted(int prim_id, const vec3& q, const vec3& wo) const { return emitted(prim_id, emitter_material(prim_id), q, wo); }
+        vec3 emitted(int prim_id, int mat_id, const vec3& q, const vec3& wo) const;
+        // a point on emitter prim_id from two uniform numbers, uniform by area
+        vec3 emitter_point(int prim_id, double u, double v) const;
+        vec3 emitter_normal(int prim_id, const vec3& q) const;
+        double emitter_area(int prim_id) const;
+        bool scatter(const ray& r_in, const hit_record& rec, double c, vec3& attenuation, ray& scattered, sampler& smp) const {
+            return material_scatter(materials[rec.mat_id], r_in, rec, c, attenuation, scattered, smp);
+        }
+        void blinn(const hit_record& rec, const light& l, const vec3& viewVector, ray& shadowRay, vec3& specular, double& NLAngle,
+                   sampler& smp) const {
+            material_blinn(materials[rec.mat_id], rec, l, viewVector, shadowRay, specular, NLAngle, smp);
+        }
+
+    public:
+        std::vector<sphere_prim> spheres;
+        std::vector<triangle_prim> triangles;
+        std::vector<triangle_uv> triangle_uvs;
+        std::vector<torus_prim> tori;
+        std::vector<box_prim> boxes;
+        std::vector<cloud_prim> clouds;
+        std::vector<cloud_part> cloud_parts;
+        std::vector<material_params> materials;
+        std::vector<int> emitters;
+        alias_table emitter_table;
+        int integrator;
+        // bits of the BVH's boxes, 8 or 16; 0 leaves the scene without one
+        int bvh_bits;
+        bvh accel;
+        // when set, camera rays look up the diffuse bounce at their first
+        // diffuse hit here instead of tracing it (see render.h)
+        std::shared_ptr<irradiance_cache> irradiance;
+        // when set, the path integrator samples part of its diffuse
+        // bounces from it and teaches it what they found
+        std::shared_ptr<path_guide> guiding;
+        // when set, the path integrator takes caustics at diffuse points
+        // from these photons instead of from bounces (see render.h)
+        std::shared_ptr<photon_map> photons;
+
+    private:
+        // of a sampled emitter or a torus
+        int emitter_material(int prim_id) const;
+        // Tests BVH entry e, counting into tests by type; sets h on a hit.
+        // An entry of type PRIM_PARTICLE is a part of a cloud.
+        bool hit_entry(int e, const ray& r, double t_min, double t_max, bool any, prim_hit& h, uint64_t* tests) const;
+
+    private:
+        std::map<material_params, int> material_ids;
+};
+
+int scene::add_material(const material_params& m) {
+    std::map<material_params, int>::iterator it = material_ids.find(m);
+    if (it != material_ids.end())
+        return it->second;
+    int id = int(materials.size());
+    materials.push_back(m);
+    material_ids[m] = id;
+    return id;
+}
+
+size_t scene::bytes_used() const {
+    size_t particles = 0;
+    for (size_t c = 0; c < clouds.size(); c++)
+        particles += (clouds[c].particles ? clouds[c].particles->bytes_used() : clouds[c].chunks->bytes_used())
+                   + clouds[c].mat_ids.capacity() * sizeof(int);
+    return particles
+         + spheres.capacity() * sizeof(sphere_prim)
+         + triangles.capacity() * sizeof(triangle_prim)
+         + triangle_uvs.capacity() * sizeof(triangle_uv)
+         + tori.capacity() * sizeof(torus_prim)
+         + boxes.capacity() * sizeof(box_prim)
+         + clouds.capacity() * sizeof(cloud_prim)
+         + cloud_parts.capacity() * sizeof(cloud_part)
+         + accel.bytes_used()
+         + materials.capacity() * sizeof(material_params)
+         + emitters.capacity() * (sizeof(int) + 2 * sizeof(double) + sizeof(int))
+         + material_ids.size() * (sizeof(material_params) + sizeof(int) + 4 * sizeof(void*));
+}
+
+void scene::build_bvh() {
+    trace_span span("build bvh", "scene");
+    accel = bvh();
+    if (bvh_bits == 0)
+        return;
+    std::vector<int> entries;
+    std::vector<bvh_box> bounds;
+    // adds an entry bounded by the points lo and hi
+    auto add = [&](int e, const vec3& lo, const vec3& hi) {
+        bvh_box b;
+        for (int k = 0; k < 3; k++) {
+            b.lo[k] = float_below(lo[k]);
+            b.hi[k] = float_above(hi[k]);
+        }
+        entries.push_back(e);
+        bounds.push_back(b);
+    };
+    for (size_t i = 0; i < spheres.size(); i++) {
+        vec3 r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+        add(make_id(PRIM_SPHERE, int(i)), spheres[i].center - r, spheres[i].center + r);
+    }
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const triangle_prim& tr = triangles[i];
+        vec3 lo = tr.p1, hi = tr.p1;
+        for (int k = 0; k < 3; k++) {
+            lo[k] = std::min(lo[k], std::min(tr.p2[k], tr.p3[k]));
+            hi[k] = std::max(hi[k], std::max(tr.p2[k], tr.p3[k]));
+        }
+        add(make_id(PRIM_TRIANGLE, int(i)), lo, hi);
+    }
+    for (size_t i = 0; i < tori.size(); i++) {
+        // tori sit at the origin around the z axis
+        double reach = tori[i].R1 + tori[i].R2;
+        add(make_id(PRIM_TORUS, int(i)), vec3(-reach, -reach, -tori[i].R2), vec3(reach, reach, tori[i].R2));
+    }
+    for (size_t i = 0; i < boxes.size(); i++) {
+        const box_prim& b = boxes[i];
+        vec3 lo = b.corner, hi = b.corner;
+        for (int c = 1; c < 8; c++) {
+            vec3 q = b.corner + ((c & 1) ? b.edge[0] : vec3(0,0,0)) + ((c & 2) ? b.edge[1] : vec3(0,0,0))
+                   + ((c & 4) ? b.edge[2] : vec3(0,0,0));
+            for (int k = 0; k < 3; k++) {
+                lo[k] = std::min(lo[k], q[k]);
+                hi[k] = std::max(hi[k], q[k]);
+            }
+        }
+        add(make_id(PRIM_BOX, int(i)), lo, hi);
+    }
+    for (size_t p = 0; p < cloud_parts.size(); p++) {
+        const cloud_prim& c = clouds[cloud_parts[p].cloud];
+        vec3 lo, hi;
+        if (cloud_parts[p].chunk >= 0) {
+            const chunk_info& info = c.chunks->chunk(cloud_parts[p].chunk);
+            lo = vec3(info.lo[0], info.lo[1], info.lo[2]);
+            hi = vec3(info.hi[0], info.hi[1], info.hi[2]);
+        } else if (c.size() > 0) {
+            c.bounds(lo, hi);
+        } else {
+            continue;
+        }
+        add(make_id(PRIM_PARTICLE, int(p)), lo, hi);
+    }
+    accel.build(entries, bounds, bvh_bits);
+    span.arg("entries", entries.size());
+    span.arg("nodes", accel.node_count());
+}
+
+bool scene::hit_entry(int e, const ray& r, double t_min, double t_max, bool any, prim_hit& h, uint64_t* tests) const {
+    int i = id_index(e);
+    double t, u = 0, v = 0;
+    switch (id_type(e)) {
+        case PRIM_SPHERE:
+            tests[PRIM_SPHERE]++;
+            if (!intersect_sphere(spheres[i].center, spheres[i].radius, r, t_min, t_max, t))
+                return false;
+            break;
+        case PRIM_TRIANGLE: {
+            const triangle_prim& tr = triangles[i];
+            tests[PRIM_TRIANGLE]++;
+            if (!intersect_triangle(tr.p1, tr.p2, tr.p3, tr.normal, r, t_min, t_max, t, u, v))
+                return false;
+            break;
+        }
+        case PRIM_TORUS:
+            tests[PRIM_TORUS]++;
+            if (!intersect_torus(tori[i].R1, tori[i].R2, r, t_min, t_max, t))
+                return false;
+            break;
+        case PRIM_BOX: {
+            int face;
+            tests[PRIM_BOX]++;
+            if (!intersect_box(boxes[i].corner, boxes[i].to_local, r, t_min, t_max, t, face))
+                return false;
+            u = face;
+            break;
+        }
+        default: {
+            const cloud_prim& c = clouds[cloud_parts[i].cloud];
+            int index, leaf, material;
+            if (cloud_parts[i].chunk >= 0) {
+                if (!c.chunks->intersect(cloud_parts[i].chunk, r, t_min, t_max, any, t, index, h.center, h.radius, material,
+                                         tests[PRIM_PARTICLE]))
+                    return false;
+            } else {
+                if (!c.particles->intersect(r, t_min, t_max, any, t, index, leaf, tests[PRIM_PARTICLE]))
+                    return false;
+                c.particles->get(index, leaf, h.center, h.radius);
+                material = c.particles->material(index);
+            }
+            e = make_id(PRIM_PARTICLE, c.first + index);
+            h.mat_id = c.mat_ids[material];
+            break;
+        }
+    }
+    h.t = t;
+    h.prim_id = e;
+    h.u = u;
+    h.v = v;
+    return true;
+}
+
+bool scene::intersect(const ray& r, double t_min, double t_max, prim_hit& h) const {
+    bool hit_anything = false;
+    double t, u, v;
+    h.t = t_max;
+    if (!accel.empty()) {
+        uint64_t tests[PRIM_TYPES] = {};
+        accel.walk(r, t_min, h.t, [&](const int* entries, int count) {
+            for (int k = 0; k < count; k++)
+                if (hit_entry(entries[k], r, t_min, h.t, false, h, tests))
+                    hit_anything = true;
+            return false;
+        });
+        thread_stats& st = local_stats();
+        for (int p = 0; p < PRIM_TYPES; p++)
+            st.add(STAT_TESTS + p, tests[p]);
+        return hit_anything;
+    }
+    for (size_t i = 0; i < spheres.size(); i++) {
+        const sphere_prim& s = spheres[i];
+        if (intersect_sphere(s.center, s.radius, r, t_min, h.t, t)) {
+            hit_anything = true;
+            h.t = t;
+            h.prim_id = make_id(PRIM_SPHERE, int(i));
+        }
+    }
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const triangle_prim& tr = triangles[i];
+        if (intersect_triangle(tr.p1, tr.p2, tr.p3, tr.normal, r, t_min, h.t, t, u, v)) {
+            hit_anything = true;
+            h.t = t;
+            h.prim_id = make_id(PRIM_TRIANGLE, int(i));
+            h.u = u;
+            h.v = v;
+        }
+    }
+    for (size_t i = 0; i < tori.size(); i++) {
+        const torus_prim& to = tori[i];
+        if (intersect_torus(to.R1, to.R2, r, t_min, h.t, t)) {
+            hit_anything = true;
+            h.t = t;
+            h.prim_id = make_id(PRIM_TORUS, int(i));
+        }
+    }
+    for (size_t i = 0; i < boxes.size(); i++) {
+        int face;
+        if (intersect_box(boxes[i].corner, boxes[i].to_local, r, t_min, h.t, t, face)) {
+            hit_anything = true;
+            h.t = t;
+            h.prim_id = make_id(PRIM_BOX, int(i));
+            h.u = face;
+        }
+    }
+    uint64_t tests[PRIM_TYPES] = {};
+    for (size_t p = 0; p < cloud_parts.size(); p++)
+        if (hit_entry(make_id(PRIM_PARTICLE, int(p)), r, t_min, h.t, false, h, tests))
+            hit_anything = true;
+    thread_stats& st = local_stats();
+    st.add(STAT_TESTS + PRIM_SPHERE, spheres.size());
+    st.add(STAT_TESTS + PRIM_TRIANGLE, triangles.size());
+    st.add(STAT_TESTS + PRIM_TORUS, tori.size());
+    st.add(STAT_TESTS + PRIM_BOX, boxes.size());
+    st.add(STAT_TESTS + PRIM_PARTICLE, tests[PRIM_PARTICLE]);
+    return hit_anything;
+}
+
+void scene::finalize(const ray& r, const prim_hit& h, hit_record& rec) const {
+    int i = id_index(h.prim_id);
+    switch (id_type(h.prim_id)) {
+        case PRIM_SPHERE:
+            sphere_attributes(spheres[i].center, spheres[i].radius, r, h.t, rec);
+            rec.mat_id = spheres[i].mat_id;
+            break;
+        case PRIM_TRIANGLE:
+            triangle_attributes(triangles[i].normal, r, h.t, rec);
+            triangle_texcoords(triangle_uvs[i].t1, triangle_uvs[i].t2, triangle_uvs[i].t3, triangle_uvs[i].scale, h.u, h.v, rec);
+            rec.mat_id = triangles[i].mat_id;
+            break;
+        case PRIM_TORUS:
+            torus_attributes(tori[i].R1, tori[i].R2, r, h.t, rec);
+            rec.mat_id = tori[i].mat_id;
+            break;
+        case PRIM_BOX:
+            box_attributes(boxes[i].corner, boxes[i].edge, boxes[i].to_local, r, h.t, int(h.u), rec);
+            rec.mat_id = boxes[i].mat_id;
+            break;
+        case PRIM_PARTICLE:
+            sphere_attributes(h.center, h.radius, r, h.t, rec);
+            rec.mat_id = h.mat_id;
+            break;
+    }
+}
+
+const material_params& scene::surface(const ray& r, const hit_record& rec, material_params& textured) const {
+    const material_params& m = materials[rec.mat_id];
+    if (m.texture < 0)
+        return m;
+    textured = m;
+    // the footprint stretches across a surface seen at a grazing angle
+    double facing = fabs(dot(unit_vector(rec.normal), unit_vector(r.direction())));
+    double width = r.width_at(rec.t) * rec.uv_scale / std::max(facing, 0.05);
+    textured.albedo *= texture_cache::global().lookup(m.texture, rec.u, rec.v, width);
+    return textured;
+}
+
+bool scene::occluded(const ray& r, double t_min, double t_max) const {
+    double t, u, v;
+    thread_stats& st = local_stats();
+    if (!accel.empty()) {
+        uint64_t tests[PRIM_TYPES] = {};
+        prim_hit h;
+        bool hit = accel.walk(r, t_min, t_max, [&](const int* entries, int count) {
+            for (int k = 0; k < count; k++)
+                if (hit_entry(entries[k], r, t_min, t_max, true, h, tests))
+                    return true;
+            return false;
+        });
+        for (int p = 0; p < PRIM_TYPES; p++)
+            st.add(STAT_TESTS + p, tests[p]);
+        return hit;
+    }
+    for (size_t i = 0; i < spheres.size(); i++) {
+        if (intersect_sphere(spheres[i].center, spheres[i].radius, r, t_min, t_max, t)) {
+            st.add(STAT_TESTS + PRIM_SPHERE, i + 1);
+            return true;
+        }
+    }
+    st.add(STAT_TESTS + PRIM_SPHERE, spheres.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        const triangle_prim& tr = triangles[i];
+        if (intersect_triangle(tr.p1, tr.p2, tr.p3, tr.normal, r, t_min, t_max, t, u, v)) {
+            st.add(STAT_TESTS + PRIM_TRIANGLE, i + 1);
+            return true;
+        }
+    }
+    st.add(STAT_TESTS + PRIM_TRIANGLE, triangles.size());
+    for (size_t i = 0; i < tori.size(); i++) {
+        if (intersect_torus(tori[i].R1, tori[i].R2, r, t_min, t_max, t)) {
+            st.add(STAT_TESTS + PRIM_TORUS, i + 1);
+            return true;
+        }
+    }
+    st.add(STAT_TESTS + PRIM_TORUS, tori.size());
+    for (size_t i = 0; i < boxes.size(); i++) {
+        int face;
+        if (intersect_box(boxes[i].corner, boxes[i].to_local, r, t_min, t_max, t, face)) {
+            st.add(STAT_TESTS + PRIM_BOX, i + 1);
+            return true;
+        }
+    }
+    st.add(STAT_TESTS + PRIM_BOX, boxes.size());
+    for (size_t p = 0; p < cloud_parts.size(); p++) {
+        uint64_t tests[PRIM_TYPES] = {};
+        prim_hit h;
+        bool hit = hit_entry(make_id(PRIM_PARTICLE, int(p)), r, t_min, t_max, true, h, tests);
+        st.add(STAT_TESTS + PRIM_PARTICLE, tests[PRIM_PARTICLE]);
+        if (hit)
+            return true;
+    }
+    return false;
+}
+
+int scene::emitter_material(int prim_id) const {
+    int i = id_index(prim_id);
+    switch (id_type(prim_id)) {
+        case PRIM_SPHERE: return spheres[i].mat_id;
+        case PRIM_TRIANGLE: return triangles[i].mat_id;
+        case PRIM_BOX: return boxes[i].mat_id;
+        default: return tori[i].mat_id;
+    }
+}
+
+double scene::emitter_area(int prim_id) const {
+    int i = id_index(prim_id);
+    if (id_type(prim_id) == PRIM_SPHERE)
+        return 4 * pi * spheres[i].radius * spheres[i].radius;
+    if (id_type(prim_id) == PRIM_BOX) {
+        const vec3* e = boxes[i].edge;
+        return 2 * (cross(e[1], e[2]).length() + cross(e[0], e[2]).length() + cross(e[0], e[1]).length());
+    }
+    const triangle_prim& tr = triangles[i];
+    return 0.5 * cross(tr.p2 - tr.p1, tr.p3 - tr.p1).length();
+}
+
+vec3 scene::emitter_normal(int prim_id, const vec3& q) const {
+    int i = id_index(prim_id);
+    if (id_type(prim_id) == PRIM_SPHERE)
+        return unit_vector(q - spheres[i].center);
+    if (id_type(prim_id) == PRIM_BOX) {
+        // the face q is on is the one its box coordinates are nearest to
+        const box_prim& b = boxes[i];
+        int face = 0;
+        double l[3];
+        for (int k = 0; k < 3; k++) {
+            l[k] = dot(b.to_local[k], q - b.corner);
+            if (fabs(l[k] - 0.5) > fabs(l[face] - 0.5))
+                face = k;
+        }
+        return unit_vector(l[face] > 0.5 ? b.to_local[face] : -b.to_local[face]);
+    }
+    return unit_vector(triangles[i].normal);
+}
+
+void scene::find_emitters() {
+    emitters.clear();
+    for (size_t i = 0; i < spheres.size(); i++)
+        if (materials[spheres[i].mat_id].flags & MAT_EMIT)
+            emitters.push_back(make_id(PRIM_SPHERE, int(i)));
+    for (size_t i = 0; i < triangles.size(); i++)
+        if (materials[triangles[i].mat_id].flags & MAT_EMIT)
+            emitters.push_back(make_id(PRIM_TRIANGLE, int(i)));
+    for (size_t i = 0; i < boxes.size(); i++)
+        if (materials[boxes[i].mat_id].flags & MAT_EMIT)
+            emitters.push_back(make_id(PRIM_BOX, int(i)));
+    // tori are not sampled; the path integrator still sees them when a bounce hits one
+    std::vector<double> power(emitters.size());
+    for (size_t e = 0; e < emitters.size(); e++)
+        power[e] = luminance(materials[emitter_material(emitters[e])].emission) * emitter_area(emitters[e]);
+    emitter_table.build(power);
+}
+
+vec3 scene::emitted(int prim_id, int mat_id, const vec3& q, const vec3& wo) const {
+    const material_params& m = materials[mat_id];
+    // spheres and boxes shine outwards only, triangles from both sides
+    if ((id_type(prim_id) == PRIM_SPHERE || id_type(prim_id) == PRIM_BOX) && dot(emitter_normal(prim_id, q), wo) <= 0)
+        return vec3(0,0,0);
+    return m.emission;
+}
+
+vec3 scene::emitter_point(int prim_id, double u, double v) const {
+    int i = id_index(prim_id);
+    if (id_type(prim_id) == PRIM_SPHERE)
+        return spheres[i].center + spheres[i].radius * map_to_sphere(u, v);
+    if (id_type(prim_id) == PRIM_BOX) {
+        // u picks a face by its area and is then stretched back over it
+        const box_prim& b = boxes[i];
+        double area[3];
+        double total = 0;
+        for (int k = 0; k < 3; k++) {
+            area[k] = cross(b.edge[(k + 1) % 3], b.edge[(k + 2) % 3]).length();
+            total += 2 * area[k];
+        }
+        double x = u * total;
+        for (int face = 0; face < 6; face++) {
+            int k = face % 3;
+            if (x < area[k] || face == 5) {
+                double s = area[k] > 0 ? std::min(1.0, x / area[k]) : 0.0;
+                vec3 base = face < 3 ? b.corner : b.corner + b.edge[k];
+                return base + s * b.edge[(k + 1) % 3] + v * b.edge[(k + 2) % 3];
+            }
+            x -= area[k];
+        }
+    }
+    // uniform over the triangle: fold the unit square onto it
+    if (u + v > 1) {
+        u = 1 - u;
+        v = 1 - v;
+    }
+    const triangle_prim& tr = triangles[i];
+    return tr.p1 + u * (tr.p2 - tr.p1) + v * (tr.p3 - tr.p1);
+}
+
+bool scene::sample_emitter(const vec3& p, sampler& smp, vec3& q, vec3& radiance, double& pdf) const {
+    if (emitters.empty())
+        return false;
+    double pick_pdf;
+    int prim_id = emitters[emitter_table.pick(smp.get_1d(), pick_pdf)];
+    double u, v;
+    smp.get_2d(u, v);
+    q = emitter_point(prim_id, u, v);
+    vec3 wo = p - q;
+    double dist2 = wo.squared_length();
+    double cos_q = fabs(dot(emitter_normal(prim_id, q), wo)) / sqrt(dist2);
+    radiance = emitted(prim_id, q, wo);
+    if (cos_q <= 0 || dist2 <= 0 || radiance.squared_length() == 0)
+        return false;
+    pdf = pick_pdf * dist2 / (cos_q * emitter_area(prim_id));
+    return true;
+}
+
+double scene::emitter_pdf(const vec3& p, int prim_id, const vec3& q) const {
+    if (emitters.empty() || !sampled_emitter_type(id_type(prim_id)))
+        return 0.0;
+    double power = luminance(materials[emitter_material(prim_id)].emission) * emitter_area(prim_id);
+    double pick_pdf = emitter_table.total_weight() > 0 ? power / emitter_table.total_weight() : 1.0 / emitters.size();
+    vec3 wo = p - q;
+    double dist2 = wo.squared_length();
+    double cos_q = fabs(dot(emitter_normal(prim_id, q), wo)) / sqrt(dist2);
+    return cos_q > 0 ? pick_pdf * dist2 / (cos_q * emitter_area(prim_id)) : 0.0;
+}
+
+// Front-end lowering
+
+void hittable_list::compile(scene& s) const {
+    for (int i = 0; i < list_size; i++)
+        list[i]->compile(s);
+    s.find_emitters();
+    s.build_bvh();
+}
+
+void sphere::compile(scene& s) const {
+    sphere_prim p = { center, radius, s.add_material(mat_ptr->params) };
+    s.spheres.push_back(p);
+}
+
+void triangle::compile(scene& s) const {
+    triangle_prim p = { p1, p2, p3, normal, s.add_material(mat_ptr->params) };
+    s.triangles.push_back(p);
+    triangle_uv uv = { t1, t2, t3, triangle_uv_scale(p1, p2, p3, t1, t2, t3) };
+    s.triangle_uvs.push_back(uv);
+}
+
+void torus::compile(scene& s) const {
+    torus_prim p = { R1, R2, s.add_material(mat_ptr->params) };
+    s.tori.push_back(p);
+}
+
+void particle_cloud::compile(scene& s) const {
+    cloud_prim c;
+    c.particles = particles;
+    c.chunks = chunks;
+    for (size_t m = 0; m < palette.size(); m++)
+        c.mat_ids.push_back(s.add_material(palette[m]->params));
+    c.first = s.clouds.empty() ? 0 : s.clouds.back().first + s.clouds.back().size();
+    for (int k = 0; k < (chunks ? chunks->chunk_count() : 1); k++) {
+        cloud_part part = { int(s.clouds.size()), chunks ? k : -1 };
+        s.cloud_parts.push_back(part);
+    }
+    s.clouds.push_back(c);
+}
+
+void cube::compile(scene& s) const {
+    box_prim p = { corner, { edge[0], edge[1], edge[2] }, { to_local[0], to_local[1], to_local[2] }, s.add_material(mat_ptr->params) };
+    s.boxes.push_back(p);
+}
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef SCENEFILEH
+#define SCENEFILEH
+
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "arena.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "cube.h"
+#include "torus.h"
+#include "particles.h"
+#include "chunks.h"
+#include "material.h"
+#include "lights.h"
+#include "scene.h"
+
+/*
+    Text scene descriptions, one statement per line; # starts a comment.
+
+        light point|directional x y z r g b
+        light spot x y z dx dy dz inner_degrees outer_degrees r g b
+        light sphere x y z radius r g b
+        integrator blinn|path
+        environment FILE.pfm [scale]
+        texture NAME FILE.tex
+        material NAME lambertian r g b [texture TEXTURE]
+        material NAME metal r g b fuzz [texture TEXTURE]
+        material NAME dielectric ior
+        material NAME blinn_lambertian r g b shininess [texture TEXTURE]
+        material NAME blinn_metal r g b fuzz shininess [texture TEXTURE]
+        material NAME blinn_dielectric ior shininess
+        material NAME emissive r g b
+        sphere x y z radius MATERIAL
+        triangle x1 y1 z1 x2 y2 z2 x3 y3 z3 MATERIAL [u1 v1 u2 v2 u3 v3]
+        cube x1 y1 z1 x2 y2 z2 x3 y3 z3 MATERIAL
+        box xmin ymin zmin xmax ymax zmax MATERIAL
+        torus x y z nx ny nz major minor MATERIAL
+        particles FILE MATERIAL [MATERIAL...] [quantize]
+
+    Every light line adds a light. A scene without any gets a white point
+    light at (0, 6, 0), unless it has an emissive material or an
+    environment map to light it. Spheres, triangles, cubes and boxes made
+    of an emissive material are area lights. The environment line replaces
+    the sky with a lat-long PFM image (see environment.h), its path taken
+    relative to the working directory. A box line is a cube whose edges
+    run along the axes.
+
+    A particles line loads a cloud of spheres from a binary file (see
+    particles.h); a particle with material index i is made of the i-th
+    material listed. With quantize its particles are kept at 16 bits.
+    Given a file made with --make-chunks, the cloud is streamed from it
+    instead of loaded (see chunks.h), and quantize does not apply.
+
+    A texture line opens a tiled texture made with --make-texture (see
+    texture.h); a material naming it has the texture multiplied into its
+    colour. Triangles without texture coordinates get (0, 0), (1, 0) and
+    (0, 1), and every face of a cube or box gets the whole texture.
+    The integrator line picks how the scene is shaded (see render.h);
+    blinn is the default. A material has to be declared before it is
+    used. "default" names the built-in scene instead of a file.
+*/
+
+const char* const default_scene_text =
+    "light point 0 6 0 1 1 1\n"
+    "material ground lambertian 0.8 0.8 0.0\n"
+    "material gold blinn_metal 0.8 0.6 0.2 0 20\n"
+    "material glass blinn_dielectric 1.5 20\n"
+    "material blue blinn_lambertian 0.2 0.2 0.8 20\n"
+    "material red blinn_lambertian 1 0 0 20\n"
+    "sphere 0 -101.5 -2 100 ground\n"
+    "sphere 2 -1 -1 0.5 gold\n"
+    "sphere -2 -1 -1 0.5 glass\n"
+    "sphere 0 -1 1 0.5 blue\n"
+    "cube -0.5 -0.5 -2 -0.5 -1.5 -2 0.5 -1.5 -2 red\n";
+
+// FNV-1a; identifies a scene by its text
+inline uint64_t content_hash(const std::string& bytes) {
+    uint64_t h = 1469598103934665603ull;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        h ^= uint8_t(bytes[i]);
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// the text of a built-in scene or a scene file
+inline bool scene_source(const std::string& name, std::string& text, std::string& error) {
+    if (name == "default") {
+        text = default_scene_text;
+        return true;
+    }
+    std::ifstream file(name.c_str(), std::ios::binary);
+    if (!file) {
+        error = "cannot read scene " + name;
+        return false;
+    }
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    text = contents.str();
+    return true;
+}
+
+// Builds the hittables of a scene description in a. world, l and
+// integrator are only set on success; error names the offending line
+// otherwise.
+inline bool parse_scene(const std::string& text, arena& a, hittable*& world, light_list& l, int& integrator, std::string& error) {
+    std::map<std::string, material*> materials;
+    std::map<std::string, int> textures;
+    std::vector<hittable*> objects;
+    light_list scene_lights;
+    int scene_integrator = INTEGRATOR_BLINN;
+    bool emissive_materials = false;
+    uint64_t particle_count = 0;
+    std::istringstream lines(text);
+    std::string line;
+    for (int number = 1; std::getline(lines, line); number++) {
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        std::istringstream in(line);
+        std::string kind;
+        if (!(in >> kind))
+            continue;
+
+        bool ok = true;
+        std::string mat_name;
+        material* m = 0;
+        if (kind == "light") {
+            std::string type;
+            vec3 v, colour, axis;
+            double radius = 1, inner = 0, outer = 0;
+            if (!(in >> type))
+                ok = false;
+            else if (type == "point" || type == "directional")
+                ok = bool(in >> v >> colour);
+            else if (type == "spot")
+                ok = (in >> v >> axis >> inner >> outer >> colour) && axis.length() > 0 && inner <= outer;
+            else if (type == "sphere")
+                ok = (in >> v >> radius >> colour) && radius >= 0;
+            else
+                ok = false;
+            if (ok) {
+                int t = type == "directional" ? LIGHT_DIRECTIONAL : type == "point" ? LIGHT_POINT
+                      : type == "spot" ? LIGHT_SPOT : LIGHT_SPHERE;
+                light lt = make_light(t, v, colour, radius);
+                if (t == LIGHT_SPOT) {
+                    lt.spotDirection = unit_vector(axis);
+                    lt.cosInner = cos(inner * pi / 180);
+                    lt.cosOuter = cos(outer * pi / 180);
+                }
+                scene_lights.add(lt);
+            }
+        } else if (kind == "material") {
+            std::string name, type;
+            vec3 albedo;
+            double fuzz = 0, ior = 0, shininess = 0;
+            in >> name >> type;
+            if (type == "lambertian" && (in >> albedo))
+                m = a.make<lambertian>(albedo);
+            else if (type == "metal" && (in >> albedo >> fuzz))
+                m = a.make<metal>(albedo, fuzz);
+            else if (type == "dielectric" && (in >> ior))
+                m = a.make<dielectric>(ior);
+            else if (type == "blinn_lambertian" && (in >> albedo >> shininess))
+                m = a.make<blinn_lambertian>(albedo, shininess);
+            else if (type == "blinn_metal" && (in >> albedo >> fuzz >> shininess))
+                m = a.make<blinn_metal>(albedo, fuzz, shininess);
+            else if (type == "blinn_dielectric" && (in >> ior >> shininess))
+                m = a.make<blinn_dielectric>(ior, shininess);
+            else if (type == "emissive" && (in >> albedo))
+                m = a.make<emissive>(albedo);
+            emissive_materials |= type == "emissive";
+            ok = m != 0;
+            std::string word, texture;
+            if (ok && (in >> word)) {
+                ok = word == "texture" && (in >> texture) && textures.count(texture) && !(m->params.flags & (MAT_REFRACT | MAT_EMIT));
+                if (ok)
+                    m->params.texture = textures[texture];
+            }
+            if (ok)
+                materials[name] = m;
+        } else if (kind == "sphere") {
+            vec3 c;
+            double r;
+            ok = bool(in >> c >> r >> mat_name) && (m = materials[mat_name]);
+            if (ok)
+                objects.push_back(a.make<sphere>(c, r, m));
+        } else if (kind == "triangle" || kind == "cube") {
+            vec3 p1, p2, p3;
+            ok = bool(in >> p1 >> p2 >> p3 >> mat_name) && (m = materials[mat_name]);
+            if (ok && kind == "triangle") {
+                triangle* t = a.make<triangle>(p1, p2, p3, m);
+                double uv[6];
+                if (in >> uv[0]) {
+                    ok = bool(in >> uv[1] >> uv[2] >> uv[3] >> uv[4] >> uv[5]);
+                    t->t1 = vec3(uv[0], uv[1], 0);
+                    t->t2 = vec3(uv[2], uv[3], 0);
+                    t->t3 = vec3(uv[4], uv[5], 0);
+                }
+                objects.push_back(t);
+            } else if (ok)
+                objects.push_back(a.make<cube>(p1, p2, p3, m));
+        } else if (kind == "box") {
+            vec3 lo, hi;
+            ok = bool(in >> lo >> hi >> mat_name) && (m = materials[mat_name]);
+            if (ok)
+                objects.push_back(a.make<cube>(lo, hi, m));
+        } else if (kind == "torus") {
+            vec3 c, n;
+            double major, minor;
+            ok = bool(in >> c >> n >> major >> minor >> mat_name) && (m = materials[mat_name]);
+            if (ok)
+                objects.push_back(a.make<torus>(c, n, major, minor, m));
+        } else if (kind == "particles") {
+            std::string path, word;
+            std::vector<material*> palette;
+            bool quantize = false;
+            ok = bool(in >> path);
+            while (ok && in >> word) {
+                if (word == "quantize")
+                    quantize = true;
+                else if (!quantize && materials[word])
+                    palette.push_back(materials[word]);
+                else
+                    ok = false;
+            }
+            ok = ok && !palette.empty();
+            if (ok && is_chunk_file(path)) {
+                std::shared_ptr<chunked_particles> chunks(new chunked_particles);
+                if (!chunks->open(path, int(palette.size()), error))
+                    return false;
+                particle_count += chunks->size();
+                ok = !quantize && particle_count <= particle_max_count;
+                if (ok)
+                    objects.push_back(a.make<particle_cloud>(chunks, palette));
+            } else if (ok) {
+                std::shared_ptr<particle_set> cloud(new particle_set);
+                if (!cloud->load(path, int(palette.size()), error))
+                    return false;
+                particle_count += cloud->size();
+                if (particle_count > particle_max_count) {
+                    error = "too many particles in the scene";
+                    return false;
+                }
+                cloud->build(quantize);
+                objects.push_back(a.make<particle_cloud>(cloud, palette));
+            }
+        } else if (kind == "integrator") {
+            std::string type;
+            ok = (in >> type) && (type == "blinn" || type == "path");
+            scene_integrator = type == "path" ? INTEGRATOR_PATH : INTEGRATOR_BLINN;
+        } else if (kind == "texture") {
+            std::string name, path;
+            ok = bool(in >> name >> path);
+            if (ok) {
+                int id = texture_cache::global().open(path, error);
+                if (id < 0)
+                    return false;
+                textures[name] = id;
+            }
+        } else if (kind == "environment") {
+            std::string path;
+            double scale = 1;
+            ok = bool(in >> path);
+            if (ok && !(in >> scale))
+                scale = 1;
+            if (ok && scale >= 0) {
+                std::shared_ptr<environment_map> env(new environment_map);
+                if (!env->load(path, scale, error))
+                    return false;
+                scene_lights.environment = env;
+            } else {
+                ok = false;
+            }
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            std::ostringstream msg;
+            msg << "scene line " << number << ": cannot read '" << line << "'";
+            error = msg.str();
+            return false;
+        }
+    }
+
+    hittable** list = a.make_array<hittable*>(objects.size());
+    for (size_t i = 0; i < objects.size(); i++)
+        list[i] = objects[i];
+    world = a.make<hittable_list>(list, int(objects.size()));
+    if (scene_lights.size() == 0 && !emissive_materials && !scene_lights.environment)
+        scene_lights.add(make_light(LIGHT_POINT, vec3(0,6,0), vec3(1,1,1)));
+    scene_lights.build();
+    l = scene_lights;
+    integrator = scene_integrator;
+    return true;
+}
+
+#endif
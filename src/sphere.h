@@ -8,6 +8,7 @@ class sphere: public hittable {
         sphere() {}
         sphere(vec3 cen, double r, material* m) : center(cen), radius(r), mat_ptr(m) {}
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void compile(scene& s) const;
         
     public:
         vec3 center;
@@ -15,31 +16,47 @@ class sphere: public hittable {
         material *mat_ptr;
 };
 
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Only finds t; the rest of the hit is filled in by sphere_attributes
+// once the closest hit is known.
+inline bool intersect_sphere(const vec3& center, double radius, const ray& r, double t_min, double t_max, double& t) {
     vec3 oc = r.origin() - center;
     double a = r.direction().squared_length();
     double b = dot(oc, r.direction());
     double c = oc.squared_length() - radius*radius;
     double discriminant = b*b - a*c;
     if (discriminant > 0) {
-        double temp = (-b - sqrt(discriminant)) / a;
+        double root = sqrt(discriminant);
+        double temp = (-b - root) / a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = unit_vector((rec.p - center) / radius);
-            rec.mat_ptr = mat_ptr;
+            t = temp;
             return true;
         }
-        temp = (-b + sqrt(discriminant)) / a;
+        temp = (-b + root) / a;
         if (temp < t_max && temp > t_min) {
-            rec.t = temp;
-            rec.p = r.point_at_parameter(rec.t);
-            rec.normal = unit_vector((rec.p - center) / radius);
-            rec.mat_ptr = mat_ptr;
+            t = temp;
             return true;
         }
     }
     return false;
 }
 
+inline void sphere_attributes(const vec3& center, double radius, const ray& r, double t, hit_record& rec) {
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    rec.normal = unit_vector((rec.p - center) / radius);
+    // latitude and longitude, v = 0 at the bottom and u = 0 facing -x
+    rec.u = 0.5 + atan2(-rec.normal.z(), rec.normal.x()) / (2 * pi);
+    rec.v = acos(std::max(-1.0, std::min(1.0, -rec.normal.y()))) / pi;
+    rec.uv_scale = 1 / (pi * radius * sqrt(2.0));
+}
+
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t;
+    if (!intersect_sphere(center, radius, r, t_min, t_max, t))
+        return false;
+    sphere_attributes(center, radius, r, t, rec);
+    rec.mat_ptr = mat_ptr;
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,338 @@
+#ifndef STATSH
+#define STATSH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
+
+/*
+    Render statistics. Every thread counts into its own block, found
+    through a thread_local pointer, so counting is a plain add. Each
+    counter has a single writer; it is a relaxed atomic only so a reporter
+    may read it while it changes. snapshot() sums the blocks, and the
+    render path never takes a lock.
+*/
+
+// intersection tests are counted per prim_type (scene.h)
+const int stats_prim_types = 5;
+// path lengths in bounces; the last bin also holds longer paths
+const int stats_depth_bins = 16;
+
+enum stat_counter {
+    STAT_CAMERA_RAYS,
+    STAT_BOUNCE_RAYS,
+    STAT_SHADOW_RAYS,
+    STAT_NODE_VISITS,
+    // texture tile lookups found in the cache and read from disk
+    STAT_TEXTURE_HITS,
+    STAT_TEXTURE_MISSES,
+    // irradiance cache lookups, and the records computed when one failed
+    STAT_IRRADIANCE_LOOKUPS,
+    STAT_IRRADIANCE_RECORDS,
+    // diffuse bounces sampled from the path guide
+    STAT_GUIDED_BOUNCES,
+    // caustic estimates taken from the photon map
+    STAT_PHOTON_GATHERS,
+    // streamed geometry chunks found mapped, mapped from disk, and that
+    // could not be mapped
+    STAT_CHUNK_HITS,
+    STAT_CHUNK_MISSES,
+    STAT_CHUNK_FAILURES,
+    STAT_TESTS,
+    STAT_PATH_DEPTH = STAT_TESTS + stats_prim_types,
+    STAT_COUNT = STAT_PATH_DEPTH + stats_depth_bins
+};
+
+struct stats_snapshot {
+    uint64_t v[STAT_COUNT];
+    stats_snapshot() {
+        for (int i = 0; i < STAT_COUNT; i++)
+            v[i] = 0;
+    }
+    void add(const stats_snapshot& o) {
+        for (int i = 0; i < STAT_COUNT; i++)
+            v[i] += o.v[i];
+    }
+    stats_snapshot minus(const stats_snapshot& o) const {
+        stats_snapshot d;
+        for (int i = 0; i < STAT_COUNT; i++)
+            d.v[i] = v[i] - o.v[i];
+        return d;
+    }
+    uint64_t rays() const { return v[STAT_CAMERA_RAYS] + v[STAT_BOUNCE_RAYS] + v[STAT_SHADOW_RAYS]; }
+};
+
+struct thread_stats {
+    std::atomic<uint64_t> v[STAT_COUNT];
+    // keeps the next thread's block off this one's cache lines
+    char pad[64];
+
+    thread_stats() {
+        for (int i = 0; i < STAT_COUNT; i++)
+            v[i].store(0, std::memory_order_relaxed);
+    }
+    void add(int c, uint64_t n) {
+        v[c].store(v[c].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    stats_snapshot read() const {
+        stats_snapshot s;
+        for (int i = 0; i < STAT_COUNT; i++)
+            s.v[i] = v[i].load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+class stats_registry {
+    public:
+        static stats_registry& global() {
+            static stats_registry r;
+            return r;
+        }
+
+        thread_stats* register_thread() {
+            std::lock_guard<std::mutex> guard(lock);
+            blocks.push_back(std::unique_ptr<thread_stats>(new thread_stats));
+            return blocks.back().get();
+        }
+        // a thread that exits leaves its counts in remote and its block is freed
+        void release(thread_stats* b) {
+            std::lock_guard<std::mutex> guard(lock);
+            remote.add(b->read());
+            for (size_t i = 0; i < blocks.size(); i++)
+                if (blocks[i].get() == b) {
+                    blocks.erase(blocks.begin() + i);
+                    break;
+                }
+        }
+        // counts made elsewhere, e.g. by worker processes
+        void add_remote(const stats_snapshot& s) {
+            std::lock_guard<std::mutex> guard(lock);
+            remote.add(s);
+        }
+        stats_snapshot snapshot() {
+            std::lock_guard<std::mutex> guard(lock);
+            stats_snapshot s = remote;
+            for (size_t b = 0; b < blocks.size(); b++)
+                for (int i = 0; i < STAT_COUNT; i++)
+                    s.v[i] += blocks[b]->v[i].load(std::memory_order_relaxed);
+            return s;
+        }
+
+        // progress of the current pass, for the ETA
+        void set_progress(int done, int total) {
+            work_done = done;
+            work_total = total;
+        }
+        double progress() const {
+            int total = work_total;
+            return total > 0 ? double(work_done) / total : 0.0;
+        }
+
+    private:
+        stats_registry() : work_done(0), work_total(0) {
+#if defined(__unix__) || defined(__APPLE__)
+            // a fork must not happen while the reporter holds the lock, or
+            // the child would find it locked forever
+            pthread_atfork(lock_for_fork, unlock_after_fork, unlock_after_fork);
+#endif
+        }
+        static void lock_for_fork() { global().lock.lock(); }
+        static void unlock_after_fork() { global().lock.unlock(); }
+
+    private:
+        // the lock only guards the list; blocks are read without it
+        std::mutex lock;
+        std::vector<std::unique_ptr<thread_stats> > blocks;
+        stats_snapshot remote;
+        std::atomic<int> work_done, work_total;
+};
+
+// the calling thread's block, registered when the thread first counts and
+// released when it exits, so short-lived threads (daemon connections) do
+// not pile up in the registry
+class local_stats_holder {
+    public:
+        local_stats_holder() : block(0), listed(false) {}
+        ~local_stats_holder() {
+            if (listed)
+                stats_registry::global().release(block);
+            else
+                delete block;
+        }
+        local_stats_holder(const local_stats_holder&) = delete;
+        local_stats_holder& operator=(const local_stats_holder&) = delete;
+
+        thread_stats* block;
+        // false for a block the registry does not know about
+        bool listed;
+};
+
+inline local_stats_holder& local_stats_slot() {
+    thread_local local_stats_holder h;
+    return h;
+}
+
+inline thread_stats& local_stats() {
+    local_stats_holder& h = local_stats_slot();
+    if (!h.block) {
+        h.block = stats_registry::global().register_thread();
+        h.listed = true;
+    }
+    return *h.block;
+}
+
+// gives the calling thread a fresh block that the registry does not list,
+// for a forked worker process: it reads its own block and never takes the
+// registry lock
+inline thread_stats& unlisted_local_stats() {
+    local_stats_holder& h = local_stats_slot();
+    h.block = new thread_stats;
+    h.listed = false;
+    return *h.block;
+}
+
+inline void count_stat(int c, uint64_t n = 1) {
+    local_stats().add(c, n);
+}
+
+// intersection tests made by this thread so far, over all primitive types
+inline uint64_t local_tests() {
+    thread_stats& s = local_stats();
+    uint64_t n = 0;
+    for (int p = 0; p < stats_prim_types; p++)
+        n += s.v[STAT_TESTS + p].load(std::memory_order_relaxed);
+    return n;
+}
+
+/*
+    Reports the counters every interval seconds: a one-line summary on
+    stderr, a JSON file rewritten in place, or both. stop() writes the
+    final report.
+*/
+class stats_reporter {
+    public:
+        stats_reporter(double interval, bool to_stderr, const std::string& json_path);
+        ~stats_reporter() { stop(); }
+        void start();
+        void stop();
+
+    private:
+        void run();
+        void report(bool final);
+        std::string json(const stats_snapshot& s, double elapsed, double eta) const;
+
+    private:
+        double interval;
+        bool to_stderr;
+        std::string json_path;
+        std::chrono::steady_clock::time_point started;
+        stats_snapshot last;
+        std::chrono::steady_clock::time_point last_time;
+        std::thread thread;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stopping;
+};
+
+inline stats_reporter::stats_reporter(double every, bool err, const std::string& path)
+: interval(every), to_stderr(err), json_path(path), stopping(false) {}
+
+inline void stats_reporter::start() {
+    started = last_time = std::chrono::steady_clock::now();
+    last = stats_registry::global().snapshot();
+    thread = std::thread(&stats_reporter::run, this);
+}
+
+inline void stats_reporter::stop() {
+    if (!thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+    report(true);
+}
+
+inline void stats_reporter::run() {
+    std::unique_lock<std::mutex> guard(lock);
+    while (!wake.wait_for(guard, std::chrono::duration<double>(interval), [&] { return stopping; }))
+        report(false);
+}
+
+inline void stats_reporter::report(bool final) {
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    stats_snapshot s = stats_registry::global().snapshot();
+    double elapsed = std::chrono::duration<double>(now - started).count();
+    double since = std::chrono::duration<double>(now - last_time).count();
+    double recent = since > 0 ? (s.rays() - last.rays()) / since : 0.0;
+    double done = stats_registry::global().progress();
+    double eta = (done > 0 && done < 1) ? elapsed * (1 - done) / done : 0.0;
+    last = s;
+    last_time = now;
+
+    if (to_stderr) {
+        char line[160];
+        if (final)
+            std::snprintf(line, sizeof(line), "\rStats: %.2f s, %.3g rays (%.3g camera, %.3g bounce, %.3g shadow), %.3g Mrays/s\n",
+                          elapsed, double(s.rays()), double(s.v[STAT_CAMERA_RAYS]), double(s.v[STAT_BOUNCE_RAYS]),
+                          double(s.v[STAT_SHADOW_RAYS]), s.rays() / elapsed / 1e6);
+        else
+            std::snprintf(line, sizeof(line), "\r%.1f s  %3.0f%%  %.3g Mrays/s  ETA %.1f s   ",
+                          elapsed, done * 100, recent / 1e6, eta);
+        std::cerr << line << std::flush;
+    }
+    if (!json_path.empty()) {
+        std::string partial = json_path + ".partial";
+        {
+            std::ofstream out(partial.c_str());
+            out << json(s, elapsed, final ? 0.0 : eta);
+        }
+        std::rename(partial.c_str(), json_path.c_str());
+    }
+}
+
+inline std::string stats_reporter::json(const stats_snapshot& s, double elapsed, double eta) const {
+    static const char* prim_names[stats_prim_types] = { "sphere", "triangle", "torus", "box", "particle" };
+    std::ostringstream out;
+    out << "{\n"
+        << "  \"elapsed_s\": " << elapsed << ",\n"
+        << "  \"progress\": " << stats_registry::global().progress() << ",\n"
+        << "  \"eta_s\": " << eta << ",\n"
+        << "  \"rays\": { \"camera\": " << s.v[STAT_CAMERA_RAYS] << ", \"bounce\": " << s.v[STAT_BOUNCE_RAYS]
+        << ", \"shadow\": " << s.v[STAT_SHADOW_RAYS] << ", \"total\": " << s.rays() << " },\n"
+        << "  \"rays_per_s\": " << (elapsed > 0 ? s.rays() / elapsed : 0.0) << ",\n"
+        << "  \"intersection_tests\": {";
+    for (int p = 0; p < stats_prim_types; p++)
+        out << (p ? ", " : " ") << '"' << prim_names[p] << "\": " << s.v[STAT_TESTS + p];
+    out << " },\n"
+        << "  \"node_visits\": " << s.v[STAT_NODE_VISITS] << ",\n"
+        << "  \"texture_tiles\": { \"hits\": " << s.v[STAT_TEXTURE_HITS] << ", \"misses\": " << s.v[STAT_TEXTURE_MISSES] << " },\n"
+        << "  \"irradiance_cache\": { \"lookups\": " << s.v[STAT_IRRADIANCE_LOOKUPS] << ", \"records\": " << s.v[STAT_IRRADIANCE_RECORDS] << " },\n"
+        << "  \"guided_bounces\": " << s.v[STAT_GUIDED_BOUNCES] << ",\n"
+        << "  \"photon_gathers\": " << s.v[STAT_PHOTON_GATHERS] << ",\n"
+        << "  \"geometry_chunks\": { \"hits\": " << s.v[STAT_CHUNK_HITS] << ", \"misses\": " << s.v[STAT_CHUNK_MISSES]
+        << ", \"failures\": " << s.v[STAT_CHUNK_FAILURES] << " },\n"
+        << "  \"path_depth\": [";
+    for (int d = 0; d < stats_depth_bins; d++)
+        out << (d ? ", " : "") << s.v[STAT_PATH_DEPTH + d];
+    out << "]\n}\n";
+    return out.str();
+}
+
+#endif
@@ -0,0 +1,385 @@
+#ifndef TEXTUREH
+#define TEXTUREH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "vec3.h"
+#include "environment.h"
+#include "framebuffer.h"
+#include "stats.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#define TEXTURE_PREAD 1
+#endif
+
+/*
+    Image textures. --make-texture converts an image once into a tiled
+    file: the image and all its mip levels, each cut into 32x32 texel
+    tiles stored one after another. Rendering reads tiles from that file
+    only when a lookup needs them, into one cache shared by every thread
+    and every texture. The cache has a fixed size and drops the least
+    recently used tiles once it is full, so a scene may use more texture
+    than fits in memory; only the tiles its rays touch are read.
+
+    A lookup picks its level from the ray's footprint (the ray cone, see
+    ray.h): a far or grazing surface reads a small level, which touches
+    few tiles and does not shimmer. Lookups are bilinear within a level
+    and blend the two nearest levels.
+
+    The file is a 32-byte header ("RTTEX1", width, height, levels and
+    tile size as little-endian 32-bit integers) followed by the tiles,
+    level 0 first, each level's tiles in rows. A tile holds RGB floats,
+    little-endian, and the tiles at the right and bottom edges are
+    padded to full size.
+*/
+
+const int texture_tile = 32;
+const size_t texture_tile_floats = size_t(texture_tile) * texture_tile * 3;
+const int texture_header_bytes = 32;
+
+// Reads a PFM, or a P3 or P6 PPM with gamma 2 undone the way write_ppm
+// applies it, into rgb, top row first. False with error otherwise.
+inline bool load_image(const std::string& path, int& width, int& height, std::vector<float>& rgb, std::string& error) {
+    std::ifstream in(path.c_str(), std::ios::binary);
+    std::string magic;
+    if (!(in >> magic)) {
+        error = "cannot read image " + path;
+        return false;
+    }
+    if (magic == "PF" || magic == "Pf")
+        return load_pfm(path, width, height, rgb, error);
+    int maxval;
+    if ((magic != "P3" && magic != "P6") || !(in >> width >> height >> maxval) || width < 1 || height < 1 || maxval < 1 || maxval > 255) {
+        error = "cannot read image " + path + " (PFM, or PPM with 8-bit values)";
+        return false;
+    }
+    in.get();
+    size_t n = size_t(width) * height * 3;
+    rgb.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        int value;
+        if (magic == "P6")
+            value = in.get();
+        else if (!(in >> value))
+            value = -1;
+        if (value < 0) {
+            error = "truncated image " + path;
+            return false;
+        }
+        double c = double(value) / maxval;
+        rgb[i] = float(c * c);
+    }
+    return true;
+}
+
+// Writes the image at in_path as a tiled, mip-mapped texture to out_path.
+inline bool make_texture(const std::string& in_path, const std::string& out_path, std::string& error) {
+    int w, h;
+    std::vector<float> level;
+    if (!load_image(in_path, w, h, level, error))
+        return false;
+    int levels = 1;
+    while ((w >> (levels - 1)) > 1 || (h >> (levels - 1)) > 1)
+        levels++;
+
+    std::ofstream out(out_path.c_str(), std::ios::binary);
+    std::string header("RTTEX1\0\0", 8);
+    put_u32(header, uint32_t(w));
+    put_u32(header, uint32_t(h));
+    put_u32(header, uint32_t(levels));
+    put_u32(header, uint32_t(texture_tile));
+    header.resize(texture_header_bytes, '\0');
+    out.write(header.data(), header.size());
+
+    std::string bytes;
+    for (int lv = 0; lv < levels; lv++) {
+        int lw = std::max(1, w >> lv), lh = std::max(1, h >> lv);
+        if (lv > 0) {
+            // box filter of the level above; where it has an odd number of
+            // columns or rows, the last texel of the new level takes in
+            // three of them instead of two
+            int pw = std::max(1, w >> (lv - 1)), ph = std::max(1, h >> (lv - 1));
+            std::vector<float> next(size_t(lw) * lh * 3);
+            for (int y = 0; y < lh; y++)
+                for (int x = 0; x < lw; x++) {
+                    int x1 = x == lw - 1 ? pw : 2 * x + 2, y1 = y == lh - 1 ? ph : 2 * y + 2;
+                    for (int c = 0; c < 3; c++) {
+                        float sum = 0;
+                        for (int sy = 2 * y; sy < y1; sy++)
+                            for (int sx = 2 * x; sx < x1; sx++)
+                                sum += level[(size_t(sy) * pw + sx) * 3 + c];
+                        next[(size_t(y) * lw + x) * 3 + c] = sum / float((x1 - 2 * x) * (y1 - 2 * y));
+                    }
+                }
+            level.swap(next);
+        }
+        for (int ty = 0; ty < lh; ty += texture_tile) {
+            for (int tx = 0; tx < lw; tx += texture_tile) {
+                bytes.clear();
+                for (int y = ty; y < ty + texture_tile; y++)
+                    for (int x = tx; x < tx + texture_tile; x++)
+                        for (int c = 0; c < 3; c++)
+                            put_f32(bytes, (x < lw && y < lh) ? level[(size_t(y) * lw + x) * 3 + c] : 0.0f);
+                out.write(bytes.data(), bytes.size());
+            }
+        }
+    }
+    if (!out.flush()) {
+        error = "cannot write texture " + out_path;
+        return false;
+    }
+    return true;
+}
+
+class texture_cache {
+    public:
+        static texture_cache& global() {
+            static texture_cache c;
+            return c;
+        }
+        ~texture_cache();
+
+        // the most tile data kept in memory; older tiles go first
+        void set_capacity(size_t bytes);
+        // Opens the tiled texture at path and returns its id. A path opened
+        // before gets the same id. -1 with error if it is not a texture.
+        int open(const std::string& path, std::string& error);
+
+        // Colour of texture id at (u, v), repeating outside [0, 1). width
+        // is the footprint across, in the same units as u and v.
+        vec3 lookup(int id, double u, double v, double width);
+        size_t bytes_resident();
+
+    private:
+        typedef std::shared_ptr<const std::vector<float> > tile_ptr;
+        typedef std::unordered_map<uint64_t, std::pair<tile_ptr, std::list<uint64_t>::iterator> > tile_map;
+
+        struct texture_file {
+            std::string path;
+            int width, height, levels;
+            // index of each level's first tile, and its tiles per row
+            std::vector<size_t> first_tile;
+            std::vector<int> tiles_x;
+#ifdef TEXTURE_PREAD
+            int fd;
+#else
+            std::mutex lock;
+            std::ifstream in;
+#endif
+        };
+
+        // one part of the cache with its own lock, so threads rarely wait
+        struct shard {
+            std::mutex lock;
+            // most recent at the front
+            std::list<uint64_t> order;
+            tile_map tiles;
+            size_t bytes;
+            shard() : bytes(0) {}
+        };
+        static const int shard_count = 16;
+        static const int max_textures = 4096;
+
+        texture_cache() : capacity(size_t(64) << 20), file_count(0) {}
+        // the tile, read from the file if it is not resident
+        tile_ptr fetch(int id, int level, int tx, int ty);
+        bool read_tile(texture_file& f, int level, int tx, int ty, std::vector<float>& texels);
+        vec3 bilinear(int id, int level, double u, double v);
+
+    private:
+        size_t capacity;
+        // a slot is filled once, before its id is handed out, so lookups
+        // read it without the lock
+        std::mutex files_lock;
+        std::unique_ptr<texture_file> files[max_textures];
+        int file_count;
+        std::map<std::string, int> ids;
+        shard shards[shard_count];
+};
+
+inline texture_cache::~texture_cache() {
+#ifdef TEXTURE_PREAD
+    for (int i = 0; i < file_count; i++)
+        close(files[i]->fd);
+#endif
+}
+
+inline void texture_cache::set_capacity(size_t bytes) {
+    capacity = bytes;
+}
+
+inline int texture_cache::open(const std::string& path, std::string& error) {
+    std::lock_guard<std::mutex> guard(files_lock);
+    std::map<std::string, int>::iterator it = ids.find(path);
+    if (it != ids.end())
+        return it->second;
+    if (file_count == max_textures) {
+        error = "too many textures";
+        return -1;
+    }
+
+    std::unique_ptr<texture_file> f(new texture_file);
+    f->path = path;
+    unsigned char header[texture_header_bytes];
+    bool ok;
+#ifdef TEXTURE_PREAD
+    f->fd = ::open(path.c_str(), O_RDONLY);
+    ok = f->fd >= 0 && pread(f->fd, header, sizeof(header), 0) == ssize_t(sizeof(header));
+#else
+    f->in.open(path.c_str(), std::ios::binary);
+    ok = bool(f->in.read(reinterpret_cast<char*>(header), sizeof(header)));
+#endif
+    uint32_t fields[4] = { 0, 0, 0, 0 };
+    for (int k = 0; k < 4; k++)
+        for (int b = 0; b < 4; b++)
+            fields[k] |= uint32_t(header[8 + 4 * k + b]) << (8 * b);
+    if (!ok || std::memcmp(header, "RTTEX1", 6) != 0 || fields[3] != uint32_t(texture_tile) || fields[0] < 1 || fields[1] < 1
+        || fields[2] < 1 || fields[2] > 32) {
+#ifdef TEXTURE_PREAD
+        if (f->fd >= 0)
+            close(f->fd);
+#endif
+        error = "cannot read texture " + path + " (make one with --make-texture)";
+        return -1;
+    }
+    f->width = int(fields[0]);
+    f->height = int(fields[1]);
+    f->levels = int(fields[2]);
+    size_t tiles = 0;
+    for (int lv = 0; lv < f->levels; lv++) {
+        int tx = (std::max(1, f->width >> lv) + texture_tile - 1) / texture_tile;
+        int ty = (std::max(1, f->height >> lv) + texture_tile - 1) / texture_tile;
+        f->first_tile.push_back(tiles);
+        f->tiles_x.push_back(tx);
+        tiles += size_t(tx) * ty;
+    }
+    int id = file_count++;
+    files[id] = std::move(f);
+    ids[path] = id;
+    return id;
+}
+
+inline bool texture_cache::read_tile(texture_file& f, int level, int tx, int ty, std::vector<float>& texels) {
+    size_t index = f.first_tile[level] + size_t(ty) * f.tiles_x[level] + tx;
+    std::vector<unsigned char> bytes(texture_tile_floats * 4);
+    uint64_t offset = texture_header_bytes + index * bytes.size();
+    bool ok;
+#ifdef TEXTURE_PREAD
+    ok = pread(f.fd, bytes.data(), bytes.size(), off_t(offset)) == ssize_t(bytes.size());
+#else
+    {
+        std::lock_guard<std::mutex> guard(f.lock);
+        f.in.clear();
+        ok = f.in.seekg(std::streamoff(offset)) && f.in.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+    }
+#endif
+    texels.resize(texture_tile_floats);
+    for (size_t i = 0; i < texels.size(); i++) {
+        uint32_t v = 0;
+        for (int b = 0; b < 4; b++)
+            v |= uint32_t(bytes[4 * i + b]) << (8 * b);
+        std::memcpy(&texels[i], &v, 4);
+    }
+    return ok;
+}
+
+inline texture_cache::tile_ptr texture_cache::fetch(int id, int level, int tx, int ty) {
+    uint64_t key = (uint64_t(id) << 48) | (uint64_t(level) << 40) | (uint64_t(ty) << 20) | uint64_t(tx);
+    shard& s = shards[(key ^ (key >> 20) ^ (key >> 40)) % shard_count];
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        tile_map::iterator it = s.tiles.find(key);
+        if (it != s.tiles.end()) {
+            s.order.splice(s.order.begin(), s.order, it->second.second);
+            count_stat(STAT_TEXTURE_HITS);
+            return it->second.first;
+        }
+    }
+
+    // read outside the lock; two threads missing on the same tile both
+    // read it and the second one's copy is dropped
+    count_stat(STAT_TEXTURE_MISSES);
+    std::shared_ptr<std::vector<float> > texels(new std::vector<float>);
+    if (!read_tile(*files[id], level, tx, ty, *texels))
+        std::fill(texels->begin(), texels->end(), 0.0f);
+
+    size_t tile_bytes = texture_tile_floats * sizeof(float);
+    std::lock_guard<std::mutex> guard(s.lock);
+    tile_map::iterator it = s.tiles.find(key);
+    if (it != s.tiles.end())
+        return it->second.first;
+    s.order.push_front(key);
+    s.tiles[key] = std::make_pair(tile_ptr(texels), s.order.begin());
+    s.bytes += tile_bytes;
+    // a tile in use elsewhere stays alive through its shared_ptr
+    while (s.bytes > capacity / shard_count && s.order.size() > 1) {
+        s.tiles.erase(s.order.back());
+        s.order.pop_back();
+        s.bytes -= tile_bytes;
+    }
+    return texels;
+}
+
+inline vec3 texture_cache::bilinear(int id, int level, double u, double v) {
+    const texture_file& f = *files[id];
+    int w = std::max(1, f.width >> level), h = std::max(1, f.height >> level);
+    // texel centres sit at half-integers; v = 0 is the bottom of the image
+    double x = (u - floor(u)) * w - 0.5;
+    double y = (1 - (v - floor(v))) * h - 0.5;
+    int x0 = int(floor(x)), y0 = int(floor(y));
+    double fx = x - x0, fy = y - y0;
+    vec3 sum(0,0,0);
+    tile_ptr last;
+    int last_tx = -1, last_ty = -1;
+    for (int k = 0; k < 4; k++) {
+        int xi = x0 + (k & 1), yi = y0 + (k >> 1);
+        xi = ((xi % w) + w) % w;
+        yi = ((yi % h) + h) % h;
+        int tx = xi / texture_tile, ty = yi / texture_tile;
+        // the four texels are usually in one tile
+        if (tx != last_tx || ty != last_ty) {
+            last = fetch(id, level, tx, ty);
+            last_tx = tx;
+            last_ty = ty;
+        }
+        const float* t = &(*last)[((yi % texture_tile) * texture_tile + xi % texture_tile) * 3];
+        double weight = ((k & 1) ? fx : 1 - fx) * ((k >> 1) ? fy : 1 - fy);
+        sum += weight * vec3(t[0], t[1], t[2]);
+    }
+    return sum;
+}
+
+inline vec3 texture_cache::lookup(int id, double u, double v, double width) {
+    const texture_file* f = files[id].get();
+    double texels = width * std::max(f->width, f->height);
+    double lod = texels > 1 ? std::min(double(f->levels - 1), log2(texels)) : 0.0;
+    int level = int(lod);
+    double blend = lod - level;
+    vec3 c = bilinear(id, level, u, v);
+    if (blend > 0 && level + 1 < f->levels)
+        c = (1 - blend) * c + blend * bilinear(id, level + 1, u, v);
+    return c;
+}
+
+inline size_t texture_cache::bytes_resident() {
+    size_t total = 0;
+    for (int i = 0; i < shard_count; i++) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        total += shards[i].bytes;
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef THREADPOOLH
+#define THREADPOOLH
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+    Fixed set of worker threads. parallel_for hands out indices one at a
+    time from a shared counter, so uneven jobs (tiles with a torus, say)
+    balance themselves. The calling thread works too, as thread index 0.
+*/
+
+class thread_pool {
+    public:
+        // 0 means one thread per hardware thread
+        thread_pool(int threads = 0);
+        ~thread_pool();
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        // runs job(i, thread_index) for every i in [0, n) and waits for all of them
+        void parallel_for(int n, const std::function<void(int, int)>& job);
+        int size() const { return int(workers.size()) + 1; }
+
+    private:
+        void worker_loop(int thread_index);
+        void run_jobs(int thread_index);
+
+    private:
+        std::vector<std::thread> workers;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::condition_variable done;
+        const std::function<void(int, int)>* job;
+        int job_count;
+        std::atomic<int> next_index;
+        // workers that have finished the current generation
+        int finished;
+        unsigned generation;
+        bool stopping;
+        // parallel_for is not reentrant; this keeps concurrent callers apart
+        std::mutex submit_lock;
+};
+
+inline thread_pool::thread_pool(int threads)
+: job(0), job_count(0), next_index(0), finished(0), generation(0), stopping(false) {
+    if (threads <= 0)
+        threads = int(std::thread::hardware_concurrency());
+    if (threads <= 0)
+        threads = 1;
+    for (int i = 1; i < threads; i++)
+        workers.push_back(std::thread(&thread_pool::worker_loop, this, i));
+}
+
+inline thread_pool::~thread_pool() {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
+
+inline void thread_pool::run_jobs(int thread_index) {
+    for (;;) {
+        int i = next_index.fetch_add(1);
+        if (i >= job_count)
+            break;
+        (*job)(i, thread_index);
+    }
+}
+
+inline void thread_pool::worker_loop(int thread_index) {
+    unsigned seen = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [&] { return stopping || generation != seen; });
+            if (stopping)
+                return;
+            seen = generation;
+        }
+        run_jobs(thread_index);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            finished++;
+        }
+        done.notify_all();
+    }
+}
+
+inline void thread_pool::parallel_for(int n, const std::function<void(int, int)>& f) {
+    std::lock_guard<std::mutex> submit(submit_lock);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        job = &f;
+        job_count = n;
+        next_index = 0;
+        finished = 0;
+        generation++;
+    }
+    wake.notify_all();
+    run_jobs(0);
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&] { return finished == int(workers.size()); });
+}
+
+#endif
@@ -10,6 +10,7 @@ class torus: public hittable {
         torus(vec3 cen, vec3 n, double br, double sr, material* m) : 
         center(cen), normal(n), R1(br), R2(sr), mat_ptr(m) {}
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void compile(scene& s) const;
         
     public:
         vec3 center;
@@ -19,7 +20,8 @@ class torus: public hittable {
         material *mat_ptr;
 };
 
-bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Only finds t; the rest of the hit is filled in by torus_attributes.
+inline bool intersect_torus(double R1, double R2, const ray& r, double t_min, double t_max, double& t) {
     vec3 rD = r.direction();
     vec3 rO = r.origin();
 
@@ -51,18 +53,35 @@ bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const
     for (int c = 0; c < numRealRoots; ++c)
     { if(solutions[c] > 1.0e-4) { solutions[numPosRoots++] = solutions[c]; } }
     if (numPosRoots == 0) { return false; }
-    double t = solutions[0];
+    double closest = solutions[0];
     for (int c = 1; c < numPosRoots; c++)
-    { if(solutions[c] < t) { t = solutions[c]; } }
-    if (t < t_max && t > t_min) {
-        rec.t = t;
-        rec.p = r.point_at_parameter(rec.t);
-        double a = 1.0 - (R1 / sqrt(rec.p.x()*rec.p.x() + rec.p.y()*rec.p.y()));
-        rec.normal = unit_vector(vec3(a*rec.p.x(), a*rec.p.y(), rec.p.z()));
-        rec.mat_ptr = mat_ptr;
+    { if(solutions[c] < closest) { closest = solutions[c]; } }
+    if (closest < t_max && closest > t_min) {
+        t = closest;
         return true;
     }
     return false;
 }
 
+inline void torus_attributes(double R1, double R2, const ray& r, double t, hit_record& rec) {
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
+    double ring = sqrt(rec.p.x()*rec.p.x() + rec.p.y()*rec.p.y());
+    double a = 1.0 - (R1 / ring);
+    rec.normal = unit_vector(vec3(a*rec.p.x(), a*rec.p.y(), rec.p.z()));
+    // u goes around the axis, v around the tube
+    rec.u = 0.5 + atan2(rec.p.y(), rec.p.x()) / (2 * pi);
+    rec.v = 0.5 + atan2(rec.p.z(), ring - R1) / (2 * pi);
+    rec.uv_scale = 1 / (2 * pi * sqrt(R1 * R2));
+}
+
+bool torus::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t;
+    if (!intersect_torus(R1, R2, r, t_min, t_max, t))
+        return false;
+    torus_attributes(R1, R2, r, t, rec);
+    rec.mat_ptr = mat_ptr;
+    return true;
+}
+
 #endif
\ No newline at end of file
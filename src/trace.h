@@ -0,0 +1,196 @@
+#ifndef TRACEH
+#define TRACEH
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/*
+    Timeline of a render in the Chrome trace-event format, for
+    chrome://tracing or Perfetto. A trace_span records how long its scope
+    took. Each thread appends its spans to its own buffer, found through a
+    thread_local pointer like the stats blocks are, so recording takes no
+    lock. Until start() is called a span checks one flag and does nothing
+    else. Spans for other processes, such as the worker processes, are
+    added by the coordinator with add().
+*/
+
+struct trace_event {
+    const char* name;
+    const char* category;
+    // microseconds since start()
+    double start, duration;
+    int tid;
+    // "key": value pairs for the viewer, without braces
+    std::string args;
+};
+
+struct trace_buffer {
+    int tid;
+    std::vector<trace_event> events;
+};
+
+class trace_log {
+    public:
+        static trace_log& global() {
+            static trace_log t;
+            return t;
+        }
+
+        void start() {
+            epoch = std::chrono::steady_clock::now();
+            on.store(true, std::memory_order_relaxed);
+        }
+        bool enabled() const { return on.load(std::memory_order_relaxed); }
+        double now() const {
+            return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        trace_buffer* register_thread() {
+            std::lock_guard<std::mutex> guard(lock);
+            buffers.push_back(std::unique_ptr<trace_buffer>(new trace_buffer));
+            int tid = ++last_tid;
+            buffers.back()->tid = tid;
+            std::ostringstream name;
+            name << "thread " << tid;
+            names[tid] = name.str();
+            return buffers.back().get();
+        }
+        // a thread that exits hands its spans over and its buffer is freed
+        void release(trace_buffer* b) {
+            std::lock_guard<std::mutex> guard(lock);
+            external.insert(external.end(), b->events.begin(), b->events.end());
+            for (size_t i = 0; i < buffers.size(); i++)
+                if (buffers[i].get() == b) {
+                    buffers.erase(buffers.begin() + i);
+                    break;
+                }
+        }
+        // labels a track of the viewer; tid is a thread's or another process's id
+        void name_track(int tid, const std::string& name) {
+            std::lock_guard<std::mutex> guard(lock);
+            names[tid] = name;
+        }
+        // a span recorded somewhere else, e.g. by a worker process
+        void add(const trace_event& e) {
+            std::lock_guard<std::mutex> guard(lock);
+            external.push_back(e);
+        }
+
+        // writes every span so far; call it once the threads are idle
+        bool write(const std::string& path);
+
+    private:
+        trace_log() : on(false), last_tid(0) {}
+
+    private:
+        std::atomic<bool> on;
+        std::chrono::steady_clock::time_point epoch;
+        std::mutex lock;
+        std::vector<std::unique_ptr<trace_buffer> > buffers;
+        std::vector<trace_event> external;
+        std::map<int, std::string> names;
+        // buffers come and go with their threads; tids are never reused
+        int last_tid;
+};
+
+// released when the thread exits, like the stats blocks (stats.h)
+class local_trace_holder {
+    public:
+        local_trace_holder() : buffer(0) {}
+        ~local_trace_holder() {
+            if (buffer)
+                trace_log::global().release(buffer);
+        }
+        local_trace_holder(const local_trace_holder&) = delete;
+        local_trace_holder& operator=(const local_trace_holder&) = delete;
+
+        trace_buffer* buffer;
+};
+
+inline trace_buffer& local_trace() {
+    thread_local local_trace_holder h;
+    if (!h.buffer)
+        h.buffer = trace_log::global().register_thread();
+    return *h.buffer;
+}
+
+// names the calling thread's track
+inline void trace_thread_name(const std::string& name) {
+    if (trace_log::global().enabled())
+        trace_log::global().name_track(local_trace().tid, name);
+}
+
+class trace_span {
+    public:
+        trace_span(const char* name, const char* category) : active(trace_log::global().enabled()) {
+            if (!active)
+                return;
+            e.name = name;
+            e.category = category;
+            e.start = trace_log::global().now();
+        }
+        ~trace_span() {
+            if (!active)
+                return;
+            e.duration = trace_log::global().now() - e.start;
+            trace_buffer& b = local_trace();
+            e.tid = b.tid;
+            b.events.push_back(e);
+        }
+        trace_span(const trace_span&) = delete;
+        trace_span& operator=(const trace_span&) = delete;
+
+        // shown with the span in the viewer
+        void arg(const char* key, double value) {
+            if (!active)
+                return;
+            std::ostringstream out;
+            out << (e.args.empty() ? "" : ", ") << '"' << key << "\": " << value;
+            e.args += out.str();
+        }
+
+    private:
+        bool active;
+        trace_event e;
+};
+
+inline bool trace_log::write(const std::string& path) {
+    std::lock_guard<std::mutex> guard(lock);
+    std::string partial = path + ".partial";
+    {
+        std::ofstream out(partial.c_str());
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (std::map<int, std::string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+            out << (first ? "" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+                << it->first << ", \"args\": {\"name\": \"" << it->second << "\"}}";
+            first = false;
+        }
+        char number[64];
+        for (size_t b = 0; b <= buffers.size(); b++) {
+            const std::vector<trace_event>& events = b < buffers.size() ? buffers[b]->events : external;
+            for (size_t i = 0; i < events.size(); i++) {
+                const trace_event& e = events[i];
+                std::snprintf(number, sizeof(number), "\"ts\": %.3f, \"dur\": %.3f", e.start, e.duration);
+                out << (first ? "" : ",\n") << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                    << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.tid << ", " << number
+                    << ", \"args\": {" << e.args << "}}";
+                first = false;
+            }
+        }
+        out << "\n]}\n";
+        if (!out.flush())
+            return false;
+    }
+    return std::rename(partial.c_str(), path.c_str()) == 0;
+}
+
+#endif
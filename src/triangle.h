@@ -5,21 +5,29 @@
 
 class triangle: public hittable {
     public:
-        triangle() {}
-        triangle(vec3& c1, vec3& c2, vec3& c3, material* m) : p1(c1), p2(c2), p3(c3), mat_ptr(m) { normal = cross((p1 - p2), (p3 - p2)); };
-        triangle(vec3& c1, vec3& c2, vec3& c3, vec3& n, material* m) : p1(c1), p2(c2), p3(c3), normal(n), mat_ptr(m) {};
+        triangle() : t1(0,0,0), t2(1,0,0), t3(0,1,0) {}
+        triangle(const vec3& c1, const vec3& c2, const vec3& c3, material* m)
+        : p1(c1), p2(c2), p3(c3), t1(0,0,0), t2(1,0,0), t3(0,1,0), mat_ptr(m) { normal = cross((p1 - p2), (p3 - p2)); };
+        triangle(const vec3& c1, const vec3& c2, const vec3& c3, const vec3& n, material* m)
+        : p1(c1), p2(c2), p3(c3), normal(n), t1(0,0,0), t2(1,0,0), t3(0,1,0), mat_ptr(m) {};
         virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const;
+        virtual void compile(scene& s) const;
         
     public:
         vec3 p1, p2, p3, normal;
+        // texture coordinates of the corners in x and y
+        vec3 t1, t2, t3;
         material *mat_ptr;
 };
 
-bool in_zero_one(double x) {
+inline bool in_zero_one(double x) {
     return (x >= 0 && x <= 1);
 }
 
-bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+// Finds t and the barycentric weights (u, v) of p2 and p3; the rest of
+// the hit is filled in by triangle_attributes.
+inline bool intersect_triangle(const vec3& p1, const vec3& p2, const vec3& p3, const vec3& normal,
+                               const ray& r, double t_min, double t_max, double& t, double& u, double& v) {
     vec3 w = p1 - r.origin();
     double a = dot(w, normal);
     double b = dot(r.direction(), normal);
@@ -46,9 +54,39 @@ bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     }
     if ((alpha + beta + gamma) > 1.001) { return false; }
 
-    rec.t = k;
-    rec.p = i;
+    t = k;
+    u = beta;
+    v = gamma;
+    return true;
+}
+
+inline void triangle_attributes(const vec3& normal, const ray& r, double t, hit_record& rec) {
+    rec.t = t;
+    rec.p = r.point_at_parameter(t);
     rec.normal = normal;
+}
+
+// texture coordinates at barycentrics (u, v), from those of the corners
+inline void triangle_texcoords(const vec3& t1, const vec3& t2, const vec3& t3, double uv_scale, double u, double v, hit_record& rec) {
+    vec3 uv = (1 - u - v) * t1 + u * t2 + v * t3;
+    rec.u = uv.x();
+    rec.v = uv.y();
+    rec.uv_scale = uv_scale;
+}
+
+// texture units per unit of distance across the triangle
+inline double triangle_uv_scale(const vec3& p1, const vec3& p2, const vec3& p3, const vec3& t1, const vec3& t2, const vec3& t3) {
+    double area = cross(p2 - p1, p3 - p1).length();
+    double uv_area = fabs(cross(t2 - t1, t3 - t1).z());
+    return area > 0 ? sqrt(uv_area / area) : 0.0;
+}
+
+bool triangle::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, u, v;
+    if (!intersect_triangle(p1, p2, p3, normal, r, t_min, t_max, t, u, v))
+        return false;
+    triangle_attributes(normal, r, t, rec);
+    triangle_texcoords(t1, t2, t3, triangle_uv_scale(p1, p2, p3, t1, t2, t3), u, v, rec);
     rec.mat_ptr = mat_ptr;
     return true;
 }
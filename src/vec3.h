@@ -4,8 +4,11 @@
 #include <cmath>
 #include <iostream>
 #include <random>
+#include <algorithm>
 
 
+const double pi = 3.1415926535897932385;
+
 inline double random_double() {
     return rand() / (RAND_MAX + 1.0);
 }
@@ -120,16 +123,49 @@ inline vec3 cross(const vec3 &u, const vec3 &v) {
                 u.e[0] * v.e[1] - u.e[1] * v.e[0]);
 }
 
+inline double luminance(const vec3& c) {
+    return 0.2126*c[0] + 0.7152*c[1] + 0.0722*c[2];
+}
+
 vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2*dot(v,n) * n;
 }
 
+// Direct mappings from uniform numbers in [0,1) to common domains. Unlike
+// rejection sampling they use a fixed amount of input and keep the
+// stratification of whatever sequence feeds them.
+
+inline vec3 map_to_disk(double u, double v) {
+    double r = sqrt(u);
+    double phi = 2*pi*v;
+    return vec3(r*cos(phi), r*sin(phi), 0);
+}
+
+inline vec3 map_to_sphere(double u, double v) {
+    double z = 1 - 2*u;
+    double r = sqrt(std::max(0.0, 1 - z*z));
+    double phi = 2*pi*v;
+    return vec3(r*cos(phi), r*sin(phi), z);
+}
+
+inline vec3 map_to_ball(double u, double v, double w) {
+    return cbrt(w) * map_to_sphere(u, v);
+}
+
+// cosine-weighted around +z
+inline vec3 map_to_hemisphere(double u, double v) {
+    vec3 d = map_to_disk(u, v);
+    return vec3(d.x(), d.y(), sqrt(std::max(0.0, 1 - u)));
+}
+
+// t and b complete the unit vector n to an orthonormal basis
+inline void make_basis(const vec3& n, vec3& t, vec3& b) {
+    t = unit_vector(cross(fabs(n.x()) > 0.9 ? vec3(0,1,0) : vec3(1,0,0), n));
+    b = cross(n, t);
+}
+
 vec3 random_in_unit_sphere() {
-    vec3 p;
-    do {
-        p = 2.0*vec3(random_double(), random_double(), random_double()) - vec3(1,1,1);
-    } while (p.squared_length() >= 1.0);
-    return p;
+    return map_to_ball(random_double(), random_double(), random_double());
 }
 
 bool refract(const vec3& v, const vec3& n, double ni_over_nt, vec3& refracted) {